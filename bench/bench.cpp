@@ -0,0 +1,511 @@
+/*
+ * bench.cpp Micro and end-to-end benchmarks of the conversion hot paths
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <argparse/argparse.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "Converter.h"
+#include "FEX2CFG.h"
+#include "GenIMG.h"
+#include "fixture.h"
+
+extern "C" {
+#include "OpenixIMG.h"
+#include "bench_genimage.h"
+}
+
+namespace fs = std::filesystem;
+
+// the cipher and checksum loops always run over this much, so their numbers
+// do not depend on --size
+constexpr size_t MICRO_SIZE = 16 * 1024 * 1024;
+
+struct Options {
+    std::string filter;
+    double min_time = 1.0;
+    size_t min_iterations = 3;
+    uint64_t size = 64 * 1024 * 1024;
+    fs::path work_dir;
+};
+
+struct Benchmark {
+    std::string name;
+    uint64_t bytes = 0;                 // processed per iteration
+    std::function<bool()> setup;        // once, untimed
+    std::function<void()> reset;        // before every iteration, untimed
+    std::function<bool()> run;
+};
+
+struct Result {
+    std::string name;
+    uint64_t bytes = 0;
+    size_t iterations = 0;
+    double median_ns = 0;
+    double min_ns = 0;
+    double mean_ns = 0;
+
+    [[nodiscard]] double mb_per_s() const {
+        return bytes != 0 && median_ns > 0 ? static_cast<double>(bytes) * 1e3 / median_ns : 0;
+    }
+};
+
+// keeps the checksum alive so the loop is not optimized away
+static volatile uint32_t crc_sink;
+
+static bool write_file(const fs::path &path, const void *data, size_t len) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(static_cast<const char *>(data), static_cast<std::streamsize>(len));
+    return static_cast<bool>(out);
+}
+
+// like an ext4 image: data blocks with holes in between
+static bool write_sparse_file(const fs::path &path, uint64_t size) {
+    auto block = make_payload(PAYLOAD_BLOCK, Payload::random, size);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+    for (uint64_t pos = 0; ok && pos < size; pos += 4 * PAYLOAD_BLOCK) {
+        auto len = std::min<uint64_t>(PAYLOAD_BLOCK, size - pos);
+        ok = pwrite(fd, block.data(), len, static_cast<off_t>(pos)) == static_cast<ssize_t>(len);
+    }
+    close(fd);
+    return ok;
+}
+
+// Build an encrypted v3 image from in-memory items
+static bool make_image(const fs::path &path, const std::vector<std::pair<std::string, std::vector<uint8_t>>> &items) {
+    imagewty_ids ids = {0x100234, 0x1234, 0x8743, 0x100, 0x100};
+    std::vector<pack_source> sources;
+    for (auto &[filename, data]: items) {
+        auto common = filename == "sys_partition.fex";
+        sources.push_back({filename.c_str(), common ? "COMMON  " : "RFSFAT16",
+                           common ? "SYS_CONFIG000000" : "BENCH_FEX0000000", data.data(), -1, 0, data.size(), 0});
+    }
+    return pack_imagewty_sources(sources.data(), sources.size(), &ids, path.c_str()) == 0;
+}
+
+// The code under test logs to stdout, keep that out of the results
+class Quiet {
+public:
+    Quiet() {
+        std::cout.flush();
+        std::fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+
+    ~Quiet() {
+        std::cout.flush();
+        std::fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+
+private:
+    int saved;
+};
+
+static std::vector<Benchmark> make_benchmarks(const Options &opt) {
+    std::vector<Benchmark> benchmarks;
+    auto dir = opt.work_dir;
+    auto size = opt.size;
+
+    // a shared encrypted buffer, the ciphers decrypt it in place again and again
+    auto micro = std::make_shared<std::vector<uint8_t>>();
+    auto micro_setup = [micro]() {
+        if (micro->empty()) {
+            *micro = make_payload(MICRO_SIZE, Payload::random, 1);
+        }
+        return true;
+    };
+
+    auto rc6 = std::make_shared<rc6_ctx_t>();
+    benchmarks.push_back({"rc6_dec", MICRO_SIZE, [micro_setup, rc6]() {
+        char key[32];
+        std::memset(key, 2, sizeof(key));
+        key[sizeof(key) - 1] = 'g';
+        return micro_setup() && rc6_init(key, sizeof(key) * 8, rc6.get()) == 0;
+    }, nullptr, [micro, rc6]() {
+        for (size_t i = 0; i < micro->size(); i += 16) {
+            rc6_dec(micro->data() + i, rc6.get());
+        }
+        return true;
+    }});
+
+    auto tf = std::make_shared<tf_ctx_t>();
+    benchmarks.push_back({"tf_decrypt_blocks", MICRO_SIZE, [micro_setup, tf]() {
+        u4byte key[8] = {5, 4, 9, 13, 22, 35, 57, 92};
+        tf_set_key(key, 256, tf.get());
+        return micro_setup();
+    }, nullptr, [micro, tf]() {
+        tf_decrypt_blocks(tf.get(), micro->data(), micro->size());
+        return true;
+    }});
+
+    benchmarks.push_back({"crc32_next", MICRO_SIZE, micro_setup, nullptr, [micro]() {
+        crc_sink = crc32_next(micro->data(), micro->size(), 0);
+        return true;
+    }});
+
+    // classify_fex() and parse_fex() only run from the FEX2CFG constructor,
+    // which also reads the file and generates the genimage cfg
+    auto fex_dir = dir / "fex";
+    benchmarks.push_back({"fex2cfg_parse", 0, [fex_dir]() {
+        std::vector<std::pair<std::string, uint64_t>> partitions;
+        for (auto name: {"boot-resource", "env", "env-redund", "boot", "dsp0", "recovery", "misc", "private",
+                         "rootfs", "rootfs_data", "vendor", "media_data", "UDISK"}) {
+            partitions.emplace_back(name, 32 * 1024 * 1024);
+        }
+        auto fex = sys_partition_fex(partitions);
+        fs::create_directories(fex_dir);
+        return write_file(fex_dir / "sys_partition.fex", fex.data(), fex.size());
+    }, nullptr, [fex_dir]() {
+        FEX2CFG fex2Cfg(fex_dir.string());
+        return !fex2Cfg.get_cfg().empty();
+    }});
+
+    auto insert_in = dir / "insert.raw";
+    auto insert_out = dir / "insert.img";
+    benchmarks.push_back({"insert_image", size, [insert_in, size]() {
+        return write_sparse_file(insert_in, size);
+    }, nullptr, [insert_in, insert_out, size]() {
+        return bench_insert_image(insert_out.c_str(), insert_in.c_str(), size, 0x100000) == 0;
+    }});
+
+    // android_sparse_generate() is only reachable through an android-sparse image
+    auto sparse_dir = dir / "sparse";
+    benchmarks.push_back({"android_sparse_generate", size, [sparse_dir, size]() {
+        std::string cfg = "image bench.simg {\n"
+                          "\tandroid-sparse {\n"
+                          "\t\timage = \"sparse.raw\"\n"
+                          "\t}\n"
+                          "}\n";
+        fs::create_directories(sparse_dir);
+        return write_sparse_file(sparse_dir / "sparse.raw", size) &&
+               write_file(sparse_dir / "sparse.cfg", cfg.data(), cfg.size());
+    }, nullptr, [sparse_dir]() {
+        GenIMG genimage((sparse_dir / "sparse.cfg").string(), sparse_dir.string(), sparse_dir.string());
+        return genimage.get_status() == 0;
+    }});
+
+    auto unpack_img = dir / "unpack.img";
+    auto unpack_out = dir / "unpack.img.dump";
+    benchmarks.push_back({"unpack_image", size, [unpack_img, size]() {
+        std::vector<std::pair<std::string, std::vector<uint8_t>>> items;
+        items.emplace_back("zeros.fex", make_payload(size / 4, Payload::zeros, 0));
+        items.emplace_back("random.fex", make_payload(size / 4, Payload::random, 2));
+        items.emplace_back("compressible.fex", make_payload(size / 2, Payload::compressible, 3));
+        return make_image(unpack_img, items);
+    }, [unpack_out]() {
+        fs::remove_all(unpack_out);
+    }, [unpack_img, unpack_out]() {
+        return unpack_image(unpack_img.c_str(), unpack_out.c_str(), 1) == 0;
+    }});
+
+    // the whole -d conversion: unpack, FEX2CFG and genimage. The warm-up and
+    // every timed run convert in this one process, as an embedding program would
+    auto dump_img = dir / "dump.img";
+    benchmarks.push_back({"dump", size, [dump_img, size]() {
+        FixtureSpec spec;
+        spec.size = size;
+        return make_fixture(dump_img.string(), spec) == 0;
+    }, [dump_img]() {
+        fs::remove_all(dump_img.string() + ".dump");
+        fs::remove_all(dump_img.string() + ".dump.out");
+    }, [dump_img]() {
+        try {
+            auto result = openixcard::Converter().dump(dump_img.string());
+            return fs::is_directory(result.output) && !fs::is_empty(result.output);
+        } catch (const std::exception &) {
+            return false;
+        }
+    }});
+
+    return benchmarks;
+}
+
+static bool measure(const Benchmark &benchmark, const Options &opt, Result &result) {
+    using clock = std::chrono::steady_clock;
+    std::vector<double> samples;
+    double total = 0;
+
+    result.name = benchmark.name;
+    result.bytes = benchmark.bytes;
+
+    Quiet quiet;
+    if (benchmark.setup && !benchmark.setup()) {
+        return false;
+    }
+    // an untimed warm-up run fills the page cache and the buffer pool
+    for (bool warm_up = true; warm_up || samples.size() < opt.min_iterations || total < opt.min_time * 1e9;
+         warm_up = false) {
+        if (benchmark.reset) {
+            benchmark.reset();
+        }
+        auto start = clock::now();
+        if (!benchmark.run()) {
+            return false;
+        }
+        auto ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        if (!warm_up) {
+            samples.push_back(ns);
+            total += ns;
+        }
+    }
+    if (benchmark.reset) {
+        benchmark.reset();
+    }
+
+    std::sort(samples.begin(), samples.end());
+    auto n = samples.size();
+    result.iterations = n;
+    result.median_ns = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    result.min_ns = samples.front();
+    result.mean_ns = total / static_cast<double>(n);
+    return true;
+}
+
+static std::string format_ns(double ns) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2);
+    if (ns >= 1e9) {
+        out << ns / 1e9 << " s";
+    } else if (ns >= 1e6) {
+        out << ns / 1e6 << " ms";
+    } else {
+        out << ns / 1e3 << " us";
+    }
+    return out.str();
+}
+
+// one benchmark per line, so a baseline can be read back without a JSON parser
+static bool write_json(const fs::path &path, const std::vector<Result> &results, const Options &opt) {
+    std::ofstream out(path);
+    out << std::fixed << std::setprecision(1);
+    out << "{\n"
+           "  \"version\": 1,\n"
+           "  \"commit\": \"" << PROJECT_GIT_HASH << "\",\n"
+           "  \"size\": " << opt.size << ",\n"
+           "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto &r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+            << ", \"bytes\": " << r.bytes << ", \"median_ns\": " << r.median_ns
+            << ", \"min_ns\": " << r.min_ns << ", \"mean_ns\": " << r.mean_ns
+            << ", \"mb_per_s\": " << r.mb_per_s() << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n"
+           "}\n";
+    return static_cast<bool>(out);
+}
+
+struct BaselineEntry {
+    double median_ns = 0;
+    uint64_t bytes = 0;
+};
+
+static std::map<std::string, BaselineEntry> read_baseline(const fs::path &path) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        throw std::runtime_error("Fail to open file: " + path.string() + ".");
+    }
+    std::map<std::string, BaselineEntry> baseline;
+    for (std::string line; std::getline(in, line);) {
+        auto name = line.find("\"name\": \"");
+        auto bytes = line.find("\"bytes\": ");
+        auto median = line.find("\"median_ns\": ");
+        if (name == std::string::npos || bytes == std::string::npos || median == std::string::npos) {
+            continue;
+        }
+        name += 9;
+        auto &entry = baseline[line.substr(name, line.find('"', name) - name)];
+        entry.bytes = std::strtoull(line.c_str() + bytes + 9, nullptr, 10);
+        entry.median_ns = std::strtod(line.c_str() + median + 13, nullptr);
+    }
+    return baseline;
+}
+
+// Returns the number of benchmarks slower than the baseline by more than threshold percent
+static int compare_baseline(const std::vector<Result> &results, const std::map<std::string, BaselineEntry> &baseline,
+                            double threshold) {
+    int regressions = 0;
+    std::cout << "\n" << std::left << std::setw(26) << "BENCHMARK" << std::right << std::setw(14) << "BASELINE"
+              << std::setw(14) << "CURRENT" << std::setw(10) << "CHANGE" << std::endl;
+    for (auto &r: results) {
+        std::cout << std::left << std::setw(26) << r.name << std::right;
+        auto it = baseline.find(r.name);
+        if (it == baseline.end() || it->second.median_ns <= 0) {
+            std::cout << std::setw(14) << "-" << std::setw(14) << format_ns(r.median_ns) << std::setw(10) << "new"
+                      << std::endl;
+            continue;
+        }
+        auto &base = it->second;
+        if (base.bytes != r.bytes) {
+            // run with another --size, the times do not compare
+            std::cout << std::setw(14) << format_ns(base.median_ns) << std::setw(14) << format_ns(r.median_ns)
+                      << std::setw(10) << "size" << std::endl;
+            continue;
+        }
+        auto change = (r.median_ns - base.median_ns) * 100 / base.median_ns;
+        std::ostringstream delta;
+        delta << std::showpos << std::fixed << std::setprecision(1) << change << "%";
+        std::cout << std::setw(14) << format_ns(base.median_ns) << std::setw(14) << format_ns(r.median_ns)
+                  << std::setw(10) << delta.str();
+        if (change > threshold) {
+            std::cout << "  REGRESSION";
+            regressions++;
+        }
+        std::cout << std::endl;
+    }
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    argparse::ArgumentParser parser("OpenixBench", PROJECT_GIT_HASH);
+    parser.add_argument("--filter")
+            .help("Only run the benchmarks whose name contains this")
+            .default_value(std::string(""));
+    parser.add_argument("--list")
+            .help("List the benchmarks and exit")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--json")
+            .help("Write the results as JSON to this file")
+            .default_value(std::string(""));
+    parser.add_argument("--baseline")
+            .help("Compare the results with the JSON of a previous run, exit with 2 on regressions")
+            .default_value(std::string(""));
+    parser.add_argument("--threshold")
+            .help("Slowdown in percent that counts as a regression")
+            .default_value(std::string("10"));
+    parser.add_argument("--min-time")
+            .help("Minimum time in seconds to run each benchmark for")
+            .default_value(std::string("1"));
+    parser.add_argument("--size")
+            .help("Size in MiB of the synthetic images and partitions")
+            .default_value(std::string("64"));
+    parser.add_argument("--work-dir")
+            .help("Directory for the synthetic data")
+            .default_value(fs::temp_directory_path().string());
+    parser.add_epilog(
+            "\r\neg.:\r\nOpenixBench --json bench.json          - Run all benchmarks and save the results"
+            "\r\nOpenixBench --baseline bench.json      - Run again and compare with the saved results"
+            "\r\nOpenixBench --filter rc6 --min-time 5  - Run only the RC6 benchmark, for longer"
+            "\r\n");
+
+    Options opt;
+    double threshold;
+    try {
+        parser.parse_args(argc, argv);
+        opt.filter = parser.get<std::string>("filter");
+        opt.min_time = std::stod(parser.get<std::string>("min-time"));
+        opt.size = std::stoull(parser.get<std::string>("size")) * 1024 * 1024;
+        threshold = std::stod(parser.get<std::string>("threshold"));
+    } catch (const std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+    if (opt.size == 0) {
+        std::cerr << "invalid size" << std::endl;
+        return 1;
+    }
+
+    std::map<std::string, BaselineEntry> baseline;
+    auto baseline_path = parser.get<std::string>("baseline");
+    try {
+        if (!baseline_path.empty()) {
+            baseline = read_baseline(baseline_path);
+        }
+    } catch (const std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+        return 1;
+    }
+
+    auto work_dir = (fs::path(parser.get<std::string>("work-dir")) / "OpenixBench-XXXXXX").string();
+    if (!parser.get<bool>("list") && mkdtemp(work_dir.data()) == nullptr) {
+        std::cerr << "Fail to create " << work_dir << std::endl;
+        return 1;
+    }
+    opt.work_dir = work_dir;
+
+    crypto_init();
+    auto benchmarks = make_benchmarks(opt);
+    if (parser.get<bool>("list")) {
+        for (auto &benchmark: benchmarks) {
+            std::cout << benchmark.name << std::endl;
+        }
+        return 0;
+    }
+
+    std::vector<Result> results;
+    int failed = 0;
+    std::cout << std::left << std::setw(26) << "BENCHMARK" << std::right << std::setw(8) << "RUNS"
+              << std::setw(14) << "MEDIAN" << std::setw(14) << "MIN" << std::setw(12) << "MB/S" << std::endl;
+    for (auto &benchmark: benchmarks) {
+        if (benchmark.name.find(opt.filter) == std::string::npos) {
+            continue;
+        }
+        Result result;
+        std::cout << std::left << std::setw(26) << benchmark.name << std::right << std::flush;
+        if (!measure(benchmark, opt, result)) {
+            std::cout << "  FAILED" << std::endl;
+            failed++;
+            continue;
+        }
+        std::ostringstream mb_per_s;
+        if (result.bytes != 0) {
+            mb_per_s << std::fixed << std::setprecision(1) << result.mb_per_s();
+        } else {
+            mb_per_s << "-";
+        }
+        std::cout << std::setw(8) << result.iterations << std::setw(14) << format_ns(result.median_ns)
+                  << std::setw(14) << format_ns(result.min_ns) << std::setw(12) << mb_per_s.str() << std::endl;
+        results.emplace_back(result);
+    }
+    std::error_code ec;
+    fs::remove_all(opt.work_dir, ec);
+
+    auto json_path = parser.get<std::string>("json");
+    if (!json_path.empty() && !write_json(json_path, results, opt)) {
+        std::cerr << "Fail to write " << json_path << std::endl;
+        return 1;
+    }
+    if (failed) {
+        return 1;
+    }
+    if (!baseline_path.empty() && compare_baseline(results, baseline, threshold) > 0) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * bench_genimage.c genimage internals for the benchmarks
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <string.h>
+#include <sys/types.h>
+
+#include "genimage.h"
+#include "bench_genimage.h"
+
+int bench_insert_image(const char *outfile, const char *infile,
+                       unsigned long long size, unsigned long long offset) {
+    struct image image, sub;
+
+    /* insert_image() only needs the output file names of both */
+    memset(&image, 0, sizeof(image));
+    memset(&sub, 0, sizeof(sub));
+    image.file = image.outfile = (char *) outfile;
+    sub.file = sub.outfile = (char *) infile;
+    INIT_LIST_HEAD(&image.partitions);
+    INIT_LIST_HEAD(&sub.partitions);
+
+    return insert_image(&image, &sub, size, offset, 0);
+}
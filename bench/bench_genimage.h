@@ -0,0 +1,27 @@
+/*
+ * bench_genimage.h genimage internals for the benchmarks
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXCARD_BENCH_GENIMAGE_H
+#define OPENIXCARD_BENCH_GENIMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32_next(const void *data, size_t len, uint32_t last_crc);
+
+/*
+ * Copy size bytes of infile to offset in outfile through insert_image(),
+ * the way hdimage places a partition. Returns 0 or -errno.
+ */
+int bench_insert_image(const char *outfile, const char *infile,
+                       unsigned long long size, unsigned long long offset);
+
+#endif //OPENIXCARD_BENCH_GENIMAGE_H
@@ -0,0 +1,195 @@
+/*
+ * fixture.cpp Synthetic IMAGEWTY images for benchmarks and tests
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fixture.h"
+
+extern "C" {
+#include "OpenixIMG.h"
+}
+
+// the scratch file with the partition data is written in pieces of this
+constexpr size_t SCRATCH_CHUNK = 16 * PAYLOAD_BLOCK;
+
+// partitions of a Tina or Linux BSP, in the order they are usually listed
+static const char *const PARTITION_NAMES[] = {
+        "boot-resource", "env", "env-redund", "boot", "rootfs", "recovery",
+        "misc", "private", "rootfs_data", "vendor", "dsp0", "media_data",
+};
+
+bool parse_payload(const std::string &name, Payload &payload) {
+    if (name == "zeros") {
+        payload = Payload::zeros;
+    } else if (name == "random") {
+        payload = Payload::random;
+    } else if (name == "compressible") {
+        payload = Payload::compressible;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void fill_random(uint8_t *p, size_t len, uint64_t seed) {
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (size_t i = 0; i < len; i += 8) {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        auto v = x * 0x2545F4914F6CDD1DULL;
+        std::memcpy(p + i, &v, std::min<size_t>(8, len - i));
+    }
+}
+
+void fill_payload(uint8_t *p, size_t len, Payload payload, uint64_t seed, uint64_t pos) {
+    // every PAYLOAD_BLOCK of the stream has its own seed
+    for (size_t off = 0; off < len;) {
+        auto block = (pos + off) / PAYLOAD_BLOCK;
+        auto n = std::min<size_t>(len - off, (block + 1) * PAYLOAD_BLOCK - (pos + off));
+        if (payload == Payload::random || (payload == Payload::compressible && block % 2 == 0)) {
+            // a block cut in two continues with the bytes of the second half
+            auto skip = (pos + off) % PAYLOAD_BLOCK;
+            if (skip == 0) {
+                fill_random(p + off, n, seed + block);
+            } else {
+                std::vector<uint8_t> whole(PAYLOAD_BLOCK);
+                fill_random(whole.data(), PAYLOAD_BLOCK, seed + block);
+                std::memcpy(p + off, whole.data() + skip, n);
+            }
+        } else {
+            std::memset(p + off, 0, n);
+        }
+        off += n;
+    }
+}
+
+std::vector<uint8_t> make_payload(size_t len, Payload payload, uint64_t seed) {
+    std::vector<uint8_t> data(len);
+    fill_payload(data.data(), len, payload, seed, 0);
+    return data;
+}
+
+std::string sys_partition_fex(const std::vector<std::pair<std::string, uint64_t>> &partitions) {
+    std::ostringstream fex;
+    fex << ";---------------------------------------------------------------------------------------------------------\n"
+           "; partition table of a synthetic image\n"
+           "; size in sectors of 512 bytes, downloadfile is the item of the image\n"
+           ";---------------------------------------------------------------------------------------------------------\n"
+           "[mbr]\n"
+           "size = 16384\n"
+           "\n"
+           "[partition_start]\n";
+    for (auto &[name, size]: partitions) {
+        fex << "\n[partition]\n"
+               "    name         = " << name << "\n";
+        if (name == "UDISK") {
+            fex << "    user_type    = 0x8100\n";
+            continue;
+        }
+        fex << "    size         = " << size / 512 << "\n"
+               "    downloadfile = \"" << name << ".fex\"\n"
+               "    user_type    = 0x8000\n";
+    }
+    return fex.str();
+}
+
+// Put the payload of all partition items into fd, zeros are left as a hole
+static bool write_scratch(int fd, const FixtureSpec &spec) {
+    if (ftruncate(fd, static_cast<off_t>(spec.size)) != 0) {
+        return false;
+    }
+    if (spec.payload == Payload::zeros) {
+        return true;
+    }
+    std::vector<uint8_t> buf(SCRATCH_CHUNK);
+    for (uint64_t pos = 0; pos < spec.size; pos += SCRATCH_CHUNK) {
+        auto len = static_cast<size_t>(std::min<uint64_t>(SCRATCH_CHUNK, spec.size - pos));
+        fill_payload(buf.data(), len, spec.payload, spec.seed, pos);
+        if (pwrite(fd, buf.data(), len, static_cast<off_t>(pos)) != static_cast<ssize_t>(len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int make_fixture(const std::string &path, const FixtureSpec &spec) {
+    if (spec.items == 0 || set_pack_format(spec.header_version, spec.encrypt) != 0) {
+        return 5;
+    }
+
+    // the partition data is streamed from an unlinked scratch file, so any
+    // size fits as long as the disk does
+    auto scratch = path + ".XXXXXX";
+    int fd = mkstemp(scratch.data());
+    if (fd < 0) {
+        set_pack_format(0x0300, 1);
+        return 2;
+    }
+    unlink(scratch.c_str());
+    if (!write_scratch(fd, spec)) {
+        close(fd);
+        set_pack_format(0x0300, 1);
+        return 6;
+    }
+
+    // the defaults of the vendor image.cfg
+    imagewty_ids ids = {0x100234, 0x1234, 0x8743, 0x100, 0x100};
+    std::vector<std::string> names;
+    std::vector<std::pair<std::string, uint64_t>> partitions;
+    std::vector<uint64_t> lengths;
+    for (size_t i = 0; i < spec.items; i++) {
+        auto name = i < std::size(PARTITION_NAMES) ? std::string(PARTITION_NAMES[i]) : "part" + std::to_string(i);
+        // the last item takes what does not divide evenly
+        auto length = spec.size / spec.items + (i + 1 == spec.items ? spec.size % spec.items : 0);
+        // partitions are sized in whole MiB, like in a BSP
+        partitions.emplace_back(name, (length | 0xFFFFF) + 1);
+        lengths.push_back(length);
+    }
+    partitions.emplace_back("UDISK", 0);
+    auto fex = sys_partition_fex(partitions);
+    auto boot0 = make_payload(32 * 1024, Payload::random, spec.seed ^ 0xB0);
+    auto boot_package = make_payload(1024 * 1024, Payload::random, spec.seed ^ 0xB1);
+
+    // the names have to outlive sources
+    names.reserve(spec.items * 2);
+    std::vector<pack_source> sources;
+    sources.push_back({"sys_partition.fex", "COMMON  ", "SYS_CONFIG000000", fex.data(), -1, 0, fex.size(), 0});
+    sources.push_back({"boot0_sdcard.fex", "12345678", "1234567890BOOT_0", boot0.data(), -1, 0, boot0.size(), 0});
+    sources.push_back({"boot_package.fex", "12345678", "BOOTPKG-00000000", boot_package.data(), -1, 0,
+                       boot_package.size(), 0});
+    uint64_t offset = 0;
+    for (size_t i = 0; i < spec.items; i++) {
+        // eg. BOOT-RESOURCE_FE, ROOTFS_FEX000000
+        std::string subtype = partitions[i].first + "_FEX";
+        std::transform(subtype.begin(), subtype.end(), subtype.begin(), ::toupper);
+        subtype.resize(IMAGEWTY_FHDR_SUBTYPE_LEN, '0');
+
+        names.emplace_back(partitions[i].first + ".fex");
+        auto &filename = names.back();
+        names.emplace_back(subtype);
+        sources.push_back({filename.c_str(), "RFSFAT16", names.back().c_str(), nullptr, fd, offset, lengths[i], 0});
+        offset += lengths[i];
+    }
+
+    auto ret = pack_imagewty_sources(sources.data(), sources.size(), &ids, path.c_str());
+    close(fd);
+    set_pack_format(0x0300, 1);
+    return ret;
+}
@@ -0,0 +1,60 @@
+/*
+ * fixture.h Synthetic IMAGEWTY images for benchmarks and tests
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXCARD_FIXTURE_H
+#define OPENIXCARD_FIXTURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// data sets are made of these, alternating random and zero for "compressible"
+constexpr size_t PAYLOAD_BLOCK = 64 * 1024;
+
+enum class Payload {
+    zeros,
+    random,
+    compressible,   // half random, half zeros, like a filled up file system
+};
+
+// "zeros", "random" or "compressible", false for anything else
+bool parse_payload(const std::string &name, Payload &payload);
+
+// xorshift64*, the same seed gives the same data on every machine
+void fill_random(uint8_t *p, size_t len, uint64_t seed);
+
+// The bytes at pos of a payload stream, the same however the stream is cut
+void fill_payload(uint8_t *p, size_t len, Payload payload, uint64_t seed, uint64_t pos);
+
+std::vector<uint8_t> make_payload(size_t len, Payload payload, uint64_t seed);
+
+// a sys_partition.fex as the Tina and Linux BSPs write it, sizes in bytes
+std::string sys_partition_fex(const std::vector<std::pair<std::string, uint64_t>> &partitions);
+
+struct FixtureSpec {
+    uint32_t header_version = 0x0300;
+    bool encrypt = true;
+    uint64_t size = 64 * 1024 * 1024;   // all partition items together
+    size_t items = 4;                   // partition items, next to boot0, boot package and sys_partition.fex
+    Payload payload = Payload::compressible;
+    uint64_t seed = 1;
+};
+
+// Write a firmware like image to path: boot0_sdcard.fex, boot_package.fex,
+// a sys_partition.fex listing the partitions and one item per partition,
+// named like in the BSPs (boot-resource, env, boot, rootfs, ...). The same
+// spec always gives the same image. Returns 0 or the pack_imagewty_sources()
+// error code.
+int make_fixture(const std::string &path, const FixtureSpec &spec);
+
+#endif //OPENIXCARD_FIXTURE_H
@@ -0,0 +1,86 @@
+/*
+ * mkfixture.cpp Generate synthetic IMAGEWTY images
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <argparse/argparse.hpp>
+#include <iostream>
+#include <string>
+
+#include "config.h"
+#include "fixture.h"
+
+extern "C" {
+#include "OpenixIMG.h"
+}
+
+int main(int argc, char *argv[]) {
+    argparse::ArgumentParser parser("OpenixFixture", PROJECT_GIT_HASH);
+    parser.add_argument("-o", "--output")
+            .help("The image to write")
+            .default_value(std::string("fixture.img"));
+    parser.add_argument("--version")
+            .help("Image header version, 1 or 3")
+            .default_value(std::string("3"));
+    parser.add_argument("--size")
+            .help("Size in MiB of all partition items together")
+            .default_value(std::string("64"));
+    parser.add_argument("--items")
+            .help("Number of partition items")
+            .default_value(std::string("4"));
+    parser.add_argument("--payload")
+            .help("Content of the partition items: zeros, random or compressible")
+            .default_value(std::string("compressible"));
+    parser.add_argument("--seed")
+            .help("Seed of the random data, the same seed gives the same image")
+            .default_value(std::string("1"));
+    parser.add_argument("--plain")
+            .help("Do not encrypt the image, like the A31 images")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_epilog(
+            "\r\neg.:\r\nOpenixFixture -o fixture.img                            - A 64 MiB v3 image with 4 partitions"
+            "\r\nOpenixFixture -o big.img --size 2048 --payload random   - 2 GiB of random data"
+            "\r\nOpenixFixture -o v1.img --version 1 --plain --items 12  - An unencrypted v1 image"
+            "\r\n");
+
+    FixtureSpec spec;
+    std::string output;
+    try {
+        parser.parse_args(argc, argv);
+        output = parser.get<std::string>("output");
+        auto version = std::stoul(parser.get<std::string>("version"));
+        if (version != 1 && version != 3) {
+            throw std::runtime_error("version must be 1 or 3");
+        }
+        spec.header_version = version == 1 ? 0x0100 : 0x0300;
+        spec.size = std::stoull(parser.get<std::string>("size")) * 1024 * 1024;
+        spec.items = std::stoul(parser.get<std::string>("items"));
+        if (spec.items == 0) {
+            throw std::runtime_error("at least one item is needed");
+        }
+        if (!parse_payload(parser.get<std::string>("payload"), spec.payload)) {
+            throw std::runtime_error("unknown payload: " + parser.get<std::string>("payload"));
+        }
+        spec.seed = std::stoull(parser.get<std::string>("seed"));
+        spec.encrypt = !parser.get<bool>("plain");
+    } catch (const std::exception &err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << parser;
+        return 1;
+    }
+
+    crypto_init();
+    auto ret = make_fixture(output, spec);
+    if (ret != 0) {
+        std::cerr << "Fail to write " << output << ": " << ret << std::endl;
+        return ret;
+    }
+    return 0;
+}
@@ -13,9 +13,9 @@
 #include <fstream>
 #include <iostream>
 #include <utility>
+#include <vector>
 
-#include <ColorCout.hpp>
-#include <subprocess.hpp>
+#include <cstdlib>
 
 #include "GenIMG.h"
 #include "exception.h"
@@ -24,10 +24,11 @@ extern "C" {
 #include "GenimageWrapper.h"
 }
 
-[[maybe_unused]] GenIMG::GenIMG(std::string config_path, std::string image_path, std::string output_path)
+[[maybe_unused]] GenIMG::GenIMG(std::string config_path, std::string image_path, std::string output_path, bool incremental)
     : config_path(std::move(config_path))
     , image_path(std::move(image_path))
     , output_path(std::move(output_path))
+    , incremental(incremental)
 {
     // generate blank.fex file for commented partition
     generate_blank_fex();
@@ -37,18 +38,22 @@ extern "C" {
     run_genimage();
 }
 
+GenIMG::~GenIMG()
+{
+    std::error_code ec;
+    for (auto &dir : temp_dir)
+        std::filesystem::remove_all(dir, ec);
+}
+
 void GenIMG::generate_tmp_dir()
 {
-    for (int i = 0; i < 2; ++i)
-        temp_dir.emplace_back([]() -> std::string {
-            auto dir_name_str = std::string(subprocess::check_output({ "mktemp", "-d" }).buf.data());
-            size_t start_pos = 0;
-            while ((start_pos = dir_name_str.find('\n', start_pos)) != std::string::npos) {
-                dir_name_str.replace(start_pos, 1, "");
-                start_pos += 1;
-            }
-            return dir_name_str;
-        }());
+    auto base = std::filesystem::temp_directory_path() / "OpenixCard-XXXXXX";
+    for (int i = 0; i < 2; ++i) {
+        std::string dir_name = base.string();
+        if (mkdtemp(dir_name.data()) == nullptr)
+            throw file_open_error(dir_name);
+        temp_dir.emplace_back(dir_name);
+    }
 }
 
 void GenIMG::run_genimage()
@@ -59,22 +64,26 @@ void GenIMG::run_genimage()
     char arg3[] = "--tmppath";
     char arg4[] = "--inputpath";
     char arg5[] = "--outputpath";
-    char* argv[] = {
+    char arg6[] = "--incremental";
+    char arg6_val[] = "1";
+    std::vector<char*> argv = {
         &arg0[0],
         &arg1[0], const_cast<char*>(this->config_path.c_str()),
         &arg2[0], const_cast<char*>(temp_dir[0].c_str()),
         &arg3[0], const_cast<char*>(temp_dir[1].c_str()),
         &arg4[0], const_cast<char*>(this->image_path.c_str()),
         &arg5[0], const_cast<char*>(this->output_path.c_str()),
-        nullptr
     };
 
-    int argc = static_cast<int>((sizeof(argv) / sizeof(argv[0]))) - 1;
+    if (this->incremental) {
+        argv.push_back(&arg6[0]);
+        argv.push_back(&arg6_val[0]);
+    }
+
+    int argc = static_cast<int>(argv.size());
+    argv.push_back(nullptr);
 
-    std::cout << cc::cyan;
-    status = GenimageWrapper(argc, argv);
-    status != 0 ? std::cout << cc::red : std::cout << cc::reset;
-    std::cout << cc::reset;
+    status = GenimageWrapper(argc, argv.data());
 }
 
 [[maybe_unused]] void GenIMG::print()
@@ -13,10 +13,14 @@
 #define OPENIXCARD_GENIMG_H
 
 #include <iostream>
+#include <string>
+#include <vector>
 
 class GenIMG {
 public:
-    [[maybe_unused]] GenIMG(std::string config_path, std::string image_path, std::string output_path);
+    [[maybe_unused]] GenIMG(std::string config_path, std::string image_path, std::string output_path, bool incremental = false);
+
+    ~GenIMG();
 
     [[maybe_unused]] void print();
 
@@ -30,6 +34,8 @@ private:
     std::string image_path;
     std::string output_path;
     std::vector<std::string> temp_dir = std::vector<std::string>{};
+    // only rewrite partitions whose input changed since the last run
+    bool incremental = false;
 
     int status = 0;
 
@@ -21,10 +21,13 @@
 #include <string.h>
 #include <errno.h>
 #include <libgen.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "genimage.h"
 
@@ -185,8 +188,11 @@ static int image_setup(struct image *image)
             return ret;
         }
     }
-    if (image->handler->setup)
+    if (image->handler->setup) {
+        stats_begin();
         ret = image->handler->setup(image, image->imagesec);
+        stats_end_detail("image_setup", image->file, 0);
+    }
 
     if (ret)
         return ret;
@@ -238,7 +244,12 @@ static int image_generate(struct image *image)
     }
 
     if (image->handler->generate) {
+        char phase[48];
+
+        snprintf(phase, sizeof(phase), "genimage:%s", image->handler->type);
+        stats_begin();
         ret = image->handler->generate(image);
+        stats_end_detail(phase, image->file, image->size);
     } else {
         image_error(image, "no generate function for %s\n", image->file);
         return -EINVAL;
@@ -249,7 +260,7 @@ static int image_generate(struct image *image)
         if (lstat(imageoutfile(image), &s) != 0 ||
             ((s.st_mode & S_IFMT) == S_IFREG) ||
             ((s.st_mode & S_IFMT) == S_IFLNK))
-            systemp(image, "rm -f \"%s\"", imageoutfile(image));
+            unlink(imageoutfile(image));
         return ret;
     }
 
@@ -421,21 +432,331 @@ static void add_root_mountpoint(void)
     list_add_tail(&mp->list, &mountpoints);
 }
 
+/*
+ * Native versions of the mkdir/cp/mv/touch/rm commands upstream genimage runs
+ * through systemp(). Forking a shell for each of them dominated the runtime
+ * for the small images OpenixCard generates.
+ */
+static int mkdir_p(const char *path)
+{
+    char *p, *c;
+    int ret = 0;
+
+    if (!*path)
+        return 0;
+
+    p = strdup(path);
+    for (c = p + 1;; c++) {
+        char sep = *c;
+
+        if (sep != '/' && sep != '\0')
+            continue;
+        *c = '\0';
+        if (mkdir(p, 0777) && errno != EEXIST) {
+            ret = -errno;
+            error("mkdir %s: %s\n", p, strerror(errno));
+            break;
+        }
+        *c = sep;
+        if (!sep)
+            break;
+    }
+    free(p);
+    return ret;
+}
+
+/* like 'touch -r', 'chmod --reference' and 'chown --reference' together */
+static int copy_attrs(const char *path, const struct stat *s)
+{
+    const struct timespec times[2] = { s->st_atim, s->st_mtim };
+    int ret;
+
+    /* ownership can only be kept when running as root, like cp -a */
+    if (lchown(path, s->st_uid, s->st_gid) && errno != EPERM)
+        goto err;
+    if (!S_ISLNK(s->st_mode) && chmod(path, s->st_mode & 07777))
+        goto err;
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW))
+        goto err;
+    return 0;
+err:
+    ret = -errno;
+    error("failed to copy attributes to %s: %s\n", path, strerror(errno));
+    return ret;
+}
+
+struct hardlink {
+    dev_t dev;
+    ino_t ino;
+    char *path;
+    struct hardlink *next;
+};
+
+static int copy_regular(const char *src, const char *dst, const struct stat *s)
+{
+    char buf[128 * 1024];
+    int in, out, ret = 0;
+    ssize_t r;
+
+    in = open(src, O_RDONLY);
+    if (in < 0) {
+        ret = -errno;
+        error("open %s: %s\n", src, strerror(errno));
+        return ret;
+    }
+    out = open(dst, O_WRONLY | O_CREAT | O_EXCL, (s->st_mode & 07777) | S_IWUSR);
+    if (out < 0) {
+        ret = -errno;
+        error("open %s: %s\n", dst, strerror(errno));
+        close(in);
+        return ret;
+    }
+    while ((r = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, r) != r) {
+            ret = errno ? -errno : -EIO;
+            error("write %s: %s\n", dst, strerror(-ret));
+            break;
+        }
+    }
+    if (r < 0) {
+        ret = -errno;
+        error("read %s: %s\n", src, strerror(errno));
+    }
+    close(in);
+    if (close(out) && !ret)
+        ret = -errno;
+    return ret;
+}
+
+/* like 'cp -a src dst' for a dst that does not exist yet, without xattrs */
+static int copy_tree(const char *src, const char *dst, struct hardlink **links)
+{
+    struct stat s;
+    int ret = 0;
+
+    if (lstat(src, &s)) {
+        ret = -errno;
+        error("stat %s: %s\n", src, strerror(errno));
+        return ret;
+    }
+
+    if (S_ISDIR(s.st_mode)) {
+        struct dirent *d;
+        DIR *dir;
+
+        if (mkdir(dst, 0700)) {
+            ret = -errno;
+            error("mkdir %s: %s\n", dst, strerror(errno));
+            return ret;
+        }
+        dir = opendir(src);
+        if (!dir) {
+            ret = -errno;
+            error("opendir %s: %s\n", src, strerror(errno));
+            return ret;
+        }
+        while (!ret && (d = readdir(dir))) {
+            char *from, *to;
+
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                continue;
+            xasprintf(&from, "%s/%s", src, d->d_name);
+            xasprintf(&to, "%s/%s", dst, d->d_name);
+            ret = copy_tree(from, to, links);
+            free(from);
+            free(to);
+        }
+        closedir(dir);
+        if (ret)
+            return ret;
+    } else if (S_ISREG(s.st_mode)) {
+        struct hardlink *l = NULL;
+
+        if (s.st_nlink > 1) {
+            for (l = *links; l; l = l->next) {
+                if (l->dev == s.st_dev && l->ino == s.st_ino)
+                    break;
+            }
+        }
+        if (l) {
+            if (link(l->path, dst)) {
+                ret = -errno;
+                error("link %s: %s\n", dst, strerror(errno));
+            }
+            return ret;
+        }
+        ret = copy_regular(src, dst, &s);
+        if (ret)
+            return ret;
+        if (s.st_nlink > 1) {
+            l = xzalloc(sizeof(*l));
+            l->dev = s.st_dev;
+            l->ino = s.st_ino;
+            l->path = strdup(dst);
+            l->next = *links;
+            *links = l;
+        }
+    } else if (S_ISLNK(s.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(src, target, sizeof(target) - 1);
+
+        if (len < 0) {
+            ret = -errno;
+            error("readlink %s: %s\n", src, strerror(errno));
+            return ret;
+        }
+        target[len] = '\0';
+        if (symlink(target, dst)) {
+            ret = -errno;
+            error("symlink %s: %s\n", dst, strerror(errno));
+            return ret;
+        }
+    } else if (mknod(dst, s.st_mode, s.st_rdev)) {
+        ret = -errno;
+        error("mknod %s: %s\n", dst, strerror(errno));
+        return ret;
+    }
+
+    return copy_attrs(dst, &s);
+}
+
+static void free_hardlinks(struct hardlink *links)
+{
+    while (links) {
+        struct hardlink *next = links->next;
+
+        free(links->path);
+        free(links);
+        links = next;
+    }
+}
+
+/* like 'rm -rf path', or 'rm -rf path/ *' if keep_top is set */
+static int remove_tree(const char *path, int keep_top)
+{
+    struct dirent *d;
+    struct stat s;
+    DIR *dir;
+    int ret = 0, err;
+
+    if (lstat(path, &s))
+        return errno == ENOENT ? 0 : -errno;
+
+    if (S_ISDIR(s.st_mode)) {
+        dir = opendir(path);
+        if (!dir)
+            return -errno;
+        while ((d = readdir(dir))) {
+            char *child;
+
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                continue;
+            xasprintf(&child, "%s/%s", path, d->d_name);
+            err = remove_tree(child, 0);
+            if (err)
+                ret = err;
+            free(child);
+        }
+        closedir(dir);
+        if (!keep_top && rmdir(path))
+            ret = -errno;
+    } else if (!keep_top && unlink(path)) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+/*
+ * After moving the mountpoints out of the root copy the timestamps of the
+ * mountpoint parents changed, copy them back from rootpath for every
+ * directory below @rel.
+ */
+static int fixup_dir_times(const char *rel)
+{
+    char *src, *dst;
+    struct dirent *d;
+    struct stat s;
+    DIR *dir;
+    int ret = 0, is_dir;
+
+    xasprintf(&src, "%s/%s", rootpath(), rel);
+    xasprintf(&dst, "%s/root/%s", tmppath(), rel);
+
+    dir = opendir(dst);
+    if (!dir) {
+        ret = -errno;
+        goto out;
+    }
+    while (!ret && (d = readdir(dir))) {
+        char *child;
+
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+        is_dir = d->d_type == DT_DIR;
+        if (d->d_type == DT_UNKNOWN) {
+            char *path;
+
+            xasprintf(&path, "%s/%s", dst, d->d_name);
+            is_dir = lstat(path, &s) == 0 && S_ISDIR(s.st_mode);
+            free(path);
+        }
+        if (!is_dir)
+            continue;
+        xasprintf(&child, "%s%s%s", rel, *rel ? "/" : "", d->d_name);
+        ret = fixup_dir_times(child);
+        free(child);
+    }
+    closedir(dir);
+
+    /* like find -depth: the directory itself last */
+    if (!ret && lstat(src, &s) == 0) {
+        const struct timespec times[2] = { s.st_atim, s.st_mtim };
+
+        if (utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW))
+            ret = -errno;
+    }
+out:
+    if (ret)
+        error("failed to restore timestamps of %s: %s\n", dst, strerror(-ret));
+    free(src);
+    free(dst);
+    return ret;
+}
+
 static int collect_mountpoints(void)
 {
     struct image *image;
     struct mountpoint *mp;
-    int ret;
+    struct hardlink *links = NULL;
+    struct stat st;
+    char *root;
+    int ret, need_mtime_fixup = 0, need_root = 0;
+
+    /* nothing to copy if no image is built from the root tree */
+    list_for_each_entry(image, &images, list) {
+        if (!(image->empty || image->handler->no_rootpath)) {
+            need_root = 1;
+            break;
+        }
+    }
+    if (!need_root) {
+        disable_rootpath();
+        return 0;
+    }
 
     add_root_mountpoint();
 
-    ret = systemp(NULL, "mkdir -p \"%s\"", tmppath());
+    ret = mkdir_p(tmppath());
     if (ret)
         return ret;
 
-    ret = systemp(NULL, "cp -a \"%s\" \"%s/root\"", rootpath(), tmppath());
+    xasprintf(&root, "%s/root", tmppath());
+    stats_begin();
+    ret = copy_tree(rootpath(), root, &links);
+    stats_end_detail("root_copy", rootpath(), 0);
+    free_hardlinks(links);
     if (ret)
-        return ret;
+        goto out;
 
     list_for_each_entry(image, &images, list) {
         if (image->mountpoint)
@@ -443,39 +764,41 @@ static int collect_mountpoints(void)
     }
 
     list_for_each_entry(mp, &mountpoints, list) {
+        char *path;
+
         if (!strlen(mp->path))
             continue;
-        ret = systemp(NULL, "mv \"%s/root/%s\" \"%s\"", tmppath(), mp->path, mp->mountpath);
-        if (ret)
-            return ret;
-        ret = systemp(NULL, "mkdir \"%s/root/%s\"", tmppath(), mp->path);
-        if (ret)
-            return ret;
-        ret = systemp(NULL, "chmod --reference=\"%s\" \"%s/root/%s\"", mp->mountpath, tmppath(), mp->path);
-        if (ret)
-            return ret;
-        ret = systemp(NULL, "chown --reference=\"%s\" \"%s/root/%s\"", mp->mountpath, tmppath(), mp->path);
+        xasprintf(&path, "%s/%s", root, mp->path);
+        if (rename(path, mp->mountpath) || stat(mp->mountpath, &st) ||
+            mkdir(path, 0700) || copy_attrs(path, &st)) {
+            ret = -errno;
+            error("failed to move mountpoint %s: %s\n", mp->path, strerror(errno));
+        }
+        free(path);
         if (ret)
-            return ret;
+            goto out;
+        need_mtime_fixup = 1;
     }
 
     /*
      * After the mv/mkdir of the mountpoints the timestamps of the
      * mountpoint and all parent dirs are changed. Fix that here.
      */
-    ret = systemp(NULL,
-                  "find '%s/root' -depth -type d -printf '%%P\\0' | xargs -0 -I {} touch -r '%s/{}' '%s/root/{}'",
-                  tmppath(), rootpath(), tmppath());
-    if (ret)
-        return ret;
+    if (need_mtime_fixup)
+        ret = fixup_dir_times("");
 
-    return 0;
+out:
+    free(root);
+    return ret;
 }
 
 const char *mountpath(const struct image *image)
 {
     struct mountpoint *mp;
 
+    if (image->empty || image->handler->no_rootpath)
+        return "";
+
     mp = image->mp;
     if (!mp)
         mp = get_mountpoint("");
@@ -485,7 +808,7 @@ const char *mountpath(const struct image *image)
 
 static int tmppath_generated;
 
-static void check_tmp_path(void)
+static int check_tmp_path(void)
 {
     const char *tmp = tmppath();
     int ret;
@@ -494,15 +817,15 @@ static void check_tmp_path(void)
 
     if (!tmp) {
         error("tmppath not set. aborting\n");
-        exit(1);
+        return -EINVAL;
     }
 
     dir = opendir(tmp);
     if (!dir) {
-        ret = systemp(NULL, "mkdir -p \"%s\"", tmppath());
+        ret = mkdir_p(tmppath());
         if (ret)
-            exit(1);
-        return;
+            return ret;
+        return 0;
     }
 
     while (1) {
@@ -511,17 +834,14 @@ static void check_tmp_path(void)
         i++;
         if (i > 2) {
             error("tmppath '%s' exists and is not empty\n", tmp);
-            exit(1);
+            closedir(dir);
+            return -EINVAL;
         }
     }
     tmppath_generated = 1;
     closedir(dir);
-}
 
-static void cleanup(void)
-{
-    if (tmppath_generated)
-        systemp(NULL, "rm -rf \"%s\"/*", tmppath());
+    return 0;
 }
 
 static cfg_opt_t top_opts[] = {
@@ -532,6 +852,51 @@ static cfg_opt_t top_opts[] = {
         CFG_END()
 };
 
+/*
+ * Free what a run set up, so the next GenimageWrapper() call in the same
+ * process does not find the images, flashes or mountpoints of this one.
+ */
+static void cleanup(cfg_t *cfg, cfg_opt_t *imageopts)
+{
+    struct image *image, *image_tmp;
+    struct partition *part, *part_tmp;
+    struct flash_type *flash, *flash_tmp;
+    struct mountpoint *mp, *mp_tmp;
+
+    if (tmppath_generated)
+        remove_tree(tmppath(), 1);
+    tmppath_generated = 0;
+
+    list_for_each_entry_safe(image, image_tmp, &images, list) {
+        list_for_each_entry_safe(part, part_tmp, &image->partitions, list)
+            free(part);
+        free(image->holes);
+        free(image->handler_priv);
+        free(image->outfile);
+        free(image);
+    }
+    INIT_LIST_HEAD(&images);
+
+    list_for_each_entry_safe(flash, flash_tmp, &flashlist, list)
+        free(flash);
+    INIT_LIST_HEAD(&flashlist);
+
+    list_for_each_entry_safe(mp, mp_tmp, &mountpoints, list) {
+        free(mp->path);
+        free(mp->mountpath);
+        free(mp);
+    }
+    INIT_LIST_HEAD(&mountpoints);
+
+    /* the names above point into the parsed config */
+    if (cfg)
+        cfg_free(cfg);
+    free(imageopts);
+    top_opts[0].subopts = NULL;
+    free(top_opts[2].subopts);
+    top_opts[2].subopts = NULL;
+}
+
 static int overwriteenv(const char *name, const char *value)
 {
     int ret;
@@ -643,7 +1008,7 @@ int GenimageWrapper(int argc, char *argv[])
     int start;
     struct image *image;
     const char *str;
-    cfg_t *cfg;
+    cfg_t *cfg = NULL;
     struct partition *part;
 
     cfg_opt_t image_end[] = {
@@ -711,7 +1076,9 @@ int GenimageWrapper(int argc, char *argv[])
     /* again, with config file this time */
     set_config_opts(argc, argv, cfg);
 
-    check_tmp_path();
+    ret = check_tmp_path();
+    if (ret)
+        goto cleanup;
 
     parse_flashes(cfg);
 
@@ -779,6 +1146,12 @@ int GenimageWrapper(int argc, char *argv[])
             list_add_tail(&child->list, &images);
             child->file = part->image;
             child->handler = &file_handler;
+            /* marks the child empty, so it does not need the root tree */
+            if (child->handler->parse) {
+                ret = child->handler->parse(child, child->imagesec);
+                if (ret)
+                    goto cleanup;
+            }
             parse_holes(child, part->cfg);
         }
     }
@@ -802,7 +1175,7 @@ int GenimageWrapper(int argc, char *argv[])
     if (ret)
         goto cleanup;
 
-    ret = systemp(NULL, "mkdir -p \"%s\"", imagepath());
+    ret = mkdir_p(imagepath());
     if (ret)
         goto cleanup;
 
@@ -819,6 +1192,6 @@ int GenimageWrapper(int argc, char *argv[])
     }
 
     cleanup:
-    cleanup();
+    cleanup(cfg, imageopts);
     return ret ? 1 : 0;
 }
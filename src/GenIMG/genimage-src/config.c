@@ -288,28 +288,28 @@ static char *abspath(const char *path)
 	return p;
 }
 
+/* absolute paths, computed on first use and dropped by init_config() */
+static char *cached_outputpath;
+static char *cached_inputpath;
+static char *cached_tmppath;
+static const char *cached_rootpath;
+
 const char *imagepath(void)
 {
-	static const char *outputpath;
-
-	if (!outputpath)
-		outputpath = abspath(get_opt("outputpath"));
+	if (!cached_outputpath)
+		cached_outputpath = abspath(get_opt("outputpath"));
 
-	return outputpath;
+	return cached_outputpath;
 }
 
 const char *inputpath(void)
 {
-	static const char *inputpath;
+	if (!cached_inputpath)
+		cached_inputpath = abspath(get_opt("inputpath"));
 
-	if (!inputpath)
-		inputpath = abspath(get_opt("inputpath"));
-
-	return inputpath;
+	return cached_inputpath;
 }
 
-static const char *cached_rootpath;
-
 void disable_rootpath(void)
 {
 	cached_rootpath = "";
@@ -325,12 +325,10 @@ const char *rootpath(void)
 
 const char *tmppath(void)
 {
-	static const char *tmppath;
-
-	if (!tmppath)
-		tmppath = abspath(get_opt("tmppath"));
+	if (!cached_tmppath)
+		cached_tmppath = abspath(get_opt("tmppath"));
 
-	return tmppath;
+	return cached_tmppath;
 }
 
 static struct config opts[] = {
@@ -367,6 +365,11 @@ static struct config opts[] = {
 #ifndef HAVE_SEARCHPATH
 		.hidden = 1,
 #endif
+	}, {
+		.name = "incremental",
+		.opt = CFG_STR("incremental", NULL, CFGF_NONE),
+		.env = "GENIMAGE_INCREMENTAL",
+		.def = "0",
 	}, {
 		.name = "cpio",
 		.opt = CFG_STR("cpio", NULL, CFGF_NONE),
@@ -495,15 +498,28 @@ static struct config opts[] = {
 
 /*
  * early setup: add all options from the array above to the
- * list of options
+ * list of options. Called again for every run in the same process,
+ * so forget the values and paths of the previous one.
  */
 int init_config(void)
 {
 	unsigned int i;
 
+	free(cached_outputpath);
+	free(cached_inputpath);
+	free(cached_tmppath);
+	/* "" after disable_rootpath() */
+	if (cached_rootpath && *cached_rootpath)
+		free((char *)cached_rootpath);
+	cached_outputpath = cached_inputpath = cached_tmppath = NULL;
+	cached_rootpath = NULL;
+
+	INIT_LIST_HEAD(&optlist);
 	for (i = 0; i < ARRAY_SIZE(opts); i++) {
 		struct config *c = &opts[i];
 
+		free(c->value);
+		c->value = NULL;
 		list_add_tail(&c->list, &optlist);
 	}
 
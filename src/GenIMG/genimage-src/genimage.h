@@ -25,6 +25,25 @@ const char *inputpath(void);
 const char *rootpath(void);
 const char *tmppath(void);
 const char *mountpath(const struct image *);
+
+/* Shared aligned buffers, provided by the embedding program (BufferPool.h) */
+size_t buffer_pool_budget(void);
+void *buffer_pool_get(size_t *size, size_t min_size);
+void buffer_pool_put(void *buf);
+
+/* Per phase timing, provided by the embedding program (Stats.h) */
+void stats_begin(void);
+void stats_end(const char *phase, uint64_t bytes);
+void stats_end_detail(const char *phase, const char *detail, uint64_t bytes);
+
+/* Progress counters, provided by the embedding program (Progress.h) */
+void progress_insert_expect(uint64_t bytes);
+void progress_insert_add(uint64_t bytes);
+
+/* Logging, provided by the embedding program (Logger.h) */
+int log_genimage_enabled(int level);
+void log_genimage(int level, const char *msg);
+
 struct flash_type;
 
 struct mountpoint {
@@ -163,10 +182,38 @@ struct extent {
 	unsigned long long start, end;
 };
 
+/* Android sparse image format, all fields are little endian */
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t header_size;
+	uint16_t chunk_header_size;
+	uint32_t block_size;
+	uint32_t output_blocks;
+	uint32_t input_chunks;
+	uint32_t crc32;
+} __attribute__((packed));
+
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+
+#define SPARSE_CHUNK_RAW	0xCAC1
+#define SPARSE_CHUNK_FILL	0xCAC2
+#define SPARSE_CHUNK_DONT_CARE	0xCAC3
+#define SPARSE_CHUNK_CRC32	0xCAC4
+
+struct sparse_chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved;
+	uint32_t blocks;
+	uint32_t size;
+} __attribute__((packed));
+
 int open_file(struct image *image, const char *filename, int extra_flags);
 int map_file_extents(struct image *image, const char *filename, int fd,
 		     size_t size, struct extent **extents, size_t *extent_count);
 int is_block_device(const char *filename);
+int sparse_image_size(const char *filename, unsigned long long *size);
 int block_device_size(struct image *image, const char *blkdev,
 		      unsigned long long *size);
 int prepare_image(struct image *image, unsigned long long size);
@@ -50,29 +50,10 @@ struct sparse {
 	uint32_t block_size;
 };
 
-struct sparse_header {
-	uint32_t magic;
-	uint16_t major_version;
-	uint16_t minor_version;
-	uint16_t header_size;
-	uint16_t chunk_header_size;
-	uint32_t block_size;
-	uint32_t output_blocks;
-	uint32_t input_chunks;
-	uint32_t crc32;
-} __attribute__((packed));
-
-#define SPARSE_RAW		htole16(0xCAC1)
-#define SPARSE_FILL		htole16(0xCAC2)
-#define SPARSE_DONT_CARE	htole16(0xCAC3)
-#define SPARSE_CRC32		htole16(0xCAC4)
-
-struct sparse_chunk_header {
-	uint16_t chunk_type;
-	uint16_t reserved;
-	uint32_t blocks;
-	uint32_t size;
-} __attribute__((packed));
+#define SPARSE_RAW		htole16(SPARSE_CHUNK_RAW)
+#define SPARSE_FILL		htole16(SPARSE_CHUNK_FILL)
+#define SPARSE_DONT_CARE	htole16(SPARSE_CHUNK_DONT_CARE)
+#define SPARSE_CRC32		htole16(SPARSE_CHUNK_CRC32)
 
 static int write_data(struct image *image, int fd, const void *data, size_t size)
 {
@@ -139,11 +120,12 @@ static int android_sparse_generate(struct image *image)
 	int in_fd = -1, out_fd = -1, ret;
 	off_t offset;
 	unsigned int i;
-	uint32_t *buf, *zeros, crc32 = 0;
+	uint32_t *buf = NULL, *zeros = NULL, crc32 = 0;
+	size_t buf_size;
 	struct stat s;
 
 	memset(&header, 0, sizeof(header));
-	header.magic = htole32(0xed26ff3a);
+	header.magic = htole32(SPARSE_HEADER_MAGIC);
 	header.major_version = htole16(0x1);
 	header.minor_version = htole16(0x0);
 	header.header_size = htole16(sizeof(struct sparse_header));
@@ -217,8 +199,15 @@ static int android_sparse_generate(struct image *image)
 		goto out;
 
 	block = 0;
-	buf = xzalloc(sparse->block_size);
-	zeros = xzalloc(sparse->block_size);
+	buf_size = sparse->block_size;
+	buf = buffer_pool_get(&buf_size, sparse->block_size);
+	buf_size = sparse->block_size;
+	zeros = buffer_pool_get(&buf_size, sparse->block_size);
+	if (!buf || !zeros) {
+		ret = -ENOMEM;
+		image_error(image, "failed to allocate %u byte buffers\n", sparse->block_size);
+		goto out;
+	}
 	memset(zeros, 0, sparse->block_size);
 	for (extent = 0; extent < extent_count; ++extent) {
 		uint32_t start_block = extents[extent].start / sparse->block_size;
@@ -367,6 +356,8 @@ out:
 	close(in_fd);
 	if (out_fd >= 0)
 		close(out_fd);
+	buffer_pool_put(buf);
+	buffer_pool_put(zeros);
 	if (extents)
 		free(extents);
 	return ret;
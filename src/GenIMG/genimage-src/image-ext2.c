@@ -24,8 +24,16 @@
 
 #include "genimage.h"
 
+enum ext_fsck {
+	EXT_FSCK_AUTO,
+	EXT_FSCK_REPAIR,
+	EXT_FSCK_VERIFY,
+	EXT_FSCK_NONE,
+};
+
 struct ext {
 	int use_mke2fs;
+	enum ext_fsck fsck;
 	const char *features;
 	char *usage_type_args;
 	char *conf_env;
@@ -38,6 +46,7 @@ static int ext2_generate_genext2fs(struct image *image)
 	struct ext *ext = image->handler_priv;
 	const char *extraargs = cfg_getstr(image->imagesec, "extraargs");
 	const char *label = cfg_getstr(image->imagesec, "label");
+	const char *features = ext->features;
 
 	ret = systemp(image, "%s %s%s%s --size-in-blocks=%lld -i 16384 '%s' %s",
 			get_opt("genext2fs"),
@@ -49,19 +58,22 @@ static int ext2_generate_genext2fs(struct image *image)
 	if (ret)
 		return ret;
 
-	if (ext->features && ext->features[0] != '\0') {
-		ret = systemp(image, "%s -O '%s' '%s'", get_opt("tune2fs"),
-				ext->features, imageoutfile(image));
-		if (ret)
-			return ret;
-	}
-	if (label && label[0] != '\0') {
-		ret = systemp(image, "%s -L '%s' '%s'", get_opt("tune2fs"),
-				label, imageoutfile(image));
-		if (ret)
-			return ret;
-	}
-	return 0;
+	if (features && features[0] == '\0')
+		features = NULL;
+	if (label && label[0] == '\0')
+		label = NULL;
+	if (!features && !label)
+		return 0;
+
+	/* one tune2fs run for both, every run reads and rewrites the metadata */
+	return systemp(image, "%s%s%s%s%s%s%s '%s'", get_opt("tune2fs"),
+			features ? " -O '" : "",
+			features ? features : "",
+			features ? "'" : "",
+			label ? " -L '" : "",
+			label ? label : "",
+			label ? "'" : "",
+			imageoutfile(image));
 }
 
 static int ext2_generate_mke2fs(struct image *image)
@@ -110,12 +122,36 @@ static int ext2_generate(struct image *image)
 	if (ret)
 		return ret;
 
-	ret = systemp(image, "%s -pvfD '%s'", get_opt("e2fsck"),
-			imageoutfile(image));
-
-	/* e2fsck return 1 when the filesystem was successfully modified */
-	if  (ret > 2)
-		return ret;
+	switch (ext->fsck) {
+	case EXT_FSCK_AUTO:
+		/*
+		 * mke2fs writes a consistent file system in one pass, only
+		 * the features tune2fs added to a genext2fs image need e2fsck
+		 * to finish them.
+		 */
+		if (ext->use_mke2fs)
+			break;
+		/* fall through */
+	case EXT_FSCK_REPAIR:
+		ret = systemp(image, "%s -pvfD '%s'", get_opt("e2fsck"),
+				imageoutfile(image));
+
+		/* e2fsck return 1 when the filesystem was successfully modified */
+		if  (ret > 2)
+			return ret;
+		break;
+	case EXT_FSCK_VERIFY:
+		/* read only check, any finding is an error */
+		ret = systemp(image, "%s -fn '%s'", get_opt("e2fsck"),
+				imageoutfile(image));
+		if (ret) {
+			image_error(image, "file system check failed\n");
+			return ret;
+		}
+		break;
+	case EXT_FSCK_NONE:
+		break;
+	}
 
 	if (fs_timestamp) {
 		ret = systemp(image, "echo '"
@@ -136,6 +172,7 @@ static int ext2_setup(struct image *image, cfg_t *cfg)
 	struct ext *ext = xzalloc(sizeof(*ext));
 	const char *conf = cfg_getstr(image->imagesec, "mke2fs-conf");
 	const char *usage_type = cfg_getstr(image->imagesec, "usage-type");
+	const char *fsck;
 
 	if (!conf) {
 		conf = cfg_getstr(image->imagesec, "mke2fs_conf");
@@ -150,6 +187,20 @@ static int ext2_setup(struct image *image, cfg_t *cfg)
 
 	ext->use_mke2fs = cfg_getbool(cfg, "use-mke2fs");
 
+	fsck = cfg_getstr(image->imagesec, "fsck");
+	if (!strcmp(fsck, "auto"))
+		ext->fsck = EXT_FSCK_AUTO;
+	else if (!strcmp(fsck, "repair"))
+		ext->fsck = EXT_FSCK_REPAIR;
+	else if (!strcmp(fsck, "verify"))
+		ext->fsck = EXT_FSCK_VERIFY;
+	else if (!strcmp(fsck, "none"))
+		ext->fsck = EXT_FSCK_NONE;
+	else {
+		image_error(image, "invalid fsck '%s', must be auto, repair, verify or none\n", fsck);
+		return -EINVAL;
+	}
+
 	ext->features = cfg_getstr(image->imagesec, "features");
 	if (!ext->features) {
 		if (!ext->use_mke2fs) {
@@ -210,6 +261,7 @@ static cfg_opt_t ext_opts[] = {
 	CFG_STR("label", NULL, CFGF_NONE),
 	CFG_STR("fs-timestamp", NULL, CFGF_NONE),
 	CFG_BOOL("use-mke2fs", cfg_false, CFGF_NONE),
+	CFG_STR("fsck", "auto", CFGF_NONE),
 	CFG_STR("usage-type", NULL, CFGF_NONE),
 	CFG_STR("mke2fs-conf", NULL, CFGF_NONE),
 	CFG_STR("mke2fs_conf", NULL, CFGF_NONE),
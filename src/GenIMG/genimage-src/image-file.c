@@ -68,8 +68,18 @@ static int file_setup(struct image *image, cfg_t *cfg)
 				strerror(errno));
 		return ret;
 	}
-	if (!image->size)
-		image->size = s.st_size;
+	if (!image->size) {
+		unsigned long long expanded;
+
+		/* android sparse images are expanded when they are inserted */
+		ret = sparse_image_size(f->infile, &expanded);
+		if (ret < 0) {
+			image_error(image, "%s: invalid android sparse header: %s\n",
+				    f->infile, strerror(-ret));
+			return ret;
+		}
+		image->size = ret ? expanded : (unsigned long long)s.st_size;
+	}
 
 	if (cfg)
 		f->copy = cfg_getbool(cfg, "copy");
@@ -60,8 +60,9 @@ static int fit_generate(struct image *image)
 
 	itsfd = open(itspath, O_WRONLY | O_APPEND);
 	if (itsfd < 0) {
-		printf("Cannot open %s: %s\n", itspath, strerror(errno));
-		return -errno;
+		ret = -errno;
+		image_error(image, "Cannot open %s: %s\n", itspath, strerror(-ret));
+		return ret;
 	}
 
 	dprintf(itsfd, "\n");
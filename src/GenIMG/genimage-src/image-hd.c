@@ -418,19 +418,267 @@ static int hdimage_insert_gpt(struct image *image, struct list_head *partitions)
 }
 
 
+/*
+ * Incremental mode: after a successful run a sidecar manifest records the
+ * partition layout and, for every partition with an input image, the size
+ * and CRC of that input. If the next run finds the same layout and an output
+ * file of the expected size, only partitions whose input changed are
+ * rewritten in place, followed by the partition tables.
+ */
+#define HDIMAGE_MANIFEST_MAGIC	"# genimage hdimage manifest 2"
+
+struct hdimage_manifest_entry {
+	char *name;
+	unsigned long long offset;
+	unsigned long long size;
+	char *image;
+	unsigned long long image_size;
+	uint32_t crc;
+};
+
+struct hdimage_manifest {
+	unsigned long long size;
+	unsigned long long file_size;
+	unsigned int count;
+	struct hdimage_manifest_entry *entries;
+};
+
+static int hdimage_incremental(void)
+{
+	const char *s = get_opt("incremental");
+
+	return s && (!strcmp(s, "1") || !strcmp(s, "yes") || !strcmp(s, "true"));
+}
+
+static void hdimage_manifest_free(struct hdimage_manifest *m)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->count; i++) {
+		free(m->entries[i].name);
+		free(m->entries[i].image);
+	}
+	free(m->entries);
+	memset(m, 0, sizeof(*m));
+}
+
+static int file_crc32(struct image *image, const char *file, uint32_t *crc)
+{
+	char buf[65536];
+	ssize_t r;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		int ret = -errno;
+		image_error(image, "open %s: %s\n", file, strerror(errno));
+		return ret;
+	}
+	*crc = 0;
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		*crc = crc32_next(buf, r, *crc);
+	if (r < 0) {
+		int ret = -errno;
+		image_error(image, "read %s: %s\n", file, strerror(errno));
+		close(fd);
+		return ret;
+	}
+	close(fd);
+	return 0;
+}
+
+static int hdimage_manifest_read(const char *path, struct hdimage_manifest *m)
+{
+	char *line = NULL;
+	size_t len = 0;
+	FILE *f;
+	int ret = -EINVAL;
+
+	memset(m, 0, sizeof(*m));
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	if (getline(&line, &len, f) < 0 || strncmp(line, HDIMAGE_MANIFEST_MAGIC,
+						  strlen(HDIMAGE_MANIFEST_MAGIC)))
+		goto out;
+	if (getline(&line, &len, f) < 0 ||
+	    sscanf(line, "size\t%llu\t%llu", &m->size, &m->file_size) != 2)
+		goto out;
+
+	while (getline(&line, &len, f) > 0) {
+		struct hdimage_manifest_entry *e;
+		char *fields[7], *p = line;
+		unsigned int n = 0;
+
+		line[strcspn(line, "\n")] = '\0';
+		while (n < ARRAY_SIZE(fields) && (fields[n] = strsep(&p, "\t")))
+			n++;
+		if (n != ARRAY_SIZE(fields) || strcmp(fields[0], "part"))
+			goto out;
+
+		m->entries = xrealloc(m->entries, (m->count + 1) * sizeof(*m->entries));
+		e = &m->entries[m->count++];
+		e->name = strdup(fields[1]);
+		e->offset = strtoull(fields[2], NULL, 0);
+		e->size = strtoull(fields[3], NULL, 0);
+		e->image = strcmp(fields[4], "-") ? strdup(fields[4]) : NULL;
+		e->image_size = strtoull(fields[5], NULL, 0);
+		e->crc = strtoul(fields[6], NULL, 16);
+	}
+	ret = 0;
+out:
+	free(line);
+	fclose(f);
+	if (ret)
+		hdimage_manifest_free(m);
+	return ret;
+}
+
+static int hdimage_manifest_write(struct image *image, const char *path,
+				  const struct hdimage_manifest *m)
+{
+	char *tmp;
+	unsigned int i;
+	FILE *f;
+	int ret = 0;
+
+	xasprintf(&tmp, "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", tmp, strerror(errno));
+		free(tmp);
+		return ret;
+	}
+	fprintf(f, "%s\n", HDIMAGE_MANIFEST_MAGIC);
+	fprintf(f, "size\t%llu\t%llu\n", m->size, m->file_size);
+	for (i = 0; i < m->count; i++) {
+		const struct hdimage_manifest_entry *e = &m->entries[i];
+
+		fprintf(f, "part\t%s\t%llu\t%llu\t%s\t%llu\t%08x\n",
+			e->name, e->offset, e->size, e->image ? e->image : "-",
+			e->image_size, e->crc);
+	}
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		ret = -errno;
+		image_error(image, "failed to write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+	return ret;
+}
+
+/*
+ * Describe the current layout, every input is read once for its CRC. The
+ * inputs are unpacked again before every run, so their inode and mtime
+ * always change and can not tell an unchanged input.
+ */
+static int hdimage_manifest_build(struct image *image, struct hdimage_manifest *m)
+{
+	struct hdimage *hd = image->handler_priv;
+	struct partition *part;
+	unsigned int i = 0;
+	int ret;
+
+	memset(m, 0, sizeof(*m));
+	m->size = image->size;
+	m->file_size = hd->file_size;
+	list_for_each_entry(part, &image->partitions, list)
+		m->count++;
+	m->entries = xzalloc(m->count * sizeof(*m->entries));
+
+	list_for_each_entry(part, &image->partitions, list) {
+		struct hdimage_manifest_entry *e = &m->entries[i];
+		struct image *child;
+		const char *file;
+
+		i++;
+		e->name = strdup(part->name);
+		e->offset = part->offset;
+		e->size = part->size;
+		if (!part->image)
+			continue;
+
+		child = image_get(part->image);
+		file = imageoutfile(child);
+		e->image = strdup(part->image);
+		e->image_size = child->size;
+		ret = file_crc32(image, file, &e->crc);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static bool hdimage_manifest_same_layout(const struct hdimage_manifest *a,
+					 const struct hdimage_manifest *b)
+{
+	unsigned int i;
+
+	if (a->size != b->size || a->file_size != b->file_size || a->count != b->count)
+		return false;
+	for (i = 0; i < a->count; i++) {
+		const struct hdimage_manifest_entry *x = &a->entries[i], *y = &b->entries[i];
+
+		if (strcmp(x->name, y->name) || x->offset != y->offset || x->size != y->size)
+			return false;
+		if (!x->image != !y->image || (x->image && strcmp(x->image, y->image)))
+			return false;
+	}
+	return true;
+}
+
+static bool hdimage_manifest_entry_changed(const struct hdimage_manifest_entry *cur,
+					   const struct hdimage_manifest_entry *old)
+{
+	return cur->image_size != old->image_size || cur->crc != old->crc;
+}
+
 static int hdimage_generate(struct image *image)
 {
 	struct partition *part;
 	struct hdimage *hd = image->handler_priv;
+	struct hdimage_manifest old, cur;
+	char *manifest = NULL;
+	bool have_old = false, incremental = false;
+	unsigned int index = 0;
 	struct stat s;
 	int ret;
 
-	ret = prepare_image(image, hd->file_size);
-	if (ret < 0)
-		return ret;
+	memset(&cur, 0, sizeof(cur));
+	if (hdimage_incremental() && !is_block_device(imageoutfile(image))) {
+		xasprintf(&manifest, "%s.manifest", imageoutfile(image));
+		have_old = hdimage_manifest_read(manifest, &old) == 0;
+		ret = hdimage_manifest_build(image, &cur);
+		if (ret)
+			goto out;
+		incremental = have_old && hdimage_manifest_same_layout(&old, &cur) &&
+			stat(imageoutfile(image), &s) == 0 && S_ISREG(s.st_mode) &&
+			(unsigned long long)s.st_size == hd->file_size;
+		/* the manifest must never describe a half written image */
+		unlink(manifest);
+	}
+
+	if (incremental) {
+		image_info(image, "layout unchanged, updating %s in place\n",
+			   imageoutfile(image));
+	} else {
+		ret = prepare_image(image, hd->file_size);
+		if (ret < 0)
+			goto out;
+	}
 
 	list_for_each_entry(part, &image->partitions, list) {
 		struct image *child;
+		unsigned long long size;
+		unsigned int i = index++;
+
+		if (incremental && part->image &&
+		    !hdimage_manifest_entry_changed(&cur.entries[i], &old.entries[i])) {
+			image_info(image, "partition '%s' unchanged, skipping\n", part->name);
+			continue;
+		}
 
 		image_info(image, "adding partition '%s'%s%s%s%s ...\n", part->name,
 			part->in_partition_table ? " (in MBR)" : "",
@@ -442,7 +690,7 @@ static int hdimage_generate(struct image *image)
 			ret = hdimage_insert_ebr(image, part);
 			if (ret) {
 				image_error(image, "failed to write EBR\n");
-				return ret;
+				goto out;
 			}
 		}
 
@@ -451,33 +699,45 @@ static int hdimage_generate(struct image *image)
 
 		child = image_get(part->image);
 
-		if (child->size == 0)
+		/*
+		 * When updating in place, also clear whatever the previous,
+		 * possibly larger, input left behind in this partition.
+		 */
+		size = child->size;
+		if (incremental && old.entries[i].image_size > size)
+			size = old.entries[i].image_size;
+
+		if (size == 0)
 			continue;
 
 		if (child->size > part->size) {
 			image_error(image, "part %s size (%lld) too small for %s (%lld)\n",
 				    part->name, part->size, child->file, child->size);
-			return -E2BIG;
+			ret = -E2BIG;
+			goto out;
 		}
 
-		ret = insert_image(image, child, child->size, part->offset, 0);
+		ret = insert_image(image, child, size, part->offset, 0);
 		if (ret) {
 			image_error(image, "failed to write image partition '%s'\n",
 					part->name);
-			return ret;
+			goto out;
 		}
 	}
 
 	if (hd->table_type != TYPE_NONE) {
 		if (hd->table_type & TYPE_GPT) {
+			stats_begin();
 			ret = hdimage_insert_gpt(image, &image->partitions);
+			/* header and entries, twice unless there is no backup */
+			stats_end("gpt_write", GPT_SECTORS * 512 * (hd->gpt_no_backup ? 1 : 2));
 			if (ret)
-				return ret;
+				goto out;
 		}
 		else {
 			ret = hdimage_insert_mbr(image, &image->partitions);
 			if (ret)
-				return ret;
+				goto out;
 		}
 	}
 
@@ -485,7 +745,7 @@ static int hdimage_generate(struct image *image)
 		ret = extend_file(image, image->size);
 		if (ret) {
 			image_error(image, "failed to fill the image.\n");
-			return ret;
+			goto out;
 		}
 	}
 
@@ -495,19 +755,32 @@ static int hdimage_generate(struct image *image)
 			ret = -errno;
 			image_error(image, "stat(%s) failed: %s\n", imageoutfile(image),
 				    strerror(errno));
-			return ret;
+			goto out;
 		}
 		if (hd->file_size != (unsigned long long)s.st_size) {
 			image_error(image, "unexpected output file size: %llu != %llu\n",
 				    hd->file_size, (unsigned long long)s.st_size);
-			return -EINVAL;
+			ret = -EINVAL;
+			goto out;
 		}
 	}
 
-	if (hd->table_type != TYPE_NONE)
-		return reload_partitions(image);
+	if (manifest) {
+		ret = hdimage_manifest_write(image, manifest, &cur);
+		if (ret)
+			goto out;
+	}
 
-	return 0;
+	ret = 0;
+	if (hd->table_type != TYPE_NONE)
+		ret = reload_partitions(image);
+
+out:
+	if (have_old)
+		hdimage_manifest_free(&old);
+	hdimage_manifest_free(&cur);
+	free(manifest);
+	return ret;
 }
 
 static unsigned long long roundup(unsigned long long value, unsigned long long align)
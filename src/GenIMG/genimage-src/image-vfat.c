@@ -15,10 +15,28 @@
  */
 
 #include <confuse.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef __APPLE__
+#include <libkern/OSByteOrder.h>
+#define htole16(x) OSSwapHostToLittleInt16(x)
+#define htole32(x) OSSwapHostToLittleInt32(x)
+#elif defined(__linux__)
+#include <endian.h>
+#else
+#include <sys/endian.h>
+#endif
 
 #ifdef __APPLE__
 /* strdupa is a GNU extension, provide a compatible implementation for macOS */
@@ -32,24 +50,973 @@
 
 #include "genimage.h"
 
-static int vfat_generate(struct image *image)
+/*
+ * Native FAT12/16/32 writer. The whole file system is planned in memory
+ * first: a tree of the files and directories to add, then short names,
+ * directory sizes and a contiguous cluster for everything. The FATs,
+ * directories and file contents are then written with a single pass over
+ * the image, no mkdosfs/mmd/mcopy process is started.
+ */
+#define FAT_SECTOR_SIZE		512
+#define FAT_DIRENT_SIZE		32
+#define FAT_LFN_CHARS		13
+#define FAT_ROOT_ENTRIES	512
+
+#define FAT_ATTR_VOLUME		0x08
+#define FAT_ATTR_DIR		0x10
+#define FAT_ATTR_ARCHIVE	0x20
+#define FAT_ATTR_LFN		0x0f
+
+#define FAT_NT_LOWER_BASE	0x08
+#define FAT_NT_LOWER_EXT	0x10
+
+struct fat_boot_sector {
+	uint8_t jump[3];
+	char oem[8];
+	uint16_t bytes_per_sector;
+	uint8_t sectors_per_cluster;
+	uint16_t reserved_sectors;
+	uint8_t fats;
+	uint16_t root_entries;
+	uint16_t total_sectors16;
+	uint8_t media;
+	uint16_t fat_sectors16;
+	uint16_t sectors_per_track;
+	uint16_t heads;
+	uint32_t hidden_sectors;
+	uint32_t total_sectors32;
+	union {
+		struct {
+			uint8_t drive;
+			uint8_t reserved;
+			uint8_t signature;
+			uint32_t volume_id;
+			char label[11];
+			char fs_type[8];
+		} __attribute__((packed)) fat16;
+		struct {
+			uint32_t fat_sectors32;
+			uint16_t flags;
+			uint16_t version;
+			uint32_t root_cluster;
+			uint16_t fsinfo_sector;
+			uint16_t backup_sector;
+			uint8_t reserved1[12];
+			uint8_t drive;
+			uint8_t reserved2;
+			uint8_t signature;
+			uint32_t volume_id;
+			char label[11];
+			char fs_type[8];
+		} __attribute__((packed)) fat32;
+	};
+} __attribute__((packed));
+
+struct fat_dirent {
+	char name[11];
+	uint8_t attr;
+	uint8_t nt_case;
+	uint8_t ctime_ms;
+	uint16_t ctime;
+	uint16_t cdate;
+	uint16_t adate;
+	uint16_t cluster_hi;
+	uint16_t mtime;
+	uint16_t mdate;
+	uint16_t cluster_lo;
+	uint32_t size;
+} __attribute__((packed));
+
+struct fat_lfn_dirent {
+	uint8_t seq;
+	uint16_t name1[5];
+	uint8_t attr;
+	uint8_t type;
+	uint8_t checksum;
+	uint16_t name2[6];
+	uint16_t cluster;
+	uint16_t name3[2];
+} __attribute__((packed));
+
+struct fat_node {
+	char *name;
+	char *src;
+	int is_dir;
+	unsigned long long size;
+	time_t mtime;
+
+	char short_name[11];
+	uint8_t nt_case;
+	uint16_t lfn[255];
+	unsigned int lfn_len;	/* 0 if the short name is enough */
+
+	unsigned int entries;	/* directory entries used by the children */
+	uint32_t cluster;
+	uint32_t clusters;
+
+	struct fat_node *parent;
+	struct fat_node *children;
+	struct fat_node *last_child;
+	struct fat_node *next;
+};
+
+struct fat_fs {
+	struct image *image;
+	int fd;
+	int bits;
+	uint32_t sectors;
+	uint32_t reserved;
+	uint32_t fat_sectors;
+	uint32_t root_sectors;
+	uint32_t cluster_sectors;
+	uint32_t data_sector;
+	uint32_t clusters;
+	uint32_t next_cluster;
+	uint32_t *fat;
+	const char *label;
+	uint32_t volume_id;
+	struct fat_node *root;
+};
+
+static void fat_free_node(struct fat_node *node)
+{
+	while (node) {
+		struct fat_node *next = node->next;
+
+		fat_free_node(node->children);
+		free(node->name);
+		free(node->src);
+		free(node);
+		node = next;
+	}
+}
+
+static struct fat_node *fat_find_child(struct fat_node *dir, const char *name)
+{
+	struct fat_node *child;
+
+	for (child = dir->children; child; child = child->next) {
+		if (!strcasecmp(child->name, name))
+			return child;
+	}
+	return NULL;
+}
+
+static struct fat_node *fat_add_child(struct fat_node *dir, const char *name)
+{
+	struct fat_node *node = xzalloc(sizeof(*node));
+
+	node->name = strdup(name);
+	node->parent = dir;
+	if (dir->last_child)
+		dir->last_child->next = node;
+	else
+		dir->children = node;
+	dir->last_child = node;
+	return node;
+}
+
+static int fat_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int fat_add_tree(struct fat_fs *fs, struct fat_node *dir, const char *name,
+			const char *src, int skip_hidden);
+
+/* add the contents of directory @src to @dir, sorted like a shell glob */
+static int fat_add_dir_contents(struct fat_fs *fs, struct fat_node *dir,
+				const char *src, int skip_hidden)
+{
+	char **names = NULL;
+	unsigned int count = 0, i;
+	struct dirent *d;
+	DIR *dirp;
+	int ret = 0;
+
+	dirp = opendir(src);
+	if (!dirp) {
+		ret = -errno;
+		image_error(fs->image, "opendir %s: %s\n", src, strerror(errno));
+		return ret;
+	}
+	while ((d = readdir(dirp))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if (skip_hidden && d->d_name[0] == '.')
+			continue;
+		names = xrealloc(names, (count + 1) * sizeof(*names));
+		names[count++] = strdup(d->d_name);
+	}
+	closedir(dirp);
+
+	qsort(names, count, sizeof(*names), fat_name_cmp);
+	for (i = 0; i < count; i++) {
+		char *path;
+
+		if (!ret) {
+			xasprintf(&path, "%s/%s", src, names[i]);
+			ret = fat_add_tree(fs, dir, names[i], path, 0);
+			free(path);
+		}
+		free(names[i]);
+	}
+	free(names);
+	return ret;
+}
+
+/* add file or directory @src as @name to @dir, like 'mcopy -s -p' */
+static int fat_add_tree(struct fat_fs *fs, struct fat_node *dir, const char *name,
+			const char *src, int skip_hidden)
+{
+	struct fat_node *node;
+	struct stat s;
+
+	if (stat(src, &s)) {
+		int ret = -errno;
+		image_error(fs->image, "stat %s: %s\n", src, strerror(errno));
+		return ret;
+	}
+
+	node = fat_find_child(dir, name);
+	if (node && (!node->is_dir || !S_ISDIR(s.st_mode))) {
+		image_error(fs->image, "'%s' is added twice\n", name);
+		return -EEXIST;
+	}
+	if (!node)
+		node = fat_add_child(dir, name);
+	node->mtime = s.st_mtime;
+
+	if (S_ISDIR(s.st_mode)) {
+		node->is_dir = 1;
+		return fat_add_dir_contents(fs, node, src, skip_hidden);
+	}
+
+	if (s.st_size > 0xffffffffLL) {
+		image_error(fs->image, "%s is too large for FAT\n", src);
+		return -EFBIG;
+	}
+	node->src = strdup(src);
+	node->size = s.st_size;
+	return 0;
+}
+
+/* add @src at @target, creating the directories leading to it like 'mmd -D s' */
+static int fat_add_path(struct fat_fs *fs, const char *target, const char *src)
+{
+	struct fat_node *dir = fs->root;
+	char *path = strdupa(target), *next;
+	const char *name;
+
+	while ((next = strchr(path, '/')) != NULL) {
+		struct fat_node *node;
+
+		*next = '\0';
+		if (*path) {
+			node = fat_find_child(dir, path);
+			if (node && !node->is_dir) {
+				image_error(fs->image, "'%s' is not a directory\n", path);
+				return -ENOTDIR;
+			}
+			if (!node) {
+				node = fat_add_child(dir, path);
+				node->is_dir = 1;
+				node->mtime = time(NULL);
+			}
+			dir = node;
+		}
+		path = next + 1;
+	}
+
+	name = *path ? path : strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+	return fat_add_tree(fs, dir, name, src, 0);
+}
+
+static int fat_utf8_to_ucs2(const char *in, uint16_t *out, unsigned int max)
+{
+	const unsigned char *p = (const unsigned char *)in;
+	unsigned int len = 0;
+
+	while (*p) {
+		uint32_t c = *p++;
+		int extra = 0;
+
+		if (c >= 0xf0) {
+			c &= 0x07;
+			extra = 3;
+		} else if (c >= 0xe0) {
+			c &= 0x0f;
+			extra = 2;
+		} else if (c >= 0xc0) {
+			c &= 0x1f;
+			extra = 1;
+		}
+		while (extra-- && (*p & 0xc0) == 0x80)
+			c = (c << 6) | (*p++ & 0x3f);
+		if (len == max)
+			return -ENAMETOOLONG;
+		out[len++] = c > 0xffff ? '_' : c;
+	}
+	return len;
+}
+
+static int fat_valid_short_char(char c)
+{
+	return isupper((unsigned char)c) || isdigit((unsigned char)c) ||
+		(c && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+/*
+ * Try to store @name as a plain 8.3 entry. Names that only differ from one
+ * by being all lower case in the base or extension use the NT case bits,
+ * like mtools and Windows do.
+ */
+static int fat_plain_short_name(const char *name, char out[11], uint8_t *nt_case)
+{
+	const char *dot = strrchr(name, '.');
+	size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+	size_t ext_len = dot ? strlen(dot + 1) : 0;
+	int part, i;
+
+	if (base_len < 1 || base_len > 8 || ext_len > 3 || (dot && !ext_len))
+		return 0;
+
+	memset(out, ' ', 11);
+	*nt_case = 0;
+	for (part = 0; part < 2; part++) {
+		const char *src = part ? dot + 1 : name;
+		size_t len = part ? ext_len : base_len;
+		int lower = 0, upper = 0;
+
+		for (i = 0; i < (int)len; i++) {
+			char c = src[i];
+
+			if (islower((unsigned char)c)) {
+				lower = 1;
+				c = toupper((unsigned char)c);
+			} else if (isupper((unsigned char)c)) {
+				upper = 1;
+			}
+			if (!fat_valid_short_char(c))
+				return 0;
+			out[(part ? 8 : 0) + i] = c;
+		}
+		if (lower && upper)
+			return 0;
+		if (lower)
+			*nt_case |= part ? FAT_NT_LOWER_EXT : FAT_NT_LOWER_BASE;
+	}
+	return 1;
+}
+
+static int fat_short_name_used(struct fat_node *dir, struct fat_node *upto,
+			       const char short_name[11])
+{
+	struct fat_node *child;
+
+	for (child = dir->children; child && child != upto; child = child->next) {
+		if (!memcmp(child->short_name, short_name, 11))
+			return 1;
+	}
+	return 0;
+}
+
+/* generate a unique 'BASIS~N.EXT' alias for a name that needs a long entry */
+static int fat_alias_short_name(struct fat_fs *fs, struct fat_node *dir,
+				struct fat_node *node)
+{
+	char basis[8], ext[3], *out = node->short_name;
+	const char *dot = strrchr(node->name, '.');
+	const char *p;
+	int base_len = 0, ext_len = 0;
+	unsigned int n;
+
+	if (dot == node->name)
+		dot = NULL;
+	for (p = node->name; *p && p != dot; p++) {
+		char c = toupper((unsigned char)*p);
+
+		if (c == ' ' || c == '.')
+			continue;
+		if (base_len < 8)
+			basis[base_len++] = fat_valid_short_char(c) ? c : '_';
+	}
+	for (p = dot ? dot + 1 : ""; *p && ext_len < 3; p++) {
+		char c = toupper((unsigned char)*p);
+
+		if (c == ' ' || c == '.')
+			continue;
+		ext[ext_len++] = fat_valid_short_char(c) ? c : '_';
+	}
+
+	for (n = 1; n < 1000000; n++) {
+		char tail[8];
+		int tail_len = snprintf(tail, sizeof(tail), "~%u", n);
+		int keep = min(base_len, 8 - tail_len);
+
+		memset(out, ' ', 11);
+		memcpy(out, basis, keep);
+		memcpy(out + keep, tail, tail_len);
+		memcpy(out + 8, ext, ext_len);
+		if (!fat_short_name_used(dir, node, out))
+			return 0;
+	}
+	image_error(fs->image, "no short name left for '%s'\n", node->name);
+	return -EEXIST;
+}
+
+static int fat_checksum(const char short_name[11])
+{
+	uint8_t sum = 0;
+	int i;
+
+	for (i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)short_name[i];
+	return sum;
+}
+
+/* assign short names and count the directory entries of @dir, recursively */
+static int fat_plan_names(struct fat_fs *fs, struct fat_node *dir)
+{
+	struct fat_node *child;
+	int ret;
+
+	dir->entries = dir == fs->root ? !!*fs->label : 2;
+	for (child = dir->children; child; child = child->next) {
+		if (!fat_plain_short_name(child->name, child->short_name, &child->nt_case) ||
+		    fat_short_name_used(dir, child, child->short_name)) {
+			ret = fat_utf8_to_ucs2(child->name, child->lfn, ARRAY_SIZE(child->lfn));
+			if (ret < 0) {
+				image_error(fs->image, "name too long: '%s'\n", child->name);
+				return ret;
+			}
+			child->lfn_len = ret;
+			child->nt_case = 0;
+			ret = fat_alias_short_name(fs, dir, child);
+			if (ret)
+				return ret;
+		}
+		dir->entries += 1 + (child->lfn_len + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS;
+		if (child->is_dir) {
+			ret = fat_plan_names(fs, child);
+			if (ret)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+static uint32_t fat_eoc(struct fat_fs *fs)
+{
+	return fs->bits == 12 ? 0xfff : fs->bits == 16 ? 0xffff : 0x0fffffff;
+}
+
+/* give @node a contiguous chain of clusters for @bytes */
+static int fat_alloc(struct fat_fs *fs, struct fat_node *node, unsigned long long bytes)
+{
+	unsigned long long cluster_size = fs->cluster_sectors * FAT_SECTOR_SIZE;
+	uint32_t i, count = (bytes + cluster_size - 1) / cluster_size;
+
+	if (!count)
+		return 0;
+	if (fs->next_cluster + count > fs->clusters + 2) {
+		image_error(fs->image, "not enough space for '%s'\n",
+			    node->name ? node->name : "/");
+		return -ENOSPC;
+	}
+	node->cluster = fs->next_cluster;
+	node->clusters = count;
+	for (i = 0; i < count; i++)
+		fs->fat[node->cluster + i] = i + 1 < count ? node->cluster + i + 1 : fat_eoc(fs);
+	fs->next_cluster += count;
+	return 0;
+}
+
+static int fat_plan_clusters(struct fat_fs *fs, struct fat_node *dir)
+{
+	struct fat_node *child;
+	int ret;
+
+	if (dir != fs->root || fs->bits == 32) {
+		/* even an empty FAT32 root directory needs a cluster */
+		ret = fat_alloc(fs, dir, (unsigned long long)(dir->entries ? dir->entries : 1) *
+				FAT_DIRENT_SIZE);
+		if (ret)
+			return ret;
+	} else if (dir->entries > FAT_ROOT_ENTRIES) {
+		image_error(fs->image, "too many entries in the root directory\n");
+		return -ENOSPC;
+	}
+	for (child = dir->children; child; child = child->next) {
+		ret = child->is_dir ? fat_plan_clusters(fs, child) :
+			fat_alloc(fs, child, child->size);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* find the smallest cluster size that makes a valid FAT@bits file system */
+static int fat_plan_bits(struct fat_fs *fs, unsigned long long size, int bits)
+{
+	uint32_t min_cluster_size = 0, min_clusters, max_clusters;
+
+	fs->bits = bits;
+	fs->sectors = size / FAT_SECTOR_SIZE;
+	fs->reserved = bits == 32 ? 32 : 1;
+	fs->root_sectors = bits == 32 ? 0 :
+		FAT_ROOT_ENTRIES * FAT_DIRENT_SIZE / FAT_SECTOR_SIZE;
+	min_clusters = bits == 12 ? 1 : bits == 16 ? 4085 : 65525;
+	max_clusters = bits == 12 ? 4084 : bits == 16 ? 65524 : 0x0ffffff5;
+	if (bits == 32)
+		min_cluster_size = size <= 8ULL << 30 ? 4096 : size <= 16ULL << 30 ? 8192 :
+			size <= 32ULL << 30 ? 16384 : 32768;
+
+	for (fs->cluster_sectors = 1; fs->cluster_sectors <= 128; fs->cluster_sectors <<= 1) {
+		uint32_t fat_sectors = 0, prev;
+
+		if (fs->cluster_sectors * FAT_SECTOR_SIZE < min_cluster_size)
+			continue;
+
+		/* the FAT size depends on the cluster count and vice versa */
+		do {
+			uint32_t meta;
+
+			prev = fat_sectors;
+			meta = fs->reserved + 2 * prev + fs->root_sectors;
+			if (meta >= fs->sectors)
+				return -ENOSPC;
+			fs->clusters = (fs->sectors - meta) / fs->cluster_sectors;
+			fat_sectors = (((fs->clusters + 2ULL) * bits + 7) / 8 +
+				       FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+		} while (fat_sectors > prev);
+		fs->fat_sectors = prev;
+
+		if (fs->clusters < min_clusters)
+			return -ENOSPC;
+		if (fs->clusters <= max_clusters) {
+			fs->data_sector = fs->reserved + 2 * fs->fat_sectors + fs->root_sectors;
+			fs->next_cluster = 2;
+			return 0;
+		}
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Pick the FAT type from the volume size, close to what mkdosfs does: FAT12
+ * below 16 MiB, FAT16 below 512 MiB and FAT32 above. Sizes a type cannot
+ * cover fall back to the next smaller one.
+ */
+static int fat_plan_layout(struct fat_fs *fs, unsigned long long size)
+{
+	int bits = size < 16 * 1024 * 1024 ? 12 : size < 512 * 1024 * 1024 ? 16 : 32;
+
+	for (; bits >= 12; bits = bits == 32 ? 16 : 12) {
+		if (!fat_plan_bits(fs, size, bits))
+			return 0;
+		if (bits == 12)
+			break;
+	}
+	return -ENOSPC;
+}
+
+/* FAT date and time, in local time like mtools; 1980-01-01 for anything older */
+static uint16_t fat_date(time_t t)
+{
+	struct tm lt;
+
+	localtime_r(&t, &lt);
+	if (lt.tm_year < 80)
+		return htole16((1 << 5) | 1);
+	return htole16(((lt.tm_year - 80) << 9) | ((lt.tm_mon + 1) << 5) | lt.tm_mday);
+}
+
+static uint16_t fat_time(time_t t)
+{
+	struct tm lt;
+
+	localtime_r(&t, &lt);
+	if (lt.tm_year < 80)
+		return 0;
+	return htole16((lt.tm_hour << 11) | (lt.tm_min << 5) | (lt.tm_sec / 2));
+}
+
+static void fat_set_dirent(struct fat_dirent *e, const char name[11], uint8_t attr,
+			   uint32_t cluster, uint32_t size, time_t mtime)
+{
+	memcpy(e->name, name, 11);
+	e->attr = attr;
+	e->cluster_hi = htole16(cluster >> 16);
+	e->cluster_lo = htole16(cluster & 0xffff);
+	e->size = htole32(size);
+	e->mdate = e->cdate = e->adate = fat_date(mtime);
+	e->mtime = e->ctime = fat_time(mtime);
+}
+
+static void fat_set_lfn(struct fat_lfn_dirent *e, const struct fat_node *node,
+			unsigned int seq, int last)
+{
+	unsigned int i;
+
+	memset(e, 0, sizeof(*e));
+	e->seq = seq | (last ? 0x40 : 0);
+	e->attr = FAT_ATTR_LFN;
+	e->checksum = fat_checksum(node->short_name);
+	for (i = 0; i < FAT_LFN_CHARS; i++) {
+		unsigned int pos = (seq - 1) * FAT_LFN_CHARS + i;
+		uint16_t c = pos < node->lfn_len ? node->lfn[pos] :
+			pos == node->lfn_len ? 0 : 0xffff;
+
+		c = htole16(c);
+		if (i < 5)
+			memcpy(&e->name1[i], &c, 2);
+		else if (i < 11)
+			memcpy(&e->name2[i - 5], &c, 2);
+		else
+			memcpy(&e->name3[i - 11], &c, 2);
+	}
+}
+
+static int fat_pwrite(struct fat_fs *fs, const void *buf, size_t len,
+		      unsigned long long offset)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t w = pwrite(fs->fd, p, len, offset);
+
+		if (w <= 0) {
+			int ret = w < 0 ? -errno : -EIO;
+			image_error(fs->image, "write %s: %s\n",
+				    imageoutfile(fs->image), strerror(-ret));
+			return ret;
+		}
+		p += w;
+		len -= w;
+		offset += w;
+	}
+	return 0;
+}
+
+static unsigned long long fat_cluster_offset(struct fat_fs *fs, uint32_t cluster)
+{
+	return ((unsigned long long)fs->data_sector +
+		(unsigned long long)(cluster - 2) * fs->cluster_sectors) * FAT_SECTOR_SIZE;
+}
+
+static int fat_write_file(struct fat_fs *fs, struct fat_node *node)
+{
+	unsigned long long offset = fat_cluster_offset(fs, node->cluster);
+	char buf[64 * 1024];
+	ssize_t r;
+	int in, ret = 0;
+
+	in = open(node->src, O_RDONLY);
+	if (in < 0) {
+		ret = -errno;
+		image_error(fs->image, "open %s: %s\n", node->src, strerror(errno));
+		return ret;
+	}
+	while ((r = read(in, buf, sizeof(buf))) > 0) {
+		ret = fat_pwrite(fs, buf, r, offset);
+		if (ret)
+			break;
+		offset += r;
+	}
+	if (r < 0) {
+		ret = -errno;
+		image_error(fs->image, "read %s: %s\n", node->src, strerror(errno));
+	}
+	close(in);
+	return ret;
+}
+
+static int fat_write_dir(struct fat_fs *fs, struct fat_node *dir)
+{
+	unsigned long long size, offset;
+	struct fat_dirent *entries;
+	struct fat_node *child;
+	unsigned int n = 0;
+	int ret;
+
+	if (dir == fs->root && fs->bits != 32) {
+		size = FAT_ROOT_ENTRIES * FAT_DIRENT_SIZE;
+		offset = (unsigned long long)(fs->reserved + 2 * fs->fat_sectors) * FAT_SECTOR_SIZE;
+	} else {
+		size = (unsigned long long)dir->clusters * fs->cluster_sectors * FAT_SECTOR_SIZE;
+		offset = fat_cluster_offset(fs, dir->cluster);
+	}
+	entries = xzalloc(size);
+
+	if (dir == fs->root) {
+		if (*fs->label) {
+			char label[11];
+
+			memset(label, ' ', 11);
+			memcpy(label, fs->label, strlen(fs->label));
+			fat_set_dirent(&entries[n++], label, FAT_ATTR_VOLUME, 0, 0, time(NULL));
+		}
+	} else {
+		uint32_t parent = dir->parent == fs->root ? 0 : dir->parent->cluster;
+
+		fat_set_dirent(&entries[n++], ".          ", FAT_ATTR_DIR, dir->cluster, 0, dir->mtime);
+		fat_set_dirent(&entries[n++], "..         ", FAT_ATTR_DIR, parent, 0, dir->mtime);
+	}
+
+	for (child = dir->children; child; child = child->next) {
+		unsigned int seq = (child->lfn_len + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS;
+		int last = 1;
+
+		/* long name entries come first, in reverse order */
+		for (; seq > 0; seq--, last = 0)
+			fat_set_lfn((struct fat_lfn_dirent *)&entries[n++], child, seq, last);
+
+		fat_set_dirent(&entries[n], child->short_name,
+			       child->is_dir ? FAT_ATTR_DIR : FAT_ATTR_ARCHIVE,
+			       child->cluster, child->is_dir ? 0 : child->size, child->mtime);
+		entries[n++].nt_case = child->nt_case;
+	}
+
+	ret = fat_pwrite(fs, entries, size, offset);
+	free(entries);
+	if (ret)
+		return ret;
+
+	for (child = dir->children; child; child = child->next) {
+		ret = child->is_dir ? fat_write_dir(fs, child) :
+			child->size ? fat_write_file(fs, child) : 0;
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int fat_write_fats(struct fat_fs *fs)
+{
+	size_t size = (size_t)fs->fat_sectors * FAT_SECTOR_SIZE;
+	uint8_t *buf = xzalloc(size);
+	uint32_t i;
+	int ret = 0, n;
+
+	/* media descriptor in the first entry */
+	fs->fat[0] = (fat_eoc(fs) & ~0xffU) | 0xf8;
+	fs->fat[1] = fat_eoc(fs);
+	for (i = 0; i < fs->clusters + 2; i++) {
+		uint32_t v = fs->fat[i];
+
+		if (fs->bits == 12) {
+			size_t off = i * 3 / 2;
+
+			if (i & 1) {
+				buf[off] = (buf[off] & 0x0f) | ((v << 4) & 0xf0);
+				buf[off + 1] = (v >> 4) & 0xff;
+			} else {
+				buf[off] = v & 0xff;
+				buf[off + 1] = (buf[off + 1] & 0xf0) | ((v >> 8) & 0x0f);
+			}
+		} else if (fs->bits == 16) {
+			uint16_t le = htole16(v);
+			memcpy(buf + i * 2, &le, 2);
+		} else {
+			uint32_t le = htole32(v);
+			memcpy(buf + i * 4, &le, 4);
+		}
+	}
+	for (n = 0; n < 2 && !ret; n++)
+		ret = fat_pwrite(fs, buf, size,
+				 (unsigned long long)(fs->reserved + n * fs->fat_sectors) * FAT_SECTOR_SIZE);
+	free(buf);
+	return ret;
+}
+
+static int fat_write_boot(struct fat_fs *fs)
+{
+	uint8_t sector[FAT_SECTOR_SIZE];
+	struct fat_boot_sector *bs = (struct fat_boot_sector *)sector;
+	uint32_t volume_id = fs->volume_id;
+	char label[11];
+	int ret;
+
+	memset(label, ' ', 11);
+	memcpy(label, *fs->label ? fs->label : "NO NAME", strlen(*fs->label ? fs->label : "NO NAME"));
+
+	memset(sector, 0, sizeof(sector));
+	bs->jump[0] = 0xeb;
+	bs->jump[1] = fs->bits == 32 ? 0x58 : 0x3c;
+	bs->jump[2] = 0x90;
+	memcpy(bs->oem, "genimage", 8);
+	bs->bytes_per_sector = htole16(FAT_SECTOR_SIZE);
+	bs->sectors_per_cluster = fs->cluster_sectors;
+	bs->reserved_sectors = htole16(fs->reserved);
+	bs->fats = 2;
+	bs->root_entries = htole16(fs->bits == 32 ? 0 : FAT_ROOT_ENTRIES);
+	bs->media = 0xf8;
+	bs->sectors_per_track = htole16(32);
+	bs->heads = htole16(64);
+	if (fs->sectors < 65536 && fs->bits != 32)
+		bs->total_sectors16 = htole16(fs->sectors);
+	else
+		bs->total_sectors32 = htole32(fs->sectors);
+
+	if (fs->bits == 32) {
+		bs->fat32.fat_sectors32 = htole32(fs->fat_sectors);
+		bs->fat32.root_cluster = htole32(fs->root->cluster);
+		bs->fat32.fsinfo_sector = htole16(1);
+		bs->fat32.backup_sector = htole16(6);
+		bs->fat32.drive = 0x80;
+		bs->fat32.signature = 0x29;
+		bs->fat32.volume_id = htole32(volume_id);
+		memcpy(bs->fat32.label, label, 11);
+		memcpy(bs->fat32.fs_type, "FAT32   ", 8);
+	} else {
+		bs->fat_sectors16 = htole16(fs->fat_sectors);
+		bs->fat16.drive = 0x80;
+		bs->fat16.signature = 0x29;
+		bs->fat16.volume_id = htole32(volume_id);
+		memcpy(bs->fat16.label, label, 11);
+		memcpy(bs->fat16.fs_type, fs->bits == 12 ? "FAT12   " : "FAT16   ", 8);
+	}
+	sector[510] = 0x55;
+	sector[511] = 0xaa;
+
+	ret = fat_pwrite(fs, sector, sizeof(sector), 0);
+	if (ret || fs->bits != 32)
+		return ret;
+
+	ret = fat_pwrite(fs, sector, sizeof(sector), 6 * FAT_SECTOR_SIZE);
+	if (ret)
+		return ret;
+
+	/* FSInfo sector and its backup */
+	{
+		uint8_t info[FAT_SECTOR_SIZE];
+		uint32_t v;
+
+		memset(info, 0, sizeof(info));
+		v = htole32(0x41615252);
+		memcpy(info, &v, 4);
+		v = htole32(0x61417272);
+		memcpy(info + 484, &v, 4);
+		v = htole32(fs->clusters + 2 - fs->next_cluster);
+		memcpy(info + 488, &v, 4);
+		v = htole32(fs->next_cluster);
+		memcpy(info + 492, &v, 4);
+		v = htole32(0xaa550000);
+		memcpy(info + 508, &v, 4);
+		ret = fat_pwrite(fs, info, sizeof(info), FAT_SECTOR_SIZE);
+		if (!ret)
+			ret = fat_pwrite(fs, info, sizeof(info), 7 * FAT_SECTOR_SIZE);
+	}
+	return ret;
+}
+
+/*
+ * The volume-id option, or like mkdosfs the time of creation, so images
+ * generated one after the other do not share a serial number.
+ */
+static uint32_t vfat_volume_id(struct image *image)
+{
+	char *volume_id = cfg_getstr(image->imagesec, "volume-id");
+	struct timeval tv;
+
+	if (volume_id && *volume_id)
+		return strtoul(volume_id, NULL, 16);
+	gettimeofday(&tv, NULL);
+	return (uint32_t)(tv.tv_sec << 20) | (uint32_t)tv.tv_usec;
+}
+
+static int vfat_generate_native(struct image *image)
+{
+	struct fat_fs fs = { .image = image, .fd = -1 };
+	struct partition *part;
+	char *label = cfg_getstr(image->imagesec, "label");
+	int ret;
+
+	fs.label = label ? label : "";
+	fs.volume_id = vfat_volume_id(image);
+	ret = fat_plan_layout(&fs, image->size);
+	if (ret) {
+		image_error(image, "size %lld is too small for a FAT file system\n", image->size);
+		return ret;
+	}
+
+	fs.root = xzalloc(sizeof(*fs.root));
+	fs.root->is_dir = 1;
+	fs.root->mtime = time(NULL);
+
+	list_for_each_entry(part, &image->partitions, list) {
+		struct image *child = image_get(part->image);
+
+		image_info(image, "adding file '%s' as '%s' ...\n",
+				child->file, *part->name ? part->name : child->file);
+		ret = fat_add_path(&fs, part->name, imageoutfile(child));
+		if (ret)
+			goto out;
+	}
+	if (list_empty(&image->partitions) && !image->empty) {
+		ret = fat_add_dir_contents(&fs, fs.root, mountpath(image), 1);
+		if (ret)
+			goto out;
+	}
+
+	ret = fat_plan_names(&fs, fs.root);
+	if (ret)
+		goto out;
+	fs.fat = xzalloc(((size_t)fs.clusters + 2) * sizeof(*fs.fat));
+	ret = fat_plan_clusters(&fs, fs.root);
+	if (ret)
+		goto out;
+
+	image_debug(image, "FAT%d, %u clusters of %u bytes, %u used\n", fs.bits,
+		    fs.clusters, fs.cluster_sectors * FAT_SECTOR_SIZE, fs.next_cluster - 2);
+
+	ret = prepare_image(image, image->size);
+	if (ret)
+		goto out;
+	fs.fd = open_file(image, imageoutfile(image), 0);
+	if (fs.fd < 0) {
+		ret = fs.fd;
+		goto out;
+	}
+
+	ret = fat_write_boot(&fs);
+	if (!ret)
+		ret = fat_write_fats(&fs);
+	if (!ret)
+		ret = fat_write_dir(&fs, fs.root);
+
+out:
+	if (fs.fd >= 0 && close(fs.fd) && !ret)
+		ret = -errno;
+	free(fs.fat);
+	fat_free_node(fs.root);
+	return ret;
+}
+
+static int vfat_generate_mtools(struct image *image)
 {
 	int ret;
 	struct partition *part;
 	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
 	char *label = cfg_getstr(image->imagesec, "label");
+	char *volume_id = cfg_getstr(image->imagesec, "volume-id");
 
 	if (label && label[0] != '\0')
 		xasprintf(&label, "-n '%s'", label);
 	else
 		label = "";
+	if (volume_id && volume_id[0] != '\0')
+		xasprintf(&volume_id, "-i %s", volume_id);
+	else
+		volume_id = "";
 
 	ret = prepare_image(image, image->size);
 	if (ret)
 		return ret;
 
-	ret = systemp(image, "%s %s %s '%s'", get_opt("mkdosfs"),
-			extraargs, label, imageoutfile(image));
+	ret = systemp(image, "%s %s %s %s '%s'", get_opt("mkdosfs"),
+			extraargs, label, volume_id, imageoutfile(image));
 	if (ret)
 		return ret;
 
@@ -86,9 +1053,21 @@ static int vfat_generate(struct image *image)
 	return ret;
 }
 
+static int vfat_generate(struct image *image)
+{
+	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
+
+	/* mkdosfs options can only be honoured by mkdosfs itself */
+	if (extraargs && *extraargs)
+		return vfat_generate_mtools(image);
+
+	return vfat_generate_native(image);
+}
+
 static int vfat_setup(struct image *image, cfg_t *cfg)
 {
 	char *label = cfg_getstr(image->imagesec, "label");
+	char *volume_id = cfg_getstr(image->imagesec, "volume-id");
 
 	if (!image->size) {
 		image_error(image, "no size given or must not be zero\n");
@@ -100,6 +1079,12 @@ static int vfat_setup(struct image *image, cfg_t *cfg)
 		return -EINVAL;
 	}
 
+	if (volume_id && *volume_id &&
+	    (strlen(volume_id) > 8 || strspn(volume_id, "0123456789abcdefABCDEF") != strlen(volume_id))) {
+		image_error(image, "vfat volume-id must be up to 8 hex digits\n");
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
@@ -136,6 +1121,7 @@ static cfg_opt_t file_opts[] = {
 static cfg_opt_t vfat_opts[] = {
 	CFG_STR("extraargs", "", CFGF_NONE),
 	CFG_STR("label", "", CFGF_NONE),
+	CFG_STR("volume-id", "", CFGF_NONE),
 	CFG_STR_LIST("files", NULL, CFGF_NONE),
 	CFG_SEC("file", file_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_END()
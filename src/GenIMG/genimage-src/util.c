@@ -28,6 +28,7 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #ifdef __linux__
 #include <linux/fs.h>
@@ -36,15 +37,28 @@
 #define HAVE_FIEMAP 1
 #define HAVE_FALLOCATE 1
 #define HAVE_BLKRRPART 1
+#define HAVE_O_DIRECT 1
 #elif defined(__APPLE__)
 #define HAVE_FIEMAP 0
 #define HAVE_FALLOCATE 0
 #define HAVE_BLKRRPART 0
+#define HAVE_O_DIRECT 0
 #else
 /* Other Unix-like systems - assume no Linux-specific features */
 #define HAVE_FIEMAP 0
 #define HAVE_FALLOCATE 0
 #define HAVE_BLKRRPART 0
+#define HAVE_O_DIRECT 0
+#endif
+
+#ifdef __APPLE__
+#include <libkern/OSByteOrder.h>
+#define le16toh(x) OSSwapLittleToHostInt16(x)
+#define le32toh(x) OSSwapLittleToHostInt32(x)
+#elif defined(__linux__)
+#include <endian.h>
+#else
+#include <sys/endian.h>
 #endif
 
 #include "genimage.h"
@@ -70,7 +84,7 @@ static int loglevel(void)
 
 static int skip_log(int level)
 {
-	return (level > loglevel());
+	return (level > loglevel() || !log_genimage_enabled(level));
 }
 
 static void xvasprintf(char **strp, const char *fmt, va_list ap)
@@ -113,33 +127,23 @@ static void image_log(struct image *image, int level, const char *fmt,
 		      va_list args)
 {
 	char *buf;
-	const char *p;
 
 	if (skip_log(level))
 		return;
 
 	xvasprintf(&buf, fmt, args);
 
-	switch (level) {
-		case 0:
-			p = "[GenIMG ERROR]";
-			break;
-		case 1:
-			p = "[GenIMG INFO]";
-			break;
-		case 2:
-			p = "[GenIMG DEBUG]";
-			break;
-		case 3:
-		default:
-			p = "[GenIMG VDEBUG]";
-			break;
-	}
+	/* the embedding program adds the level and writes it out */
+	if (image) {
+		char *line;
 
-	if (image)
-		printf("%s: %s(%s): %s", p, image->handler ? image->handler->type : "unknown", image->file, buf);
-	else
-		printf("%s: %s", p, buf);
+		xasprintf(&line, "%s(%s): %s", image->handler ? image->handler->type : "unknown",
+			  image->file, buf);
+		log_genimage(level, line);
+		free(line);
+	} else {
+		log_genimage(level, buf);
+	}
 
 	free(buf);
 }
@@ -223,6 +227,7 @@ int systemp(struct image *image, const char *fmt, ...)
 
 	image_info(image, "cmd: \"%s\"%s\n", buf, o);
 
+	stats_begin();
 	pid = fork();
 
 	if (!pid) {
@@ -253,6 +258,7 @@ int systemp(struct image *image, const char *fmt, ...)
 		}
 	} else {
 		ret = waitpid(pid, &status, 0);
+		stats_end_detail("systemp", buf, 0);
 		if (ret < 0) {
 			ret = -errno;
 			error("Failed to wait for command execution: %s\n", strerror(errno));
@@ -544,6 +550,609 @@ int prepare_image(struct image *image, unsigned long long size)
 	return 0;
 }
 
+static int pwrite_all(int fd, const char *buf, size_t len, unsigned long long offset)
+{
+	while (len) {
+		ssize_t w = pwrite(fd, buf, len, offset);
+
+		if (w < 0)
+			return -errno;
+		if (w == 0)
+			return -EIO;
+		buf += w;
+		len -= w;
+		offset += w;
+	}
+	return 0;
+}
+
+/*
+ * Copy loops write their data through a zero_run: blocks that only contain
+ * zeros are not written but collected and handed to write_bytes() as one
+ * range once the run ends, so they become holes in regular output files.
+ */
+#define ZERO_BLOCK_SIZE		4096
+#define COPY_BUF_SIZE		(1024 * 1024)
+
+struct zero_run {
+	int fd;
+	int sparse;
+	unsigned long long start, len;
+};
+
+static void zero_run_init(struct zero_run *z, int fd)
+{
+	struct stat st;
+
+	z->fd = fd;
+	z->sparse = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	z->start = z->len = 0;
+}
+
+static int zero_run_flush(struct zero_run *z)
+{
+	int ret;
+
+	if (!z->len)
+		return 0;
+	ret = write_bytes(z->fd, z->len, z->start, 0);
+	z->len = 0;
+	return ret;
+}
+
+static int is_zero(const char *buf, size_t len)
+{
+	return !len || (!buf[0] && !memcmp(buf, buf + 1, len - 1));
+}
+
+static int zero_run_write(struct zero_run *z, const char *buf, size_t len,
+			  unsigned long long offset)
+{
+	size_t pos = 0, now, data;
+	int ret;
+
+	if (!z->sparse)
+		return pwrite_all(z->fd, buf, len, offset);
+
+	while (pos < len) {
+		now = min(len - pos, ZERO_BLOCK_SIZE);
+		if (is_zero(buf + pos, now)) {
+			if (z->len && z->start + z->len != offset + pos) {
+				ret = zero_run_flush(z);
+				if (ret)
+					return ret;
+			}
+			if (!z->len)
+				z->start = offset + pos;
+			z->len += now;
+			pos += now;
+			continue;
+		}
+		/* write everything up to the next zero block at once */
+		for (data = now; pos + data < len; data += now) {
+			now = min(len - pos - data, ZERO_BLOCK_SIZE);
+			if (is_zero(buf + pos + data, now))
+				break;
+		}
+		ret = zero_run_flush(z);
+		if (ret)
+			return ret;
+		ret = pwrite_all(z->fd, buf + pos, data, offset + pos);
+		if (ret)
+			return ret;
+		pos += data;
+	}
+	return 0;
+}
+
+/*
+ * Read the header of an Android sparse image from @fd. Returns 1 if @fd
+ * holds a sparse image, 0 if it does not and a negative error code if
+ * it could not be read or the header is not usable.
+ */
+static int read_sparse_header(int fd, struct sparse_header *hdr)
+{
+	ssize_t r;
+
+	r = pread(fd, hdr, sizeof(*hdr), 0);
+	if (r < 0)
+		return -errno;
+	if ((size_t)r < sizeof(*hdr) || le32toh(hdr->magic) != SPARSE_HEADER_MAGIC)
+		return 0;
+	if (le16toh(hdr->major_version) != 1 ||
+	    le16toh(hdr->header_size) < sizeof(*hdr) ||
+	    le16toh(hdr->chunk_header_size) < sizeof(struct sparse_chunk_header) ||
+	    !le32toh(hdr->block_size) || le32toh(hdr->block_size) % 4)
+		return -EINVAL;
+	return 1;
+}
+
+/*
+ * If @filename is an Android sparse image, store the size of the expanded
+ * data in @size and return 1. Returns 0 for any other file.
+ */
+int sparse_image_size(const char *filename, unsigned long long *size)
+{
+	struct sparse_header hdr;
+	int fd, ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = read_sparse_header(fd, &hdr);
+	close(fd);
+	if (ret > 0)
+		*size = (unsigned long long)le32toh(hdr.block_size) *
+			le32toh(hdr.output_blocks);
+	return ret;
+}
+
+static int write_pattern(int fd, unsigned long long size,
+			 unsigned long long offset, uint32_t pattern)
+{
+	const unsigned char *p = (const unsigned char *)&pattern;
+	uint32_t buf[1024];
+	unsigned i;
+	int ret;
+
+	/* a single repeated byte (usually zero) can use write_bytes() */
+	if (p[0] == p[1] && p[0] == p[2] && p[0] == p[3])
+		return write_bytes(fd, size, offset, p[0]);
+
+	for (i = 0; i < ARRAY_SIZE(buf); i++)
+		buf[i] = pattern;
+	while (size) {
+		size_t now = min(size, sizeof(buf));
+
+		ret = pwrite_all(fd, (const char *)buf, now, offset);
+		if (ret)
+			return ret;
+		size -= now;
+		offset += now;
+	}
+	return 0;
+}
+
+/*
+ * Expand the Android sparse image @in_fd into @fd at *@offset. RAW chunks
+ * are copied, FILL chunks are written as a pattern and DONT_CARE chunks are
+ * filled with @byte, which keeps them as holes in regular files when @byte
+ * is zero. At most *@size bytes are written, *@size and *@offset are
+ * advanced past the expanded data.
+ */
+static int insert_sparse_image(struct image *image, int fd, int in_fd,
+			       const char *infile, const struct sparse_header *hdr,
+			       char *buf, size_t buf_size,
+			       unsigned long long *size, unsigned long long *offset,
+			       unsigned char byte)
+{
+	unsigned long long block_size = le32toh(hdr->block_size);
+	unsigned long long in_pos = le16toh(hdr->header_size);
+	unsigned chunk_header_size = le16toh(hdr->chunk_header_size);
+	uint32_t chunks = le32toh(hdr->input_chunks);
+	struct zero_run zero;
+	uint32_t c;
+	int ret;
+
+	zero_run_init(&zero, fd);
+
+	image_debug(image, "expanding %u sparse chunks from %s at offset %llu\n",
+		    chunks, infile, *offset);
+
+	for (c = 0; c < chunks && *size > 0; c++) {
+		struct sparse_chunk_header chunk;
+		unsigned long long len, data, pos;
+		uint32_t pattern;
+		ssize_t r;
+
+		r = pread(in_fd, &chunk, sizeof(chunk), in_pos);
+		if (r < (ssize_t)sizeof(chunk) ||
+		    le32toh(chunk.size) < chunk_header_size) {
+			ret = r < 0 ? -errno : -EINVAL;
+			image_error(image, "%s: failed to read sparse chunk %u: %s\n",
+				    infile, c, strerror(-ret));
+			return ret;
+		}
+		in_pos += chunk_header_size;
+		data = le32toh(chunk.size) - chunk_header_size;
+		len = block_size * le32toh(chunk.blocks);
+		if (len > *size)
+			len = *size;
+
+		switch (le16toh(chunk.chunk_type)) {
+		case SPARSE_CHUNK_RAW:
+			if (data != block_size * le32toh(chunk.blocks)) {
+				image_error(image, "%s: sparse chunk %u has %llu bytes of data for %u blocks\n",
+					    infile, c, data, le32toh(chunk.blocks));
+				return -EINVAL;
+			}
+			for (pos = 0; pos < len; ) {
+				size_t now = min(len - pos, buf_size);
+
+				r = pread(in_fd, buf, now, in_pos + pos);
+				if (r <= 0) {
+					ret = r < 0 ? -errno : -EINVAL;
+					image_error(image, "reading %zu bytes from %s failed: %s\n",
+						    now, infile, strerror(-ret));
+					return ret;
+				}
+				ret = zero_run_write(&zero, buf, r, *offset + pos);
+				if (ret) {
+					image_error(image, "write %zd bytes: %s\n", r, strerror(-ret));
+					return ret;
+				}
+				pos += r;
+			}
+			ret = zero_run_flush(&zero);
+			if (ret) {
+				image_error(image, "writing zeros failed: %s\n", strerror(-ret));
+				return ret;
+			}
+			break;
+		case SPARSE_CHUNK_FILL:
+			if (data < sizeof(pattern) ||
+			    pread(in_fd, &pattern, sizeof(pattern), in_pos) != sizeof(pattern)) {
+				image_error(image, "%s: failed to read fill value of sparse chunk %u\n",
+					    infile, c);
+				return -EINVAL;
+			}
+			ret = write_pattern(fd, len, *offset, pattern);
+			if (ret) {
+				image_error(image, "writing %llu bytes failed: %s\n", len, strerror(-ret));
+				return ret;
+			}
+			break;
+		case SPARSE_CHUNK_DONT_CARE:
+			ret = write_bytes(fd, len, *offset, byte);
+			if (ret) {
+				image_error(image, "writing %llu bytes failed: %s\n", len, strerror(-ret));
+				return ret;
+			}
+			break;
+		case SPARSE_CHUNK_CRC32:
+			len = 0;
+			break;
+		default:
+			image_error(image, "%s: unknown sparse chunk type %#x\n",
+				    infile, le16toh(chunk.chunk_type));
+			return -EINVAL;
+		}
+		in_pos += data;
+		*size -= len;
+		*offset += len;
+	}
+	return 0;
+}
+
+#if HAVE_O_DIRECT
+/*
+ * Writing to block devices (usually SD cards) goes around the page cache:
+ * a reader thread fills one aligned buffer while the other one is written
+ * with O_DIRECT. Holes are handed to the device with BLKZEROOUT instead of
+ * being written, and anything not aligned to the logical block size goes
+ * through a second, buffered descriptor.
+ */
+#define DIRECT_BUF_SIZE		(4 * 1024 * 1024)
+#define DIRECT_BUF_MIN_SIZE	(64 * 1024)
+
+enum direct_chunk_kind {
+	DIRECT_DATA,
+	DIRECT_FILL,
+	DIRECT_END,
+};
+
+struct direct_chunk {
+	enum direct_chunk_kind kind;
+	unsigned long long offset;
+	size_t len;
+	char *buf;
+	int full;
+	int error;
+};
+
+struct direct_copy {
+	struct image *image;
+	const char *infile;
+	int in_fd, dfd, fd;
+	unsigned long long blksz;
+	const struct extent *extents;
+	size_t extent_count;
+	unsigned long long size, offset;
+	unsigned char byte;
+	char *fillbuf;
+	size_t buf_size;
+	struct direct_chunk chunk[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int abort;
+};
+
+/* wait until chunk @n is in state @full, NULL if the writer gave up */
+static struct direct_chunk *direct_get(struct direct_copy *dc, unsigned n, int full)
+{
+	struct direct_chunk *c = &dc->chunk[n & 1];
+	int abort;
+
+	pthread_mutex_lock(&dc->lock);
+	while (c->full != full && !dc->abort)
+		pthread_cond_wait(&dc->cond, &dc->lock);
+	abort = dc->abort;
+	pthread_mutex_unlock(&dc->lock);
+
+	return abort ? NULL : c;
+}
+
+static void direct_put(struct direct_copy *dc, struct direct_chunk *c, int full)
+{
+	pthread_mutex_lock(&dc->lock);
+	c->full = full;
+	pthread_cond_broadcast(&dc->cond);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+static void *direct_reader(void *arg)
+{
+	struct direct_copy *dc = arg;
+	unsigned long long size = dc->size, in_pos = 0;
+	struct direct_chunk *c;
+	unsigned n = 0;
+	size_t e;
+
+	/* the extra round covers the area after the last extent */
+	for (e = 0; e <= dc->extent_count && size > 0; e++) {
+		unsigned long long start, end, len;
+
+		start = e < dc->extent_count ? dc->extents[e].start : in_pos + size;
+		end = e < dc->extent_count ? dc->extents[e].end : start;
+
+		len = min(start - in_pos, size);
+		if (len) {
+			c = direct_get(dc, n++, 0);
+			if (!c)
+				return NULL;
+			c->kind = DIRECT_FILL;
+			c->offset = dc->offset + in_pos;
+			c->len = len;
+			direct_put(dc, c, 1);
+			size -= len;
+			in_pos += len;
+		}
+		while (in_pos < end && size > 0) {
+			ssize_t r;
+
+			c = direct_get(dc, n++, 0);
+			if (!c)
+				return NULL;
+			len = min(end - in_pos, dc->buf_size);
+			len = min(len, size);
+			r = pread(dc->in_fd, c->buf, len, in_pos);
+			if (r < 0) {
+				c->kind = DIRECT_END;
+				c->error = -errno;
+				image_error(dc->image, "reading %llu bytes from %s failed: %s\n",
+					    len, dc->infile, strerror(errno));
+				direct_put(dc, c, 1);
+				return NULL;
+			}
+			c->offset = dc->offset + in_pos;
+			if (r == 0) {
+				/* input is shorter than expected, fill the rest */
+				c->kind = DIRECT_FILL;
+				c->len = size;
+				in_pos += size;
+				size = 0;
+			} else {
+				c->kind = DIRECT_DATA;
+				c->len = r;
+				in_pos += r;
+				size -= r;
+			}
+			direct_put(dc, c, 1);
+		}
+	}
+
+	c = direct_get(dc, n, 0);
+	if (c) {
+		c->kind = DIRECT_END;
+		c->error = 0;
+		direct_put(dc, c, 1);
+	}
+	return NULL;
+}
+
+static int direct_pwrite(struct direct_copy *dc, const char *buf, size_t len,
+			 unsigned long long offset)
+{
+	size_t now = 0;
+	int ret;
+
+	if (!(offset & (dc->blksz - 1)))
+		now = len & ~(dc->blksz - 1);
+	if (now) {
+		ret = pwrite_all(dc->dfd, buf, now, offset);
+		if (ret) {
+			image_error(dc->image, "write %zu bytes: %s\n", now, strerror(-ret));
+			return ret;
+		}
+	}
+	if (len > now) {
+		ret = pwrite_all(dc->fd, buf + now, len - now, offset + now);
+		if (ret) {
+			image_error(dc->image, "write %zu bytes: %s\n", len - now, strerror(-ret));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int direct_fill(struct direct_copy *dc, unsigned long long offset,
+		       unsigned long long len)
+{
+	int ret;
+
+#ifdef BLKZEROOUT
+	if (!dc->byte && !(offset & (dc->blksz - 1)) && len >= dc->blksz) {
+		uint64_t range[2] = { offset, len & ~(dc->blksz - 1) };
+
+		if (ioctl(dc->dfd, BLKZEROOUT, range) == 0) {
+			offset += range[1];
+			len -= range[1];
+		}
+	}
+#endif
+	if (!len)
+		return 0;
+
+	memset(dc->fillbuf, dc->byte, min(len, dc->buf_size));
+	while (len) {
+		size_t now = min(len, dc->buf_size);
+
+		ret = direct_pwrite(dc, dc->fillbuf, now, offset);
+		if (ret)
+			return ret;
+		offset += now;
+		len -= now;
+	}
+	return 0;
+}
+
+/*
+ * O_DIRECT variant of insert_image() for block devices. Returns -EOPNOTSUPP
+ * if the device or the offset are not suitable, the caller then falls back
+ * to the buffered copy.
+ */
+static int insert_image_direct(struct image *image, struct image *sub,
+			       unsigned long long size, unsigned long long offset,
+			       unsigned char byte)
+{
+	struct direct_copy dc = {
+		.image = image,
+		.infile = imageoutfile(sub),
+		.in_fd = -1,
+		.dfd = -1,
+		.fd = -1,
+		.size = size,
+		.offset = offset,
+		.byte = byte,
+	};
+	struct extent *extents = NULL;
+	const char *outfile = imageoutfile(image);
+	struct sparse_header sparse;
+	struct direct_chunk *c;
+	pthread_t reader;
+	unsigned n;
+	int blksz, i, ret;
+
+	dc.dfd = open(outfile, O_WRONLY | O_EXCL | O_DIRECT);
+	if (dc.dfd < 0) {
+		ret = errno == EINVAL ? -EOPNOTSUPP : -errno;
+		if (ret != -EOPNOTSUPP)
+			image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		return ret;
+	}
+	if (ioctl(dc.dfd, BLKSSZGET, &blksz) < 0 || blksz <= 0 ||
+	    (blksz & (blksz - 1)) || (offset & (blksz - 1))) {
+		close(dc.dfd);
+		return -EOPNOTSUPP;
+	}
+	dc.blksz = blksz;
+
+	dc.fd = open(outfile, O_WRONLY);
+	if (dc.fd < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		goto out;
+	}
+	dc.in_fd = open(dc.infile, O_RDONLY);
+	if (dc.in_fd < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", dc.infile, strerror(errno));
+		goto out;
+	}
+	/* sparse images are expanded by the generic path */
+	if (read_sparse_header(dc.in_fd, &sparse)) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+	posix_fadvise(dc.in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ret = map_file_extents(image, dc.infile, dc.in_fd, size, &extents,
+			       &dc.extent_count);
+	if (ret)
+		goto out;
+	dc.extents = extents;
+
+	/* all three buffers end up with the size of the smallest one */
+	dc.buf_size = min(DIRECT_BUF_SIZE, buffer_pool_budget() / 3);
+	for (i = 0; i < 2; i++) {
+		dc.chunk[i].buf = buffer_pool_get(&dc.buf_size, DIRECT_BUF_MIN_SIZE);
+		if (!dc.chunk[i].buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	dc.fillbuf = buffer_pool_get(&dc.buf_size, DIRECT_BUF_MIN_SIZE);
+	if (!dc.fillbuf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	image_debug(image, "copying %llu bytes from %s at offset %llu (direct)\n",
+		    size, dc.infile, offset);
+
+	pthread_mutex_init(&dc.lock, NULL);
+	pthread_cond_init(&dc.cond, NULL);
+	ret = -pthread_create(&reader, NULL, direct_reader, &dc);
+	if (ret) {
+		image_error(image, "failed to start reader: %s\n", strerror(-ret));
+		goto out_sync;
+	}
+
+	for (n = 0; ; n++) {
+		c = direct_get(&dc, n, 1);
+		if (c->kind == DIRECT_END) {
+			ret = c->error;
+			break;
+		}
+		if (c->kind == DIRECT_DATA)
+			ret = direct_pwrite(&dc, c->buf, c->len, c->offset);
+		else
+			ret = direct_fill(&dc, c->offset, c->len);
+		if (!ret)
+			progress_insert_add(c->len);
+		direct_put(&dc, c, 0);
+		if (ret)
+			break;
+	}
+
+	pthread_mutex_lock(&dc.lock);
+	dc.abort = 1;
+	pthread_cond_broadcast(&dc.cond);
+	pthread_mutex_unlock(&dc.lock);
+	pthread_join(reader, NULL);
+
+	if (!ret && (fsync(dc.fd) < 0 || fsync(dc.dfd) < 0)) {
+		ret = -errno;
+		image_error(image, "fsync %s: %s\n", outfile, strerror(errno));
+	}
+
+out_sync:
+	pthread_cond_destroy(&dc.cond);
+	pthread_mutex_destroy(&dc.lock);
+out:
+	for (i = 0; i < 2; i++)
+		buffer_pool_put(dc.chunk[i].buf);
+	buffer_pool_put(dc.fillbuf);
+	free(extents);
+	if (dc.in_fd >= 0)
+		close(dc.in_fd);
+	if (dc.fd >= 0)
+		close(dc.fd);
+	close(dc.dfd);
+	return ret;
+}
+#endif
+
 /*
  * Insert the image @sub at offset @offset in @image. If @sub is
  * smaller than @size (including if @sub is NULL), insert @byte bytes for
@@ -558,12 +1167,27 @@ int insert_image(struct image *image, struct image *sub,
 {
 	struct extent *extents = NULL;
 	size_t extent_count = 0;
+	struct sparse_header sparse;
+	struct zero_run zero;
 	int fd = -1, in_fd = -1;
 	unsigned long long in_pos;
+	char *buf = NULL;
+	size_t buf_size;
 	const char *infile;
+	unsigned long long total = size;
 	unsigned e;
 	int ret;
 
+	stats_begin();
+	progress_insert_expect(size);
+#if HAVE_O_DIRECT
+	if (sub && is_block_device(imageoutfile(image))) {
+		ret = insert_image_direct(image, sub, size, offset, byte);
+		if (ret != -EOPNOTSUPP)
+			goto out;
+	}
+#endif
+
 	fd = open_file(image, imageoutfile(image), 0);
 	if (fd < 0) {
 		ret = fd;
@@ -583,9 +1207,31 @@ int insert_image(struct image *image, struct image *sub,
 		image_error(image, "open %s: %s", infile, strerror(errno));
 		goto out;
 	}
+	buf_size = COPY_BUF_SIZE;
+	buf = buffer_pool_get(&buf_size, ZERO_BLOCK_SIZE);
+	if (!buf) {
+		ret = -ENOMEM;
+		image_error(image, "failed to allocate copy buffer\n");
+		goto out;
+	}
+	ret = read_sparse_header(in_fd, &sparse);
+	if (ret < 0) {
+		image_error(image, "%s: invalid android sparse header: %s\n",
+			    infile, strerror(-ret));
+		goto out;
+	}
+	if (ret) {
+		ret = insert_sparse_image(image, fd, in_fd, infile, &sparse,
+					  buf, buf_size, &size, &offset, byte);
+		if (ret)
+			goto out;
+		progress_insert_add(total - size);
+		goto fill;
+	}
 	ret = map_file_extents(image, infile, in_fd, size, &extents, &extent_count);
 	if (ret)
 		goto out;
+	zero_run_init(&zero, fd);
 	image_debug(image, "copying %llu bytes from %s at offset %llu\n",
 		    size, infile, offset);
 	in_pos = 0;
@@ -603,15 +1249,15 @@ int insert_image(struct image *image, struct image *sub,
 			image_error(image, "writing %zu bytes failed: %s\n", len, strerror(-ret));
 			goto out;
 		}
+		progress_insert_add(len);
 		size -= len;
 		offset += len;
 		in_pos += len;
 		while (in_pos < ext->end && size > 0) {
-			char buf[4096];
 			size_t now;
-			int r, w;
+			ssize_t r;
 
-			now = min(ext->end - in_pos, sizeof(buf));
+			now = min(ext->end - in_pos, buf_size);
 			now = min(now, size);
 			r = pread(in_fd, buf, now, in_pos);
 			if (r < 0) {
@@ -623,18 +1269,20 @@ int insert_image(struct image *image, struct image *sub,
 			if (r == 0)
 				break;
 
-			w = pwrite(fd, buf, r, offset);
-			if (w < r) {
-				ret = w < 0 ? -errno : -EIO;
-				if (w < 0)
-					image_error(image, "write %d bytes: %s\n", r, strerror(errno));
-				else
-					image_error(image, "short write (%d vs %d)\n", w, r);
+			ret = zero_run_write(&zero, buf, r, offset);
+			if (ret) {
+				image_error(image, "write %zd bytes: %s\n", r, strerror(-ret));
 				goto out;
 			}
-			size -= w;
-			offset += w;
-			in_pos += w;
+			progress_insert_add(r);
+			size -= r;
+			offset += r;
+			in_pos += r;
+		}
+		ret = zero_run_flush(&zero);
+		if (ret) {
+			image_error(image, "writing zeros failed: %s\n", strerror(-ret));
+			goto out;
 		}
 	}
 
@@ -644,13 +1292,17 @@ fill:
 	ret = write_bytes(fd, size, offset, byte);
 	if (ret)
 		image_error(image, "writing %llu bytes failed: %s\n", size, strerror(-ret));
+	else
+		progress_insert_add(size);
 
 out:
 	if (fd >= 0)
 		close(fd);
 	if (in_fd >= 0)
 		close(in_fd);
+	buffer_pool_put(buf);
 	free(extents);
+	stats_end_detail("insert_image", sub ? sub->file : NULL, total);
 	return ret;
 }
 
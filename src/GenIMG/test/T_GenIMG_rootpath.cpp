@@ -0,0 +1,103 @@
+/*
+ * T_GenIMG_rootpath.cpp Check that the root tree is only copied for images built from it
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#include "GenIMG.h"
+
+extern "C" {
+#include "Stats.h"
+}
+
+static void write_file(const std::filesystem::path &path, size_t size) {
+    std::ofstream out(path, std::ios::binary);
+    for (size_t i = 0; i < size; ++i) {
+        out.put(static_cast<char>(i * 7));
+    }
+}
+
+// run genimage on cfg with stats on, true if the root tree was copied
+static bool copies_root(const std::filesystem::path &dir, const std::string &name, const std::string &cfg, int &status) {
+    auto cfg_path = dir / (name + ".cfg");
+    auto stats_path = dir / (name + ".json");
+    {
+        std::ofstream out(cfg_path);
+        out << cfg;
+    }
+
+    stats_enable(1);
+    {
+        GenIMG genimg(cfg_path.string(), (dir / "input").string(), (dir / "output").string());
+        status = genimg.get_status();
+    }
+    stats_write_json(stats_path.string().c_str());
+    stats_enable(0);
+
+    std::ifstream in(stats_path);
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return json.find("\"root_copy\"") != std::string::npos;
+}
+
+int main() {
+    auto dir = std::filesystem::temp_directory_path() / "T_GenIMG_rootpath";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "input");
+    std::filesystem::create_directories(dir / "output");
+    write_file(dir / "input" / "boot.fex", 64 * 1024);
+    write_file(dir / "input" / "rootfs.fex", 256 * 1024);
+
+    // what OpenixCard generates: a disk of partition files, nothing from the root tree
+    int status;
+    bool copied = copies_root(dir, "hdimage",
+                              "image disk.img {\n"
+                              "\thdimage {\n"
+                              "\t\tpartition-table-type = \"gpt\"\n"
+                              "\t}\n"
+                              "\tpartition boot {\n"
+                              "\t\timage = \"boot.fex\"\n"
+                              "\t\tsize = 1M\n"
+                              "\t}\n"
+                              "\tpartition rootfs {\n"
+                              "\t\timage = \"rootfs.fex\"\n"
+                              "\t\tsize = 1M\n"
+                              "\t}\n"
+                              "}\n", status);
+    if (status != 0) {
+        std::cerr << "genimage failed on the hdimage: " << status << std::endl;
+        return 1;
+    }
+    if (copied) {
+        std::cerr << "the root tree was copied for an image of partition files" << std::endl;
+        return 1;
+    }
+
+    // a vfat image without files is filled from the root tree, so it has to be copied
+    copied = copies_root(dir, "vfat",
+                         "image root.vfat {\n"
+                         "\tvfat {}\n"
+                         "\tsize = 8M\n"
+                         "}\n", status);
+    if (status != 0) {
+        std::cerr << "genimage failed on the vfat image: " << status << std::endl;
+        return 1;
+    }
+    if (!copied) {
+        std::cerr << "the root tree was not copied for a vfat image built from it" << std::endl;
+        return 1;
+    }
+
+    std::filesystem::remove_all(dir);
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * T_GenIMG_vfat.cpp Generate a small vfat image natively and check it with fsck.vfat or mtools
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "GenIMG.h"
+
+// ctest reports this exit code as skipped
+constexpr int SKIP = 77;
+
+static bool have(const std::string &tool) {
+    return std::system(("command -v " + tool + " >/dev/null 2>&1").c_str()) == 0;
+}
+
+static void write_file(const std::filesystem::path &path, size_t size) {
+    std::ofstream out(path, std::ios::binary);
+    for (size_t i = 0; i < size; ++i) {
+        out.put(static_cast<char>(i * 31 + i / 251));
+    }
+}
+
+int main() {
+    auto dir = std::filesystem::temp_directory_path() / "T_GenIMG_vfat";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "input");
+    std::filesystem::create_directories(dir / "output");
+
+    // a short name, a long name in a sub directory and a file spanning many clusters
+    write_file(dir / "input" / "a.txt", 5);
+    write_file(dir / "input" / "long-file-name.bin", 300 * 1024);
+    {
+        std::ofstream cfg(dir / "vfat.cfg");
+        cfg << "image test.vfat {\n"
+               "\tvfat {\n"
+               "\t\tlabel = \"OPENIX\"\n"
+               "\t\tvolume-id = \"1234abcd\"\n"
+               "\t\tfile a.txt { image = \"a.txt\" }\n"
+               "\t\tfile \"dir/long-file-name.bin\" { image = \"long-file-name.bin\" }\n"
+               "\t}\n"
+               "\tsize = 8M\n"
+               "}\n";
+    }
+
+    int status;
+    {
+        GenIMG genimg((dir / "vfat.cfg").string(), (dir / "input").string(), (dir / "output").string());
+        status = genimg.get_status();
+    }
+    if (status != 0) {
+        std::cerr << "genimage failed: " << status << std::endl;
+        return 1;
+    }
+
+    auto image = (dir / "output" / "test.vfat").string();
+    uint8_t boot[512];
+    std::ifstream in(image, std::ios::binary);
+    if (!in.read(reinterpret_cast<char *>(boot), sizeof(boot)) || boot[510] != 0x55 || boot[511] != 0xaa) {
+        std::cerr << "no boot sector in " << image << std::endl;
+        return 1;
+    }
+    // 8 MiB is FAT12, its volume id is at offset 39
+    uint32_t volume_id = boot[39] | boot[40] << 8 | boot[41] << 16 | static_cast<uint32_t>(boot[42]) << 24;
+    if (volume_id != 0x1234abcd) {
+        std::cerr << "volume id is " << std::hex << volume_id << ", not 1234abcd" << std::endl;
+        return 1;
+    }
+
+    int ret;
+    if (have("fsck.vfat")) {
+        ret = std::system(("fsck.vfat -n '" + image + "'").c_str());
+    } else if (have("mdir")) {
+        ret = std::system(("MTOOLS_SKIP_CHECK=1 mdir -i '" + image + "' ::/dir/long-file-name.bin").c_str());
+    } else {
+        std::cerr << "neither fsck.vfat nor mdir found, skipping" << std::endl;
+        return SKIP;
+    }
+    if (ret != 0) {
+        std::cerr << image << " is not a valid vfat file system" << std::endl;
+        return 1;
+    }
+
+    std::filesystem::remove_all(dir);
+    return 0;
+}
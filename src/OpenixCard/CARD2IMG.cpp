@@ -0,0 +1,245 @@
+/*
+ * CARD2IMG.cpp
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "CARD2IMG.h"
+#include "LOG.h"
+#include "exception.h"
+#include "payloads/chip.h"
+
+extern "C" {
+#include "OpenixIMG.h"
+}
+
+constexpr uint64_t SECTOR_SIZE = 512;
+
+// what the vendor image.cfg uses for the items a card carries
+constexpr const char *ITEM_COMMON = "COMMON  ";
+constexpr const char *ITEM_BOOT = "12345678";
+constexpr const char *ITEM_ROOTFSFAT16 = "RFSFAT16";
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+static uint64_t le64(const uint8_t *p) {
+    return le32(p) | static_cast<uint64_t>(le32(p + 4)) << 32;
+}
+
+CARD2IMG::CARD2IMG(std::string card_path) : card_path(std::move(card_path)) {
+    fd = open(this->card_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw file_open_error(this->card_path);
+    }
+    struct stat st{};
+    fstat(fd, &st);
+    card_size = st.st_size;
+#ifdef BLKGETSIZE64
+    if (S_ISBLK(st.st_mode)) {
+        ioctl(fd, BLKGETSIZE64, &card_size);
+    }
+#endif
+
+    if (!read_gpt() && !read_mbr()) {
+        throw std::runtime_error("No partition table found on: " + this->card_path);
+    }
+    find_boot();
+    gen_partition_table_fex();
+}
+
+CARD2IMG::~CARD2IMG() {
+    if (fd >= 0) close(fd);
+}
+
+void CARD2IMG::read_at(void *buf, size_t len, uint64_t offset) const {
+    if (pread(fd, buf, len, static_cast<off_t>(offset)) != static_cast<ssize_t>(len)) {
+        throw file_size_error(card_path);
+    }
+}
+
+// the GPT as hdimage_insert_gpt() writes it, entries may sit at gpt-location
+bool CARD2IMG::read_gpt() {
+    uint8_t header[92];
+    read_at(header, sizeof(header), SECTOR_SIZE);
+    if (std::memcmp(header, "EFI PART", 8) != 0) {
+        return false;
+    }
+    auto entries_lba = le64(header + 72);
+    auto num_entries = le32(header + 80);
+    auto entry_size = le32(header + 84);
+    if (entry_size < 128 || num_entries > 1024) {
+        return false;
+    }
+
+    std::vector<uint8_t> table(static_cast<size_t>(num_entries) * entry_size);
+    read_at(table.data(), table.size(), entries_lba * SECTOR_SIZE);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        const uint8_t *entry = table.data() + static_cast<size_t>(i) * entry_size;
+        static const uint8_t unused[16] = {};
+        if (std::memcmp(entry, unused, sizeof(unused)) == 0) {
+            continue;
+        }
+        Partition part;
+        auto first_lba = le64(entry + 32);
+        auto last_lba = le64(entry + 40);
+        // UTF-16LE, partition names are plain ASCII
+        for (int c = 0; c < 36; c++) {
+            auto ch = entry[56 + c * 2] | entry[57 + c * 2] << 8;
+            if (ch == 0) break;
+            part.name += static_cast<char>(ch < 0x80 ? ch : '_');
+        }
+        if (part.name.empty()) {
+            part.name = "part" + std::to_string(i + 1);
+        }
+        part.offset = first_lba * SECTOR_SIZE;
+        part.size = (last_lba - first_lba + 1) * SECTOR_SIZE;
+        partitions.emplace_back(part);
+    }
+    return !partitions.empty();
+}
+
+// MBR only cards carry no partition names
+bool CARD2IMG::read_mbr() {
+    uint8_t mbr[SECTOR_SIZE];
+    read_at(mbr, sizeof(mbr), 0);
+    if (mbr[510] != 0x55 || mbr[511] != 0xAA) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *entry = mbr + 446 + i * 16;
+        auto type = entry[4];
+        if (type == 0 || type == 0xEE) {
+            continue;
+        }
+        Partition part;
+        part.name = "part" + std::to_string(i + 1);
+        part.offset = le32(entry + 8) * SECTOR_SIZE;
+        part.size = le32(entry + 12) * SECTOR_SIZE;
+        partitions.emplace_back(part);
+    }
+    return !partitions.empty();
+}
+
+// boot0 and the boot package sit at fixed offsets, their headers carry the length
+void CARD2IMG::find_boot() {
+    linux_compensate compensate;
+    uint64_t first_partition = card_size;
+    for (auto &part: partitions) {
+        first_partition = std::min(first_partition, part.offset);
+    }
+
+    uint8_t header[64];
+    read_at(header, sizeof(header), compensate.boot0_offset);
+    boot0_size = compensate.gpt_location - compensate.boot0_offset;
+    if (std::memcmp(header + 4, "eGON.BT0", 8) == 0 && le32(header + 16) <= boot0_size) {
+        boot0_size = le32(header + 16);
+        boot0_exact = true;
+    }
+
+    read_at(header, sizeof(header), compensate.boot_packages_offset);
+    boot_package_size = first_partition > compensate.boot_packages_offset ?
+                        first_partition - compensate.boot_packages_offset : 0;
+    if (std::memcmp(header, "sunxi-package", 13) == 0 && le32(header + 36) <= boot_package_size) {
+        boot_package_size = le32(header + 36);
+        boot_package_exact = true;
+    }
+}
+
+void CARD2IMG::gen_partition_table_fex() {
+    std::ostringstream fex;
+    fex << ";---------------------------------------------------------------------------------------------------------\n"
+           "; generated from the partition table of " << card_path << "\n"
+           ";---------------------------------------------------------------------------------------------------------\n"
+           "[mbr]\n"
+           "size = 16384\n"
+           "\n"
+           "[partition_start]\n";
+    for (auto &part: partitions) {
+        fex << "\n[partition]\n"
+               "    name         = " << part.name << "\n";
+        if (part.name == "UDISK") {
+            // takes up the rest of the card
+            fex << "    user_type    = 0x8100\n";
+            continue;
+        }
+        fex << "    size         = " << part.size / SECTOR_SIZE << "\n"
+               "    downloadfile = \"" << part.name << ".fex\"\n"
+               "    user_type    = 0x8000\n";
+    }
+    partition_table_fex = fex.str();
+}
+
+std::string CARD2IMG::get_partition_table_fex() const {
+    return partition_table_fex;
+}
+
+void CARD2IMG::print_partition_table() const {
+    for (auto &part: partitions) {
+        std::ostringstream line;
+        line << std::left << std::setw(13) << "  Partition: '" << std::setw(18) << part.name + "'"
+             << std::setw(9) << static_cast<double>(part.size) / 0x100000 << "MB - "
+             << std::setw(7) << part.size / 0x400 << "KB";
+        LOG::DATA(line.str());
+    }
+}
+
+int CARD2IMG::pack(const std::string &image_path) {
+    linux_compensate compensate;
+    std::vector<std::string> names;
+    std::vector<pack_source> sources;
+    // the defaults of the vendor image.cfg, a card does not record them
+    imagewty_ids ids = {0x100234, 0x1234, 0x8743, 0x100, 0x100};
+
+    // the names have to outlive sources
+    names.reserve(partitions.size() * 2);
+
+    sources.push_back({"sys_partition.fex", ITEM_COMMON, "SYS_CONFIG000000", partition_table_fex.data(), -1, 0,
+                       partition_table_fex.size(), 0});
+    sources.push_back({"boot0_sdcard.fex", ITEM_BOOT, "1234567890BOOT_0", nullptr, fd, compensate.boot0_offset,
+                       boot0_size, !boot0_exact});
+    sources.push_back({"boot_package.fex", ITEM_BOOT, "BOOTPKG-00000000", nullptr, fd,
+                       compensate.boot_packages_offset, boot_package_size, !boot_package_exact});
+
+    for (auto &part: partitions) {
+        if (part.name == "UDISK") {
+            continue;
+        }
+        // eg. BOOT-RESOURCE_FE, ROOTFS_FEX000000
+        std::string subtype = part.name + "_FEX";
+        std::transform(subtype.begin(), subtype.end(), subtype.begin(), ::toupper);
+        subtype.resize(IMAGEWTY_FHDR_SUBTYPE_LEN, '0');
+
+        names.emplace_back(part.name + ".fex");
+        auto &filename = names.back();
+        names.emplace_back(subtype);
+        // only the used part of the partition goes into the image
+        sources.push_back({filename.c_str(), ITEM_ROOTFSFAT16, names.back().c_str(), nullptr, fd, part.offset,
+                           std::min(part.size, card_size > part.offset ? card_size - part.offset : 0), 1});
+    }
+
+    return pack_imagewty_sources(sources.data(), sources.size(), &ids, image_path.c_str());
+}
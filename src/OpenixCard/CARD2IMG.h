@@ -0,0 +1,67 @@
+/*
+ * CARD2IMG.h
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXCARD_CARD2IMG_H
+#define OPENIXCARD_CARD2IMG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Turn a card image as written by dump (or the card itself) back into an
+// Allwinner image. The partitions are taken from the GPT, or the MBR if
+// there is none, and streamed straight from the card into the encrypted
+// image items together with boot0, the boot package and a sys_partition.fex
+// generated from the partition table.
+class CARD2IMG {
+public:
+    explicit CARD2IMG(std::string card_path);
+
+    ~CARD2IMG();
+
+    // write the Allwinner image, returns the pack_imagewty_sources() result
+    int pack(const std::string &image_path);
+
+    [[nodiscard]] std::string get_partition_table_fex() const;
+
+    // Print out the partition table
+    void print_partition_table() const;
+
+private:
+    struct Partition {
+        std::string name;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+    };
+
+    std::string card_path;
+    int fd = -1;
+    uint64_t card_size = 0;
+    std::vector<Partition> partitions;
+    uint64_t boot0_size = 0;
+    bool boot0_exact = false;
+    uint64_t boot_package_size = 0;
+    bool boot_package_exact = false;
+    std::string partition_table_fex;
+
+    void read_at(void *buf, size_t len, uint64_t offset) const;
+
+    bool read_gpt();
+
+    bool read_mbr();
+
+    void find_boot();
+
+    void gen_partition_table_fex();
+};
+
+
+#endif //OPENIXCARD_CARD2IMG_H
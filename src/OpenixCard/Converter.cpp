@@ -0,0 +1,298 @@
+/*
+ * Converter.cpp
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
+#include <utility>
+
+#include "LOG.h"
+#include "exception.h"
+#include "FEX2CFG.h"
+#include "GenIMG.h"
+#include "Flasher.h"
+#include "CARD2IMG.h"
+#include "StatsPhase.h"
+
+extern "C" {
+#include "OpenixIMG.h"
+}
+
+#include "Converter.h"
+
+namespace openixcard {
+    Converter::Converter(Options options) : options(std::move(options)) {}
+
+    Converter::Step::Step(const Options &options, std::string name) : options(options), name(std::move(name)) {
+        if (options.on_step) {
+            options.on_step(this->name, true);
+        }
+    }
+
+    Converter::Step::~Step() {
+        if (options.on_step) {
+            options.on_step(name, false);
+        }
+    }
+
+    UnpackResult Converter::unpack(const std::string &image, bool cfg) {
+        UnpackResult result;
+        result.directory = image + ".dump";
+        unpack_image_to(image, result.directory);
+        if (cfg) {
+            FEX2CFG fex2Cfg(result.directory);
+            result.cfg_file = fex2Cfg.save_file(result.directory);
+        }
+        return result;
+    }
+
+    DumpResult Converter::dump(const std::string &image) {
+        DumpResult result;
+        result.directory = image + ".dump";
+        unpack_image_to(image, result.directory);
+        LOG::INFO("Convert Done! Parsing the partition tables...");
+
+        auto &targets = options.targets;
+        // a single card without verify is written by genimage itself, everything
+        // else is generated to a file first and fanned out from there
+        bool fan_out = targets.size() > 1 || (!targets.empty() && options.verify);
+        FEX2CFG fex2Cfg(result.directory, targets.size() == 1 && !fan_out ? targets[0] : "");
+        auto target_cfg_path = fex2Cfg.save_file(result.directory);
+        auto image_name = fex2Cfg.get_image_name();
+        auto output_path = result.directory + ".out";
+        // generate the image
+        LOG::INFO("Parse Done! Generating target image...");
+
+        int status;
+        {
+            Step step(options, "generate");
+            StatsPhase phase("generate");
+            GenIMG genimage(target_cfg_path, result.directory, output_path, options.incremental);
+            status = genimage.get_status();
+        }
+
+        // check genimage-src result
+        if (status != 0) {
+            throw generate_error(target_cfg_path);
+        }
+
+        if (fan_out) {
+            LOG::INFO("Generate Done! Flashing " + std::to_string(targets.size()) + " devices...");
+            flash_targets(output_path + "/" + image_name + ".img");
+            result.output = output_path + "/" + image_name + ".img";
+            result.flashed = targets;
+        } else if (targets.empty()) {
+            result.output = output_path;
+        } else {
+            result.output = targets[0];
+            result.flashed = targets;
+        }
+        return result;
+    }
+
+    uint64_t Converter::size(const std::string &image) {
+        auto directory = image + ".dump";
+        unpack_image_to(image, directory);
+        LOG::INFO("Getting accurate size of Allwinner img...");
+        FEX2CFG fex2Cfg(directory);
+        auto real_size = fex2Cfg.get_image_real_size(true);
+        std::filesystem::remove_all(directory);
+        return real_size;
+    }
+
+    ImageList Converter::list(const std::string &image) {
+        struct image_entry *entries = nullptr;
+        uint32_t num_entries = 0;
+        ImageList result;
+
+        check_file(image);
+        crypto_init();
+        set_unpack_twofish(options.twofish);
+        check_unpack_result(list_image(image.c_str(), &entries, &num_entries, &result.version), image);
+
+        for (uint32_t i = 0; i < num_entries; i++) {
+            const auto &e = entries[i];
+            result.items.push_back({e.filename, e.maintype, e.subtype, e.offset, e.stored_length,
+                                    e.original_length, e.encrypted != 0, e.twofish != 0});
+        }
+        free(entries);
+        return result;
+    }
+
+    void Converter::check(const std::string &image) {
+        LOG::INFO("Checking input file: " + image);
+        check_file(image);
+        crypto_init();
+        check_unpack_result(validate_image(image.c_str()), image);
+    }
+
+    std::string Converter::pack(const std::string &directory) {
+        LOG::INFO("Generating target image...");
+
+        std::string target_cfg_path = {};
+        for (const auto &entry: std::filesystem::directory_iterator(directory)) {
+            if (entry.path().extension() == ".cfg") {
+                if (entry.path().filename() != "image.cfg") {
+                    target_cfg_path = entry.path().string();
+                }
+            }
+        }
+
+        if (target_cfg_path.empty()) {
+            throw std::runtime_error("Can't find target image partition table cfg file in: " + directory);
+        }
+
+        int status;
+        {
+            Step step(options, "generate");
+            StatsPhase phase("generate");
+            GenIMG gen_img(target_cfg_path, directory, directory);
+            status = gen_img.get_status();
+        }
+
+        // check gen_img-src result
+        if (status == -EINVAL) {
+            throw generate_error("check your cfg file " + target_cfg_path);
+        } else if (status != 0) {
+            throw generate_error(target_cfg_path);
+        }
+        return directory;
+    }
+
+    std::string Converter::pack_imagewty(const std::string &directory) {
+        auto input_dir = std::filesystem::path(directory);
+        if (!input_dir.has_filename()) {
+            input_dir = input_dir.parent_path(); // trailing slash
+        }
+        auto cfg_file = (input_dir / "image.cfg").string();
+        auto image_file = input_dir.string() + ".img";
+
+        LOG::INFO("Packing " + cfg_file + " to Allwinner image...");
+        check_file(cfg_file);
+        crypto_init();
+        int pack_img_ret;
+        {
+            Step step(options, "pack");
+            pack_img_ret = ::pack_imagewty(cfg_file.c_str(), image_file.c_str());
+        }
+
+        check_pack_result(pack_img_ret, cfg_file, image_file);
+        return image_file;
+    }
+
+    std::string Converter::from_card(const std::string &card) {
+        auto image_file = card + ".img";
+
+        LOG::INFO("Reading partition table of " + card + "...");
+        check_file(card);
+        crypto_init();
+        CARD2IMG card2img(card);
+        LOG::DATA("Partition Table: ");
+        card2img.print_partition_table();
+
+        LOG::INFO("Converting card to Allwinner image...");
+        int pack_img_ret;
+        {
+            Step step(options, "pack");
+            pack_img_ret = card2img.pack(image_file);
+        }
+
+        check_pack_result(pack_img_ret, card, image_file);
+        return image_file;
+    }
+
+    void Converter::check_file(const std::string &file_path) {
+        if (!std::filesystem::exists(file_path)) {
+            throw file_open_error(file_path);
+        }
+    }
+
+    void Converter::check_pack_result(int ret, const std::string &source, const std::string &image_file) {
+        switch (ret) {
+            case 0:
+                break;
+            case 2:
+                throw file_open_error(source);
+            case 3:
+                throw file_size_error(image_file);
+            case 4:
+                throw std::runtime_error("Unable to allocate memory for image: " + image_file);
+            case 5:
+                throw std::runtime_error("Unsupported items in: " + source);
+            default:
+                throw std::runtime_error("I/O error while packing image: " + image_file);
+        }
+    }
+
+    void Converter::check_unpack_result(int ret, const std::string &image) const {
+        switch (ret) {
+            case 2:
+                throw file_open_error(image);
+            case 3:
+                throw file_size_error(image);
+            case 4:
+                throw std::runtime_error("Unable to allocate memory for image: " + image);
+            case 5:
+                throw file_format_error(image);
+            case 6:
+                throw std::runtime_error("I/O error while unpacking image: " + image);
+            case 7:
+                throw manifest_mismatch_error(options.check_manifest);
+            default:
+                break;
+        }
+    }
+
+    void Converter::unpack_image_to(const std::string &image, const std::string &directory) {
+        // refuse to unpack anything if a card is not there
+        for (auto &target: options.targets) {
+            if (!std::filesystem::is_block_file(target)) {
+                throw not_block_device_error(target);
+            }
+        }
+
+        // dump the packed image
+        LOG::INFO("Converting input file: " + image);
+        check_file(image);
+        std::filesystem::create_directories(directory);
+        crypto_init();
+        set_unpack_cache_dir(options.cache_dir.c_str());
+        set_unpack_manifest(options.manifest, options.check_manifest.c_str());
+        set_unpack_twofish(options.twofish);
+        std::error_code ec;
+        auto image_size = std::filesystem::file_size(image, ec);
+        // if input file path is absolute path, convert to relative path, #1
+        auto is_absolute = std::filesystem::path(image).is_absolute();
+        int unpack_img_ret;
+        {
+            Step step(options, "unpack");
+            StatsPhase phase("unpack", ec ? 0 : image_size);
+            unpack_img_ret = unpack_image(image.c_str(), directory.c_str(), is_absolute);
+        }
+
+        check_unpack_result(unpack_img_ret, image);
+    }
+
+    void Converter::flash_targets(const std::string &image_path) {
+        Flasher flasher(image_path, options.targets, options.verify, options.flash_progress);
+        flasher.flash();
+
+        auto failed = flasher.get_failed_devices();
+        if (!failed.empty()) {
+            std::string devices;
+            for (auto &device: failed) {
+                devices += (devices.empty() ? "" : ", ") + device;
+            }
+            throw flash_error(std::to_string(failed.size()) + " of " + std::to_string(options.targets.size()) +
+                              " devices: " + devices);
+        }
+    }
+}
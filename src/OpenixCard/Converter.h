@@ -0,0 +1,135 @@
+/*
+ * Converter.h
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXCARD_CONVERTER_H
+#define OPENIXCARD_CONVERTER_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace openixcard {
+    struct Options {
+        // keep decrypted items here, unchanged items are linked from there on later runs
+        std::string cache_dir;
+        // update the previous converted image in place, only rewriting changed partitions
+        bool incremental = false;
+        // write the converted image straight to these block devices
+        std::vector<std::string> targets;
+        // read the targets back and compare them with the image after flashing
+        bool verify = false;
+        // hash every item while unpacking and write image.manifest next to image.cfg
+        bool manifest = false;
+        // compare the unpacked items with this image.manifest
+        std::string check_manifest;
+        // decrypt the non-fex items with Twofish
+        bool twofish = false;
+        // print a progress line per device to stdout while flashing
+        bool flash_progress = false;
+        // called with begin true before and false after "unpack", "generate"
+        // and "pack", eg. to show the progress counters of that step
+        std::function<void(const std::string &step, bool begin)> on_step;
+    };
+
+    // One item of an Allwinner image
+    struct ImageItem {
+        std::string filename;
+        std::string maintype;
+        std::string subtype;
+        uint64_t offset = 0;
+        uint64_t stored_length = 0;
+        uint64_t original_length = 0;
+        bool encrypted = false;     // stored encrypted
+        bool twofish = false;       // with Twofish instead of RC6, see Options::twofish
+    };
+
+    struct ImageList {
+        uint32_t version = 0;       // header version, 0x0100 or 0x0300
+        std::vector<ImageItem> items;
+    };
+
+    struct UnpackResult {
+        std::string directory;      // the unpacked items, <image>.dump
+        std::string cfg_file;       // the genimage cfg, if asked for
+    };
+
+    struct DumpResult {
+        std::string directory;      // the unpacked items, <image>.dump
+        std::string output;         // the regular image, or the single target device
+        std::vector<std::string> flashed;
+    };
+
+    // The conversions of OpenixCard as a library: nothing is printed to
+    // stdout but through Logger.h (see log_set_handler()) and the process is
+    // never exited, failures throw the exceptions of exception.h. OpenixIMG
+    // and genimage keep global state: conversions may follow each other in
+    // one process, but run one at a time.
+    class Converter {
+    public:
+        explicit Converter(Options options = {});
+
+        // unpack image to <image>.dump, with cfg also write the genimage cfg there
+        UnpackResult unpack(const std::string &image, bool cfg = false);
+
+        // convert image to a regular image, or flash it to the targets
+        DumpResult dump(const std::string &image);
+
+        // the accurate size of image once converted in KB
+        uint64_t size(const std::string &image);
+
+        // the items of image, without unpacking it
+        ImageList list(const std::string &image);
+
+        // check the header and item table of image, throws if it is damaged
+        void check(const std::string &image);
+
+        // generate the regular image of a dumped folder with its cfg file, returns the folder
+        std::string pack(const std::string &directory);
+
+        // pack a folder with image.cfg back to an Allwinner image <directory>.img, returns its path
+        std::string pack_imagewty(const std::string &directory);
+
+        // convert a card image or SD card back to an Allwinner image <card>.img, returns its path
+        std::string from_card(const std::string &card);
+
+    private:
+        Options options;
+
+    private:
+        static void check_file(const std::string &file_path);
+
+        // map the return code of pack_imagewty() to an exception
+        static void check_pack_result(int ret, const std::string &source, const std::string &image_file);
+
+        // map the return code of unpack_image and validate_image to an exception
+        void check_unpack_result(int ret, const std::string &image) const;
+
+        void unpack_image_to(const std::string &image, const std::string &directory);
+
+        void flash_targets(const std::string &image_path);
+
+        // call on_step for begin and end of a scope
+        class Step {
+        public:
+            Step(const Options &options, std::string name);
+
+            ~Step();
+
+        private:
+            const Options &options;
+            std::string name;
+        };
+    };
+}
+
+
+#endif //OPENIXCARD_CONVERTER_H
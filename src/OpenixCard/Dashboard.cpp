@@ -0,0 +1,217 @@
+/*
+ * Dashboard.cpp
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+#include <unistd.h>
+
+#include <ftxui/dom/elements.hpp>
+#include <ftxui/screen/color.hpp>
+#include <ftxui/screen/screen.hpp>
+
+#include "Dashboard.h"
+
+extern "C" {
+#include "Logger.h"
+}
+
+// counters are sampled this often, the lines are printed every LINES_EVERY samples
+constexpr auto SAMPLE_INTERVAL = std::chrono::milliseconds(250);
+constexpr unsigned LINES_EVERY = 8;
+// a stage that did not move for this long while not done is stalled
+constexpr auto STALL_TIME = std::chrono::seconds(5);
+
+static std::string format_size(uint64_t bytes) {
+    char buf[32];
+    if (bytes >= 1024ULL * 1024 * 1024) {
+        std::snprintf(buf, sizeof(buf), "%.2f GiB", static_cast<double>(bytes) / (1024.0 * 1024 * 1024));
+    } else {
+        std::snprintf(buf, sizeof(buf), "%.1f MiB", static_cast<double>(bytes) / (1024.0 * 1024));
+    }
+    return buf;
+}
+
+static std::string format_eta(uint64_t seconds) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%02llu:%02llu:%02llu", static_cast<unsigned long long>(seconds / 3600),
+                  static_cast<unsigned long long>(seconds / 60 % 60), static_cast<unsigned long long>(seconds % 60));
+    return buf;
+}
+
+// seconds left at the current rate, -1 if unknown
+static int64_t eta_seconds(uint64_t done, uint64_t total, double rate) {
+    if (done >= total || rate <= 0) {
+        return -1;
+    }
+    return static_cast<int64_t>(static_cast<double>(total - done) / rate);
+}
+
+Dashboard::Mode Dashboard::parse_mode(const std::string &mode) {
+    if (mode == "auto") {
+        return AUTO;
+    } else if (mode == "lines") {
+        return LINES;
+    } else if (mode == "off") {
+        return OFF;
+    }
+    throw std::invalid_argument(mode);
+}
+
+Dashboard::Dashboard(Mode mode, std::string step) : mode(mode), step(std::move(step)) {
+    progress_reset();
+    if (mode == OFF) {
+        return;
+    }
+    tty = mode == AUTO && isatty(STDERR_FILENO);
+    last_sample = clock::now();
+    for (auto &stage: stages) {
+        stage.changed = last_sample;
+    }
+    thread = std::thread(&Dashboard::run, this);
+    // log lines would end up in the middle of the redrawn dashboard
+    route_log = tty && isatty(STDOUT_FILENO);
+    if (route_log) {
+        log_set_handler(&Dashboard::log_message, this);
+    }
+}
+
+Dashboard::~Dashboard() {
+    if (!thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        stop = true;
+    }
+    cond.notify_all();
+    thread.join();
+    if (route_log) {
+        log_set_handler(nullptr, nullptr);
+    }
+}
+
+void Dashboard::run() {
+    std::unique_lock<std::mutex> lk(lock);
+    for (unsigned tick = 1;; ++tick) {
+        bool last = cond.wait_for(lk, SAMPLE_INTERVAL, [this] { return stop; });
+        sample();
+        if (tty) {
+            render();
+        } else if (last || tick % LINES_EVERY == 0) {
+            print_lines();
+        }
+        if (last) {
+            break;
+        }
+    }
+    if (tty) {
+        std::cerr << std::endl;
+    }
+    done = true;
+}
+
+void Dashboard::sample() {
+    auto now = clock::now();
+    auto elapsed = std::chrono::duration<double>(now - last_sample).count();
+    last_sample = now;
+
+    for (int i = 0; i < PROGRESS_STAGES; ++i) {
+        auto &stage = stages[i];
+        auto done = progress_done(static_cast<progress_stage>(i));
+        auto rate = elapsed > 0 ? static_cast<double>(done - stage.done) / elapsed : 0;
+
+        // smooth over about a second so the ETA does not jump around
+        stage.rate = stage.done == 0 ? rate : stage.rate * 0.7 + rate * 0.3;
+        if (done != stage.done) {
+            stage.changed = now;
+        }
+        stage.done = done;
+        stage.total = progress_total(static_cast<progress_stage>(i));
+    }
+}
+
+bool Dashboard::stalled(const Stage &stage) const {
+    return stage.done < stage.total && last_sample - stage.changed >= STALL_TIME;
+}
+
+void Dashboard::render() {
+    using namespace ftxui;
+
+    Elements rows;
+    for (int i = 0; i < PROGRESS_STAGES; ++i) {
+        const auto &stage = stages[i];
+        if (stage.total == 0 && stage.done == 0) {
+            continue;
+        }
+        auto ratio = stage.total ? std::min(1.0, static_cast<double>(stage.done) / static_cast<double>(stage.total)) : 0.0;
+        auto eta = eta_seconds(stage.done, stage.total, stage.rate);
+        char rate[32];
+        std::snprintf(rate, sizeof(rate), "%.1f MB/s", stage.rate / 1e6);
+
+        auto state = stalled(stage) ? color(Color::Red) : ratio >= 1.0 ? color(Color::Green) : color(Color::Cyan);
+        rows.push_back(hbox({
+                text(progress_stage_name(static_cast<progress_stage>(i))) | size(WIDTH, EQUAL, 8),
+                gauge(static_cast<float>(ratio)) | flex,
+                text(" " + format_size(stage.done) + " / " + format_size(stage.total)) | size(WIDTH, EQUAL, 24),
+                text(rate) | size(WIDTH, EQUAL, 12),
+                text(stalled(stage) ? "STALLED" : eta < 0 ? "" : "ETA " + format_eta(eta)) | size(WIDTH, EQUAL, 13),
+        }) | state);
+    }
+    if (rows.empty()) {
+        rows.push_back(text("waiting..."));
+    }
+
+    auto document = window(text(" " + step + " "), vbox(std::move(rows)));
+    auto screen = Screen::Create(Dimension::Full(), Dimension::Fit(document));
+    Render(screen, document);
+    std::cerr << reset_position << screen.ToString() << std::flush;
+    reset_position = screen.ResetPosition();
+    clear_position = screen.ResetPosition(true);
+}
+
+void Dashboard::print_lines() {
+    for (int i = 0; i < PROGRESS_STAGES; ++i) {
+        const auto &stage = stages[i];
+        if (stage.total == 0 && stage.done == 0) {
+            continue;
+        }
+        char line[256];
+        std::snprintf(line, sizeof(line),
+                      "progress step=%s stage=%s done=%llu total=%llu mb_per_s=%.1f eta_s=%lld stalled=%d\n",
+                      step.c_str(), progress_stage_name(static_cast<progress_stage>(i)),
+                      static_cast<unsigned long long>(stage.done), static_cast<unsigned long long>(stage.total),
+                      stage.rate / 1e6, static_cast<long long>(eta_seconds(stage.done, stage.total, stage.rate)),
+                      stalled(stage) ? 1 : 0);
+        std::cerr << line;
+    }
+    std::cerr << std::flush;
+}
+
+// runs on the log writer thread, or on the thread logging when there is none
+void Dashboard::log_message(int level, const char *source, const char *msg, void *arg) {
+    auto *self = static_cast<Dashboard *>(arg);
+    std::lock_guard<std::mutex> lk(self->lock);
+    if (self->done || self->clear_position.empty()) {
+        log_print_default(level, source, msg);
+        std::fflush(stdout);
+        return;
+    }
+    std::cerr << self->clear_position << std::flush;
+    log_print_default(level, source, msg);
+    std::fflush(stdout);
+    // the message took the place of the dashboard, draw it again below
+    self->reset_position.clear();
+    self->render();
+}
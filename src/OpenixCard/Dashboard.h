@@ -0,0 +1,90 @@
+/*
+ * Dashboard.h
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXCARD_DASHBOARD_H
+#define OPENIXCARD_DASHBOARD_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include "Progress.h"
+}
+
+// Show the progress counters of OpenixIMG and genimage while one step of a
+// conversion runs: bytes done, MB/s and ETA of every stage. On a terminal
+// this is an FTXUI dashboard redrawn in place, otherwise a key=value line
+// per stage every few seconds. Both go to stderr, a stage that has not
+// moved for a while is reported as stalled. While the dashboard is drawn on
+// the terminal stdout is on, the log is printed through it: erased, the
+// message, drawn again.
+class Dashboard {
+public:
+    enum Mode {
+        OFF,
+        AUTO,   // the dashboard on a terminal, lines otherwise
+        LINES,
+    };
+
+    // "auto", "lines" or "off", throws std::invalid_argument otherwise
+    static Mode parse_mode(const std::string &mode);
+
+    // reset the counters and start showing them, step names the output
+    Dashboard(Mode mode, std::string step);
+
+    // show the final state once more and stop
+    ~Dashboard();
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct Stage {
+        uint64_t done = 0;
+        uint64_t total = 0;
+        double rate = 0;    // bytes per second, smoothed
+        clock::time_point changed;
+    };
+
+    Mode mode;
+    bool tty = false;
+    bool route_log = false;
+    std::string step;
+    Stage stages[PROGRESS_STAGES];
+    clock::time_point last_sample;
+    std::string reset_position;
+    std::string clear_position;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool stop = false;
+    bool done = false;  // the final state is drawn, nothing to erase any more
+    std::thread thread;
+
+private:
+    void run();
+
+    void sample();
+
+    [[nodiscard]] bool stalled(const Stage &stage) const;
+
+    void render();
+
+    void print_lines();
+
+    static void log_message(int level, const char *source, const char *msg, void *arg);
+};
+
+
+#endif //OPENIXCARD_DASHBOARD_H
@@ -9,19 +9,19 @@
  * See README and LICENSE for more details.
  */
 
+#include <fstream>
 #include <string>
 #include <string_view>
 #include <sstream>
 #include <iomanip>
 
-#include <ColorCout.hpp>
-
 #include "FEX2CFG.h"
 #include "LOG.h"
 #include "exception.h"
+#include "StatsPhase.h"
 #include "payloads/chip.h"
 
-FEX2CFG::FEX2CFG(const std::string &dump_path) {
+FEX2CFG::FEX2CFG(const std::string &dump_path, const std::string &target) : target_path(target) {
     // parse basic files
     awImgPara.partition_table_fex_path = dump_path + '/' + awImgPara.partition_table_fex;
     awImgPara.image_name = dump_path.substr(dump_path.find_last_of('/') + 1, dump_path.length() - dump_path.find_last_of('/') + 1);
@@ -31,10 +31,18 @@ FEX2CFG::FEX2CFG(const std::string &dump_path) {
 
     // Parse File
     open_file(awImgPara.partition_table_fex_path);
-    classify_fex();
-    
-    parse_fex();
-    gen_cfg();
+    {
+        StatsPhase phase("fex_parse");
+        classify_fex();
+        parse_fex();
+        phase.set_bytes(awImgFex.size());
+    }
+
+    {
+        StatsPhase phase("cfg_gen");
+        gen_cfg();
+        phase.set_bytes(awImgCfg.size());
+    }
 }
 
 std::string FEX2CFG::save_file(const std::string &file_path) {
@@ -110,11 +118,10 @@ void FEX2CFG::parse_fex() {
     try {
         fex_classed = inicpp::parser::load(awImgFexClassed);
     } catch(const inicpp::ambiguity_exception &e) {
-        LOG::ERROR(std::string("Partition table error, bad format. ") + std::string(e.what()));
         LOG::ERROR(std::string("Your Partition table: "));
-        std::cout << awImgFexClassed << std::endl;
+        LOG::DATA(awImgFexClassed);
         LOG::ERROR(std::string("Please fix in `sys_partition.fex` and re-pack with Allwinner BSP"));
-        std::exit(-1);
+        throw partition_table_error(e.what());
     }
 }
 
@@ -142,8 +149,8 @@ uint FEX2CFG::get_image_real_size(bool print) {
 void FEX2CFG::gen_cfg() {
     // Generate Prefix
     awImgCfg += "image ";
-    awImgCfg += awImgPara.image_name;
-    awImgCfg += ".img {\n";
+    awImgCfg += target_path.empty() ? awImgPara.image_name + ".img" : "\"" + target_path + "\"";
+    awImgCfg += " {\n";
 
     // For Debug
     print_partition_table();
@@ -155,25 +162,24 @@ void FEX2CFG::gen_cfg() {
 }
 
 [[maybe_unused]] void FEX2CFG::print_partition_table() {
-    std::cout << cc::green;
     for (auto &sect: fex_classed) {
-        std::cout << std::left << std::setw(13) << "  Partition: '";
+        std::ostringstream line;
+        line << std::left << std::setw(13) << "  Partition: '";
         // Iterate through options in a section
         for (auto &opt: sect) {
             if (opt.get_name() == "name") {
                 auto name = opt.get<inicpp::string_ini_t>();
-                std::cout << std::left << std::setw(18) << name + "'";
+                line << std::left << std::setw(18) << name + "'";
                 if (name == "UDISK") {
-                    std::cout << "Remaining space.";
+                    line << "Remaining space.";
                 }
             } else if (opt.get_name() == "size") {
-                std::cout << std::left << std::setw(9) << static_cast<double>(opt.get<inicpp::unsigned_ini_t>()) / 2 / 0x300 << "MB - "
-                          << std::left << std::setw(7) << opt.get<inicpp::unsigned_ini_t>() / 2 << "KB";
+                line << std::left << std::setw(9) << static_cast<double>(opt.get<inicpp::unsigned_ini_t>()) / 2 / 0x300 << "MB - "
+                     << std::left << std::setw(7) << opt.get<inicpp::unsigned_ini_t>() / 2 << "KB";
             }
         }
-        std::cout << std::endl;
+        LOG::DATA(line.str());
     }
-    std::cout << cc::reset;
 }
 
 void FEX2CFG::get_partition_real_size() {
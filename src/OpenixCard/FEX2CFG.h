@@ -21,7 +21,8 @@
 
 class FEX2CFG {
 public:
-    explicit FEX2CFG(const std::string &dump_path);
+    // target is where the generated image is written (eg. a block device), <image_name>.img if empty
+    explicit FEX2CFG(const std::string &dump_path, const std::string &target = "");
 
     // save the configuration to the dump file path
     std::string save_file(const std::string &file_path);
@@ -50,6 +51,7 @@ private:
     std::vector <u_int> partition_size_list;
     std::string awImgFex = {};
     std::string awImgCfg = {};
+    std::string target_path = {};
     std::string awImgFexClassed = {};
     partition_table_type type = partition_table_type::gpt;
 
@@ -0,0 +1,471 @@
+/*
+ * Flasher.cpp
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <ColorCout.hpp>
+
+#include "Flasher.h"
+#include "LOG.h"
+#include "exception.h"
+
+extern "C" {
+#include "sha256.h"
+#include "BufferPool.h"
+}
+
+// 8 x 4 MiB in flight, enough to keep the slowest card busy while the
+// fastest one runs ahead. A smaller memory budget gets smaller slots.
+constexpr size_t FLASH_SLOT_COUNT = 8;
+constexpr uint64_t FLASH_SLOT_SIZE = 4 * 1024 * 1024;
+constexpr uint64_t FLASH_MIN_SLOT_SIZE = 64 * 1024;
+constexpr size_t FLASH_ALIGN = BUFFER_POOL_ALIGN;
+
+// an O_DIRECT buffer of exactly size bytes from the budgeted pool
+static char *aligned_buffer(uint64_t size) {
+    size_t got = size;
+    auto buf = static_cast<char *>(buffer_pool_get(&got, size));
+    if (buf == nullptr) {
+        throw std::runtime_error("Unable to allocate flash buffer within the memory budget");
+    }
+    return buf;
+}
+
+static std::string errno_string(const std::string &what) {
+    return what + ": " + std::strerror(errno);
+}
+
+Flasher::Flasher(std::string image_path, std::vector<std::string> devices, bool verify, bool progress)
+        : image_path(std::move(image_path)), verify(verify), progress(progress), slots(FLASH_SLOT_COUNT) {
+    for (auto &path: devices) {
+        auto dev = std::make_unique<Device>();
+        dev->path = path;
+        this->devices.emplace_back(std::move(dev));
+    }
+
+    // the slots, the zero buffer and a read back buffer per device share the budget
+    auto share = buffer_pool_budget() / (FLASH_SLOT_COUNT + 1 + (verify ? this->devices.size() : 0));
+    slot_size = std::min<uint64_t>(FLASH_SLOT_SIZE, share);
+    // the pool hands out powers of two, round down so every slot is the same size
+    while (slot_size & (slot_size - 1)) {
+        slot_size &= slot_size - 1;
+    }
+    if (slot_size < FLASH_MIN_SLOT_SIZE) {
+        throw std::runtime_error("Memory budget too small to flash " + std::to_string(this->devices.size()) + " devices");
+    }
+    try {
+        for (auto &slot: slots) {
+            slot.buf = aligned_buffer(slot_size);
+        }
+        zero_buf = aligned_buffer(slot_size);
+    } catch (...) {
+        release_buffers();
+        throw;
+    }
+    std::memset(zero_buf, 0, slot_size);
+}
+
+Flasher::~Flasher() {
+    release_buffers();
+    for (auto &dev: devices) {
+        if (dev->fd >= 0) close(dev->fd);
+        if (dev->tail_fd >= 0) close(dev->tail_fd);
+    }
+}
+
+void Flasher::release_buffers() {
+    for (auto &slot: slots) {
+        buffer_pool_put(slot.buf);
+        slot.buf = nullptr;
+    }
+    buffer_pool_put(zero_buf);
+    zero_buf = nullptr;
+}
+
+void Flasher::flash() {
+    int in_fd = open(image_path.c_str(), O_RDONLY);
+    if (in_fd < 0) {
+        throw file_open_error(image_path);
+    }
+    struct stat st{};
+    if (fstat(in_fd, &st) != 0) {
+        auto error = errno_string("stat");
+        close(in_fd);
+        throw std::runtime_error(error);
+    }
+    image_size = st.st_size;
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (auto &dev: devices) {
+        try {
+            open_device(*dev);
+            alive++;
+        } catch (const std::exception &e) {
+            dev->failed = true;
+            dev->error = e.what();
+        }
+    }
+    for (auto &dev: devices) {
+        if (!dev->failed) {
+            dev->thread = std::thread(&Flasher::writer, this, std::ref(*dev));
+        }
+    }
+
+    // the progress line is printed directly, get the log out of the way first
+    std::atomic<bool> stop_progress{false};
+    std::thread progress_thread;
+    if (progress) {
+        LOG::FLUSH();
+        progress_thread = std::thread(&Flasher::show_progress, this, std::cref(stop_progress));
+    }
+
+    sha256_ctx_t sha;
+    if (verify) {
+        sha256_init(&sha);
+    }
+    std::string source_error;
+    uint64_t offset = 0;
+
+    for (uint64_t seq = 0;; ++seq) {
+        Slot &slot = slots[seq % slots.size()];
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            cond.wait(lk, [&] { return slot.pending == 0 || alive == 0; });
+            if (alive == 0) {
+                break;
+            }
+        }
+
+        // the slot is ours now, fill it without holding the lock
+        slot.offset = offset;
+        slot.hole = false;
+        slot.last = offset >= image_size;
+        slot.error = false;
+        slot.len = 0;
+        if (!slot.last) {
+            auto data = lseek(in_fd, static_cast<off_t>(offset), SEEK_DATA);
+            if (data < 0) {
+                // nothing but a hole up to the end of the image
+                data = static_cast<off_t>(image_size);
+            }
+            if (static_cast<uint64_t>(data) > offset) {
+                slot.hole = true;
+                slot.len = data - offset;
+                if (verify) {
+                    for (uint64_t done = 0; done < slot.len; done += slot_size) {
+                        sha256_update(&sha, zero_buf, std::min(slot.len - done, slot_size));
+                    }
+                }
+            } else {
+                auto hole = lseek(in_fd, static_cast<off_t>(offset), SEEK_HOLE);
+                auto end = hole < 0 ? image_size : static_cast<uint64_t>(hole);
+                auto len = std::min(end - offset, slot_size);
+                auto r = pread(in_fd, slot.buf, len, static_cast<off_t>(offset));
+                if (r <= 0) {
+                    source_error = r < 0 ? errno_string(image_path) : image_path + ": unexpected end of file";
+                    slot.last = true;
+                    slot.error = true;
+                } else {
+                    slot.len = r;
+                    if (verify) {
+                        sha256_update(&sha, slot.buf, r);
+                    }
+                }
+            }
+            offset += slot.len;
+        }
+        if (slot.last && verify) {
+            sha256_final(&sha, image_digest);
+        }
+
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            slot.seq = seq;
+            slot.pending = alive;
+        }
+        cond.notify_all();
+        if (slot.last) {
+            break;
+        }
+    }
+    close(in_fd);
+
+    for (auto &dev: devices) {
+        if (dev->thread.joinable()) {
+            dev->thread.join();
+        }
+    }
+    stop_progress = true;
+    if (progress_thread.joinable()) {
+        progress_thread.join();
+    }
+
+    for (auto &dev: devices) {
+        if (dev->failed) {
+            LOG::ERROR(dev->path + " failed: " + dev->error);
+        } else {
+            LOG::INFO(dev->path + (verify ? " written and verified" : " written"));
+        }
+    }
+
+    if (!source_error.empty()) {
+        throw std::runtime_error("Reading " + source_error);
+    }
+}
+
+std::vector<std::string> Flasher::get_failed_devices() const {
+    std::vector<std::string> failed;
+    for (auto &dev: devices) {
+        if (dev->failed) {
+            failed.emplace_back(dev->path);
+        }
+    }
+    return failed;
+}
+
+void Flasher::open_device(Device &dev) {
+    struct stat st{};
+    if (stat(dev.path.c_str(), &st) != 0 || !S_ISBLK(st.st_mode)) {
+        throw not_block_device_error(dev.path);
+    }
+
+    int flags = O_WRONLY | O_EXCL;
+#ifdef O_DIRECT
+    dev.fd = open(dev.path.c_str(), flags | O_DIRECT);
+    if (dev.fd < 0 && errno == EINVAL)
+#endif
+        dev.fd = open(dev.path.c_str(), flags);
+    if (dev.fd < 0) {
+        throw std::runtime_error(errno_string("open"));
+    }
+    // unaligned leftovers bypass O_DIRECT through a second descriptor
+    dev.tail_fd = open(dev.path.c_str(), O_WRONLY);
+    if (dev.tail_fd < 0) {
+        throw std::runtime_error(errno_string("open"));
+    }
+
+#ifdef BLKGETSIZE64
+    uint64_t dev_size = 0;
+    if (ioctl(dev.fd, BLKGETSIZE64, &dev_size) == 0 && dev_size < image_size) {
+        throw std::runtime_error("device is smaller than the image (" + std::to_string(dev_size) +
+                                 " < " + std::to_string(image_size) + ")");
+    }
+#endif
+#ifdef BLKSSZGET
+    int block_size = 0;
+    if (ioctl(dev.fd, BLKSSZGET, &block_size) == 0 && block_size > 0) {
+        dev.block_size = block_size;
+    }
+#endif
+}
+
+void Flasher::writer(Device &dev) {
+    for (uint64_t seq = 0;; ++seq) {
+        Slot &slot = slots[seq % slots.size()];
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            cond.wait(lk, [&] { return slot.seq == seq; });
+        }
+
+        try {
+            if (slot.error) {
+                throw std::runtime_error("source image could not be read");
+            }
+            if (slot.hole) {
+                zero_at(dev, slot.len, slot.offset);
+            } else {
+                write_at(dev, slot.buf, slot.len, slot.offset);
+            }
+            dev.written += slot.len;
+            if (slot.last && (fsync(dev.fd) != 0 || fsync(dev.tail_fd) != 0)) {
+                throw std::runtime_error(errno_string("fsync"));
+            }
+        } catch (const std::exception &e) {
+            fail(dev, seq, e.what());
+            return;
+        }
+
+        bool last = slot.last;
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            slot.pending--;
+        }
+        cond.notify_all();
+        if (last) {
+            break;
+        }
+    }
+
+    if (verify) {
+        try {
+            read_back(dev);
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lk(lock);
+            dev.failed = true;
+            dev.error = e.what();
+        }
+    }
+}
+
+static void pwrite_all(int fd, const char *buf, uint64_t len, uint64_t offset) {
+    while (len > 0) {
+        auto w = pwrite(fd, buf, len, static_cast<off_t>(offset));
+        if (w < 0) {
+            throw std::runtime_error(errno_string("write"));
+        }
+        if (w == 0) {
+            throw std::runtime_error("short write");
+        }
+        buf += w;
+        len -= w;
+        offset += w;
+    }
+}
+
+void Flasher::write_at(Device &dev, const char *buf, uint64_t len, uint64_t offset) {
+    uint64_t aligned = 0;
+    if (offset % dev.block_size == 0) {
+        aligned = len - len % dev.block_size;
+    }
+    if (aligned > 0) {
+        pwrite_all(dev.fd, buf, aligned, offset);
+    }
+    if (len > aligned) {
+        pwrite_all(dev.tail_fd, buf + aligned, len - aligned, offset + aligned);
+    }
+}
+
+void Flasher::zero_at(Device &dev, uint64_t len, uint64_t offset) {
+#ifdef BLKZEROOUT
+    if (offset % dev.block_size == 0 && len >= dev.block_size) {
+        uint64_t range[2] = {offset, len - len % dev.block_size};
+        if (ioctl(dev.fd, BLKZEROOUT, range) == 0) {
+            offset += range[1];
+            len -= range[1];
+        }
+    }
+#endif
+    while (len > 0) {
+        auto now = std::min(len, slot_size);
+        write_at(dev, zero_buf, now, offset);
+        offset += now;
+        len -= now;
+    }
+}
+
+void Flasher::read_back(Device &dev) {
+    int flags = O_RDONLY;
+#ifdef O_DIRECT
+    // read from the card, not from the page cache
+    flags |= O_DIRECT;
+#endif
+    int fd = open(dev.path.c_str(), flags);
+    if (fd < 0) {
+        throw std::runtime_error(errno_string("open for verify"));
+    }
+#ifdef BLKFLSBUF
+    ioctl(fd, BLKFLSBUF, 0);
+#endif
+
+    std::unique_ptr<char, decltype(&buffer_pool_put)> buf(aligned_buffer(slot_size), &buffer_pool_put);
+    sha256_ctx_t sha;
+    if (verify) {
+        sha256_init(&sha);
+    }
+
+    uint64_t offset = 0;
+    while (offset < image_size) {
+        auto want = std::min(image_size - offset, slot_size);
+        // O_DIRECT reads must cover whole blocks, the extra bytes are not hashed
+        auto len = (want + FLASH_ALIGN - 1) / FLASH_ALIGN * FLASH_ALIGN;
+        auto r = pread(fd, buf.get(), len, static_cast<off_t>(offset));
+        if (r <= 0) {
+            close(fd);
+            throw std::runtime_error(r < 0 ? errno_string("read back") : "device too short on read back");
+        }
+        auto used = std::min<uint64_t>(r, want);
+        sha256_update(&sha, buf.get(), used);
+        offset += used;
+        dev.verified = offset;
+    }
+    close(fd);
+
+    uint8_t digest[SHA256_DIGEST_LEN];
+    sha256_final(&sha, digest);
+    if (std::memcmp(digest, image_digest, SHA256_DIGEST_LEN) != 0) {
+        throw std::runtime_error("read back does not match the image");
+    }
+}
+
+void Flasher::fail(Device &dev, uint64_t seq, const std::string &error) {
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        dev.failed = true;
+        dev.error = error;
+        alive--;
+        // every slot published from seq on still counts this writer
+        for (auto &slot: slots) {
+            if (slot.seq != UINT64_MAX && slot.seq >= seq && slot.pending > 0) {
+                slot.pending--;
+            }
+        }
+    }
+    cond.notify_all();
+}
+
+void Flasher::show_progress(const std::atomic<bool> &stop) {
+    auto print = [&]() {
+        std::cout << "\r" << cc::cyan;
+        for (auto &dev: devices) {
+            auto name = dev->path.substr(dev->path.find_last_of('/') + 1);
+            std::cout << name << ": ";
+            bool failed;
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                failed = dev->failed;
+            }
+            if (failed) {
+                std::cout << cc::red << "FAILED" << cc::cyan;
+            } else {
+                auto total = image_size ? image_size : 1;
+                auto pct = dev->written * 100 / total;
+                std::cout << "W" << std::setw(3) << pct << "%";
+                if (verify) {
+                    std::cout << " V" << std::setw(3) << dev->verified * 100 / total << "%";
+                }
+            }
+            std::cout << "  ";
+        }
+        std::cout << cc::reset << std::flush;
+    };
+
+    while (!stop) {
+        print();
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    print();
+    std::cout << std::endl;
+}
@@ -0,0 +1,100 @@
+/*
+ * Flasher.h
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXCARD_FLASHER_H
+#define OPENIXCARD_FLASHER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Write one image to several block devices at once. The image is read a
+// single time into a ring of shared buffers, every device has its own
+// writer thread consuming that ring. A device that fails is dropped without
+// stopping the others.
+class Flasher {
+public:
+    // progress prints a per device progress line to stdout while flashing
+    Flasher(std::string image_path, std::vector<std::string> devices, bool verify, bool progress = true);
+
+    ~Flasher();
+
+    void flash();
+
+    [[nodiscard]] std::vector<std::string> get_failed_devices() const;
+
+private:
+    struct Slot {
+        char *buf = nullptr;
+        uint64_t seq = UINT64_MAX;
+        uint64_t offset = 0;
+        uint64_t len = 0;
+        bool hole = false;
+        bool last = false;
+        // the source could not be read, nothing after this is valid
+        bool error = false;
+        // writers that still have to consume this slot
+        unsigned pending = 0;
+    };
+
+    struct Device {
+        std::string path;
+        int fd = -1;
+        int tail_fd = -1;
+        uint64_t block_size = 512;
+        std::atomic<uint64_t> written{0};
+        std::atomic<uint64_t> verified{0};
+        bool failed = false;
+        std::string error;
+        std::thread thread;
+    };
+
+    std::string image_path;
+    bool verify = false;
+    bool progress = true;
+    uint64_t image_size = 0;
+    uint8_t image_digest[32] = {};
+    char *zero_buf = nullptr;
+    // bytes per slot, FLASH_SLOT_SIZE unless the memory budget is tight
+    uint64_t slot_size = 0;
+
+    std::vector<Slot> slots;
+    std::vector<std::unique_ptr<Device>> devices;
+    unsigned alive = 0;
+    std::mutex lock;
+    std::condition_variable cond;
+
+private:
+    void release_buffers();
+
+    void open_device(Device &dev);
+
+    void writer(Device &dev);
+
+    void write_at(Device &dev, const char *buf, uint64_t len, uint64_t offset);
+
+    void zero_at(Device &dev, uint64_t len, uint64_t offset);
+
+    void read_back(Device &dev);
+
+    // drop the device and release every slot it still holds, starting with seq
+    void fail(Device &dev, uint64_t seq, const std::string &error);
+
+    void show_progress(const std::atomic<bool> &stop);
+};
+
+
+#endif //OPENIXCARD_FLASHER_H
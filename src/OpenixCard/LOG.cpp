@@ -9,26 +9,34 @@
  * See README and LICENSE for more details.
  */
 
-#include <ColorCout.hpp>
-
 #include "LOG.h"
 
+extern "C" {
+#include "Logger.h"
+}
+
+// the shared log colours and queues these, see Logger.h
+
 void LOG::DATA(const std::string &msg) {
-    std::cout << cc::green << msg << cc::reset << std::endl;
+    log_write(LOG_LEVEL_INFO, nullptr, "%s", msg.c_str());
 }
 
 void LOG::INFO(const std::string &msg) {
-    std::cout << cc::cyan << "[OpenixCard INFO] " << msg << cc::reset << std::endl;
+    log_write(LOG_LEVEL_INFO, "OpenixCard", "%s", msg.c_str());
 }
 
 [[maybe_unused]] void LOG::DEBUG(const std::string &msg) {
-    std::cout << cc::white << "[OpenixCard DEBUG] " << msg << cc::reset << std::endl;
+    log_write(LOG_LEVEL_DEBUG, "OpenixCard", "%s", msg.c_str());
 }
 
 void LOG::WARNING(const std::string &msg) {
-    std::cout << cc::yellow << "[OpenixCard WARNING] " << msg << cc::reset << std::endl;
+    log_write(LOG_LEVEL_WARNING, "OpenixCard", "%s", msg.c_str());
 }
 
 void LOG::ERROR(const std::string &msg) {
-    std::cout << cc::red << "[OpenixCard ERROR] " << msg << cc::reset << std::endl;
+    log_write(LOG_LEVEL_ERROR, "OpenixCard", "%s", msg.c_str());
+}
+
+void LOG::FLUSH() {
+    log_flush();
 }
@@ -25,6 +25,9 @@ public:
     [[maybe_unused]] static void WARNING(const std::string &msg);
 
     [[maybe_unused]] static void ERROR(const std::string &msg);
+
+    // wait until the queued messages are out, before writing to std::cout directly
+    static void FLUSH();
 };
 
 
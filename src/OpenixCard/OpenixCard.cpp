@@ -11,16 +11,20 @@
 
 #include <ColorCout.hpp>
 #include <argparse/argparse.hpp>
-#include <filesystem>
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <unistd.h>
 
 #include "LOG.h"
 #include "exception.h"
 #include "config.h"
-#include "FEX2CFG.h"
-#include "GenIMG.h"
 
 extern "C" {
-#include "OpenixIMG.h"
+#include "BufferPool.h"
+#include "Stats.h"
+#include "Logger.h"
 }
 
 #include "OpenixCard.h"
@@ -32,7 +36,14 @@ OpenixCard::OpenixCard(int argc, char **argv) {
         else
             return PROJECT_GIT_HASH;
     }());
-    show_logo();
+    // JSON goes to stdout, keep everything else out of it, and the colors out of files and pipes
+    json = std::any_of(argv + 1, argv + argc, [](const char *arg) { return std::string(arg) == "--json"; });
+    auto quiet = std::any_of(argv + 1, argv + argc, [](const char *arg) {
+        return std::string(arg) == "-q" || std::string(arg) == "--quiet" || std::string(arg) == "--log-json";
+    });
+    if (!json && !quiet && isatty(STDOUT_FILENO)) {
+        show_logo();
+    }
 
     parser.add_argument("-u", "--unpack")
             .help("Unpack Allwinner Image to folder")
@@ -50,10 +61,78 @@ OpenixCard::OpenixCard(int argc, char **argv) {
             .help("pack dumped Allwinner image to regular image from folder (needs cfg file)")
             .default_value(false)
             .implicit_value(true);
+    parser.add_argument("--pack-imagewty")
+            .help("Pack an unpacked folder with image.cfg back into an encrypted Allwinner image")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--from-card")
+            .help("Convert a card image or SD card with GPT/MBR back into an encrypted Allwinner image")
+            .default_value(false)
+            .implicit_value(true);
     parser.add_argument("-s", "--size")
             .help("Get the accurate size of Allwinner image")
             .default_value(false)
             .implicit_value(true);
+    parser.add_argument("-l", "--list")
+            .help("List the items of Allwinner image without unpacking it")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--json")
+            .help("Print the list as JSON (use together with list)")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--check")
+            .help("Check the header and item table of Allwinner image without unpacking it")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--cache")
+            .help("Directory to keep decrypted items in, unchanged items are linked from there on later runs")
+            .default_value(std::string(""));
+    parser.add_argument("--incremental")
+            .help("Update the previous converted image in place, only rewriting changed partitions (use together with dump)")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--target")
+            .help("Write the converted image straight to these block devices, comma separated, eg. /dev/sdX,/dev/sdY (use together with dump)")
+            .default_value(std::string(""));
+    parser.add_argument("--verify")
+            .help("Read the target devices back and compare them with the image after flashing")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--manifest")
+            .help("Hash every item while unpacking and write image.manifest next to image.cfg")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--check-manifest")
+            .help("Compare the unpacked items with a previous image.manifest")
+            .default_value(std::string(""));
+    parser.add_argument("--twofish")
+            .help("Decrypt the non-fex items with Twofish, for firmwares that encrypt them so")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--memory")
+            .help("Memory budget in MiB for the unpack and image buffers")
+            .default_value(std::string("64"));
+    parser.add_argument("--stats")
+            .help("Write the time, CPU time, bytes and peak memory of every conversion phase as JSON to this file")
+            .default_value(std::string(""));
+    parser.add_argument("--trace")
+            .help("Write a timeline of the pipeline threads, items and genimage steps as Chrome trace JSON to this file")
+            .default_value(std::string(""));
+    parser.add_argument("--progress")
+            .help("Show bytes, MB/s and ETA of every stage: auto (a dashboard on a terminal, lines otherwise), lines or off")
+            .default_value(std::string("auto"));
+    parser.add_argument("-q", "--quiet")
+            .help("Only print warnings and errors, and no progress")
+            .default_value(false)
+            .implicit_value(true);
+    parser.add_argument("--log-level")
+            .help("Print messages up to this level: error, warning, info, debug or trace")
+            .default_value(std::string("info"));
+    parser.add_argument("--log-json")
+            .help("Print the messages as JSON lines")
+            .default_value(false)
+            .implicit_value(true);
     parser.add_argument("input")
             .help("Input image file or directory path")
             .required()
@@ -63,7 +142,21 @@ OpenixCard::OpenixCard(int argc, char **argv) {
             "\r\nOpenixCard -uc <img>   - Unpack Allwinner image to target and generate Allwinner image partition table cfg"
             "\r\nOpenixCard -d  <img>   - Convert Allwinner image to regular image"
             "\r\nOpenixCard -p  <dir>   - pack dumped Allwinner image to regular image from folder"
+            "\r\nOpenixCard --pack-imagewty <dir> - Pack unpacked folder back to Allwinner image <dir>.img"
+            "\r\nOpenixCard --from-card <img> - Convert regular card image back to Allwinner image <img>.img"
             "\r\nOpenixCard -s  <img>   - Get the accurate size of Allwinner image)"
+            "\r\nOpenixCard -l  <img>   - List the items of Allwinner image"
+            "\r\nOpenixCard -l --json <img> - List the items of Allwinner image as JSON"
+            "\r\nOpenixCard --check <img> - Check Allwinner image for truncation or a damaged item table"
+            "\r\nOpenixCard -d --cache <dir> <img> - Convert, reusing items unchanged since the last run"
+            "\r\nOpenixCard -d --incremental <img> - Convert, rewriting only partitions changed since the last run"
+            "\r\nOpenixCard -d --target /dev/sdX <img> - Convert and flash directly to the SD card /dev/sdX"
+            "\r\nOpenixCard -d --verify --target /dev/sdX,/dev/sdY <img> - Convert, flash several SD cards at once and verify them"
+            "\r\nOpenixCard -u --check-manifest <file> <img> - Unpack and check the items against a previous image.manifest"
+            "\r\nOpenixCard -d --stats stats.json <img> - Convert and write where the time went to stats.json"
+            "\r\nOpenixCard -d --trace trace.json <img> - Convert and write a timeline for ui.perfetto.dev to trace.json"
+            "\r\nOpenixCard -d --progress lines <img> - Convert and print the progress as lines, eg. for a log file"
+            "\r\nOpenixCard -d -q --log-json <img> - Convert and print only warnings and errors, as JSON lines"
             "\r\n");
 
     if (argc < 2) {
@@ -88,18 +181,62 @@ OpenixCard::OpenixCard(int argc, char **argv) {
     }
 
     input_file = input_file_vector[0];
-
-    // if input file path is absolute path, convert to relative path, #1
-    std::filesystem::path input_path(input_file);
-
-    is_absolute = input_path.is_absolute();
-    temp_file_path = input_file + ".dump";
-    output_file_path = temp_file_path + ".out";
+    options.cache_dir = parser.get<std::string>("cache");
+    options.incremental = parser.get<bool>("incremental");
+    options.verify = parser.get<bool>("verify");
+    options.manifest = parser.get<bool>("manifest");
+    options.check_manifest = parser.get<std::string>("check-manifest");
+    options.twofish = parser.get<bool>("twofish");
+    stats_file = parser.get<std::string>("stats");
+    trace_file = parser.get<std::string>("trace");
+    try {
+        progress_mode = Dashboard::parse_mode(parser.get<std::string>("progress"));
+    } catch (const std::invalid_argument &err) {
+        throw operator_error("invalid progress mode " + parser.get<std::string>("progress"));
+    }
+    const std::vector<std::string> log_levels = {"error", "warning", "info", "debug", "trace"};
+    auto log_level = std::find(log_levels.begin(), log_levels.end(), parser.get<std::string>("log-level"));
+    if (log_level == log_levels.end()) {
+        throw operator_error("invalid log level " + parser.get<std::string>("log-level"));
+    }
+    if (parser.get<bool>("quiet")) {
+        log_set_level(LOG_LEVEL_WARNING);
+        progress_mode = Dashboard::OFF;
+    } else {
+        log_set_level(static_cast<int>(log_level - log_levels.begin()));
+    }
+    log_set_format(parser.get<bool>("log-json") ? LOG_FORMAT_JSON : LOG_FORMAT_TEXT);
+    // the flashing progress rewrites one colored line, only for a terminal showing text
+    options.flash_progress = progress_mode != Dashboard::OFF && !parser.get<bool>("log-json") &&
+                             isatty(STDOUT_FILENO);
+    try {
+        auto memory = std::stoull(parser.get<std::string>("memory"));
+        if (memory == 0) {
+            throw std::invalid_argument("memory");
+        }
+        // the budget is in bytes, it has to fit a size_t
+        if (memory > std::numeric_limits<size_t>::max() / (1024 * 1024)) {
+            throw std::out_of_range("memory");
+        }
+        buffer_pool_set_budget(memory * 1024 * 1024);
+    } catch (const std::logic_error &err) {
+        throw operator_error("invalid memory budget " + parser.get<std::string>("memory"));
+    }
+    std::stringstream target_list(parser.get<std::string>("target"));
+    for (std::string target; std::getline(target_list, target, ',');) {
+        if (!target.empty()) {
+            options.targets.emplace_back(target);
+        }
+    }
 
     // Basic Operator
     mode = [&]() {
         if (parser.get<bool>("pack")) {
             return OpenixCardOperator::PACK;
+        } else if (parser.get<bool>("pack-imagewty")) {
+            return OpenixCardOperator::PACKIMAGEWTY;
+        } else if (parser.get<bool>("from-card")) {
+            return OpenixCardOperator::FROMCARD;
         } else if (parser.get<bool>("unpack")) {
             if (parser.get<bool>("cfg")) {
                 return OpenixCardOperator::UNPACKCFG;
@@ -109,6 +246,10 @@ OpenixCard::OpenixCard(int argc, char **argv) {
             return OpenixCardOperator::DUMP;
         } else if (parser.get<bool>("size")) {
             return OpenixCardOperator::SIZE;
+        } else if (parser.get<bool>("list")) {
+            return OpenixCardOperator::LIST;
+        } else if (parser.get<bool>("check")) {
+            return OpenixCardOperator::CHECK;
         } else {
             return OpenixCardOperator::NONE;
         }
@@ -120,22 +261,32 @@ OpenixCard::OpenixCard(int argc, char **argv) {
         throw operator_missing_error();
     }
 
+    // from here on the messages are queued and written by a thread of their own
+    log_start();
+    stats_enable(!stats_file.empty());
+    stats_enable_trace(!trace_file.empty());
+    stats_thread_name("main");
+
+    // a dashboard for every step the conversion runs
+    options.on_step = [this](const std::string &step, bool begin) {
+        dashboard.reset();
+        if (begin) {
+            dashboard = std::make_unique<Dashboard>(progress_mode, step);
+        }
+    };
+    run();
 
-    if (mode == OpenixCardOperator::DUMP) {
-        unpack_target_image();
-        LOG::INFO("Convert Done! Parsing the partition tables...");
-        dump_and_clean();
-    } else if (mode == OpenixCardOperator::UNPACK || mode == OpenixCardOperator::UNPACKCFG) {
-        unpack_target_image();
-        LOG::INFO("Unpack Done! Your image file is at " + temp_file_path);
-        if (mode == OpenixCardOperator::UNPACKCFG) {
-            save_cfg_file();
+    if (!stats_file.empty()) {
+        if (stats_write_json(stats_file.c_str()) != 0) {
+            throw file_open_error(stats_file);
         }
-    } else if (mode == OpenixCardOperator::PACK) {
-        pack();
-    } else if (mode == OpenixCardOperator::SIZE) {
-        unpack_target_image();
-        get_real_size();
+        LOG::INFO("Phase statistics written to " + stats_file);
+    }
+    if (!trace_file.empty()) {
+        if (stats_write_trace(trace_file.c_str()) != 0) {
+            throw file_open_error(trace_file);
+        }
+        LOG::INFO("Trace written to " + trace_file);
     }
 }
 
@@ -151,101 +302,104 @@ void OpenixCard::show_logo() {
               << cc::reset << std::endl;
 }
 
-void OpenixCard::pack() {
-    LOG::INFO("Generating target image...");
-
-    std::string target_cfg_path = {};
-
-    auto a = std::filesystem::directory_iterator(input_file);
-    temp_file_path = input_file; // for potential size query
+void OpenixCard::run() {
+    openixcard::Converter converter(options);
 
-    for (const auto &entry: std::filesystem::directory_iterator(input_file)) {
-        if (entry.path().extension() == ".cfg") {
-            if (entry.path().filename() != "image.cfg") {
-                target_cfg_path = entry.path().string();
-            }
+    if (mode == OpenixCardOperator::DUMP) {
+        auto result = converter.dump(input_file);
+        // flashing several devices was reported by Converter already
+        if (result.flashed.empty() || result.output == result.flashed[0]) {
+            LOG::INFO("Generate Done! Your image file is at " + result.output);
         }
+        LOG::INFO("Cleaning up...");
+    } else if (mode == OpenixCardOperator::UNPACK || mode == OpenixCardOperator::UNPACKCFG) {
+        auto result = converter.unpack(input_file, mode == OpenixCardOperator::UNPACKCFG);
+        LOG::INFO("Unpack Done! Your image file is at " + result.directory);
+        if (mode == OpenixCardOperator::UNPACKCFG) {
+            LOG::INFO("Parse Done! Your cfg file is at " + result.cfg_file);
+        }
+    } else if (mode == OpenixCardOperator::PACK) {
+        auto output = converter.pack(input_file);
+        LOG::INFO("Generate Done! Your image file is at " + output + " Cleaning up...");
+    } else if (mode == OpenixCardOperator::PACKIMAGEWTY) {
+        auto image_file = converter.pack_imagewty(input_file);
+        LOG::INFO("Pack Done! Your image file is at " + image_file);
+    } else if (mode == OpenixCardOperator::FROMCARD) {
+        auto image_file = converter.from_card(input_file);
+        LOG::INFO("Convert Done! Your image file is at " + image_file);
+    } else if (mode == OpenixCardOperator::SIZE) {
+        auto real_size = converter.size(input_file);
+        LOG::DATA("The accurate size of image: " + std::to_string(real_size / 1024) + "MB, " + std::to_string(real_size) + "KB");
+    } else if (mode == OpenixCardOperator::LIST) {
+        if (!json) {
+            LOG::INFO("Listing input file: " + input_file);
+        }
+        print_list(converter.list(input_file));
+    } else if (mode == OpenixCardOperator::CHECK) {
+        converter.check(input_file);
+        LOG::INFO("Check Done! " + input_file + " looks valid");
     }
-
-    if (target_cfg_path.empty()) {
-        LOG::ERROR("Can't find target image partition table cfg file in target folder");
-        return;
-    }
-
-    GenIMG gen_img(target_cfg_path, input_file, input_file);
-
-    // check gen_img-src result
-    if (gen_img.get_status() == -EINVAL) {
-        LOG::ERROR("Generate image failed! Check your cfg file in: " + target_cfg_path);
-        std::exit(1);
-    } else if (gen_img.get_status() != 0) {
-        LOG::ERROR("Generate image failed!");
-        std::exit(1);
-    }
-
-    LOG::INFO("Generate Done! Your image file is at " + input_file + " Cleaning up...");
 }
 
-void OpenixCard::unpack_target_image() {
-    // dump the packed image
-    LOG::INFO("Converting input file: " + input_file);
-    check_file(input_file);
-    std::filesystem::create_directories(temp_file_path);
-    crypto_init();
-    std::cout << cc::cyan;
-    auto unpack_img_ret = unpack_image(input_file.c_str(), temp_file_path.c_str(), is_absolute);
-    std::cout << cc::reset;
-
-    switch (unpack_img_ret) {
-        case 2:
-            throw file_open_error(input_file);
-        case 3:
-            throw file_size_error(input_file);
-        case 4:
-            throw std::runtime_error("Unable to allocate memory for image: " + input_file);
-        case 5:
-            throw file_format_error(input_file);
-        default:
-            break;
+static std::string json_string(const std::string &str) {
+    std::ostringstream out;
+    out << '"';
+    for (auto c: str) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+        } else {
+            out << c;
+        }
     }
+    out << '"';
+    return out.str();
 }
 
-void OpenixCard::dump_and_clean() {
-    FEX2CFG fex2Cfg(temp_file_path);
-    auto target_cfg_path = fex2Cfg.save_file(temp_file_path);
-    auto image_name = fex2Cfg.get_image_name();
-    // generate the image
-    LOG::INFO("Parse Done! Generating target image...");
-
-    GenIMG genimage(target_cfg_path, temp_file_path, output_file_path);
-
-    // check genimage-src result
-    if (genimage.get_status() != 0) {
-        LOG::ERROR("Generate image failed!");
-        std::exit(1);
+static const char *item_cipher(const openixcard::ImageItem &item) {
+    if (!item.encrypted) {
+        return "none";
     }
-
-    LOG::INFO("Generate Done! Your image file is at " + output_file_path);
-    LOG::INFO("Cleaning up...");
+    return item.twofish ? "twofish" : "rc6";
 }
 
-void OpenixCard::save_cfg_file() {
-    FEX2CFG fex2Cfg(temp_file_path);
-    auto target_cfg_path = fex2Cfg.save_file(temp_file_path);
-    LOG::INFO("Parse Done! Your cfg file is at " + target_cfg_path);
-}
-
-void OpenixCard::check_file(const std::string &file_path) {
-    if (!std::filesystem::exists(file_path)) {
-        throw file_open_error(file_path);
+void OpenixCard::print_list(const openixcard::ImageList &list) const {
+    std::ostringstream version;
+    version << "0x" << std::hex << std::setw(4) << std::setfill('0') << list.version;
+
+    LOG::FLUSH();
+    if (json) {
+        std::cout << "{\"image\": " << json_string(input_file)
+                  << ", \"version\": \"" << version.str() << "\""
+                  << ", \"items\": [";
+        for (size_t i = 0; i < list.items.size(); i++) {
+            const auto &e = list.items[i];
+            std::cout << (i ? ", " : "")
+                      << "{\"filename\": " << json_string(e.filename)
+                      << ", \"maintype\": " << json_string(e.maintype)
+                      << ", \"subtype\": " << json_string(e.subtype)
+                      << ", \"offset\": " << e.offset
+                      << ", \"stored_length\": " << e.stored_length
+                      << ", \"original_length\": " << e.original_length
+                      << ", \"encrypted\": " << (e.encrypted ? "true" : "false")
+                      << ", \"cipher\": \"" << item_cipher(e) << "\"}";
+        }
+        std::cout << "]}" << std::endl;
+    } else {
+        LOG::DATA("IMG version " + version.str() + ", " + std::to_string(list.items.size()) + " items");
+        std::cout << std::left
+                  << std::setw(10) << "MAINTYPE" << std::setw(18) << "SUBTYPE"
+                  << std::right
+                  << std::setw(12) << "OFFSET" << std::setw(12) << "STORED" << std::setw(12) << "ORIGINAL"
+                  << "  " << std::setw(7) << "CIPHER" << "  FILENAME" << std::endl;
+        for (const auto &e: list.items) {
+            std::cout << std::left
+                      << std::setw(10) << e.maintype << std::setw(18) << e.subtype
+                      << std::right
+                      << std::setw(12) << e.offset << std::setw(12) << e.stored_length
+                      << std::setw(12) << e.original_length
+                      << "  " << std::setw(7) << item_cipher(e) << "  " << e.filename << std::endl;
+        }
     }
 }
-
-void OpenixCard::get_real_size() {
-    LOG::INFO("Getting accurate size of Allwinner img...");
-    FEX2CFG fex2Cfg(temp_file_path);
-    auto real_size = fex2Cfg.get_image_real_size(true);
-    LOG::DATA("The accurate size of image: " + std::to_string(real_size / 1024) + "MB, " + std::to_string(real_size) + "KB");
-    std::filesystem::remove_all(temp_file_path);
-}
-
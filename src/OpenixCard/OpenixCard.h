@@ -13,8 +13,14 @@
 #define OPENIXCARD_OPENIXCARD_H
 
 #include <iostream>
+#include <memory>
 #include <vector>
 
+#include "Converter.h"
+#include "Dashboard.h"
+
+// The command line front end of Converter: parse the arguments, run the
+// conversion and print its result
 class OpenixCard {
 public:
     OpenixCard(int argc, char **argv);
@@ -22,35 +28,35 @@ public:
 private:
     std::vector<std::string> input_file_vector;
     std::string input_file;
-    std::string temp_file_path;
-    std::string output_file_path;
+    openixcard::Options options;
+    std::string stats_file;
+    std::string trace_file;
+    Dashboard::Mode progress_mode = Dashboard::AUTO;
+    // the dashboard of the step Converter runs
+    std::unique_ptr<Dashboard> dashboard;
+    bool json = false;
 
     enum OpenixCardOperator {
         NONE,
         PACK,
+        PACKIMAGEWTY,
+        FROMCARD,
         UNPACK,
         UNPACKCFG,
         DUMP,
         SIZE,
+        CHECK,
+        LIST,
     };
 
     OpenixCardOperator mode;
-    bool is_absolute = false;
 
 private:
     static void show_logo();
 
-    static void check_file(const std::string& file_path);
-private:
-    void pack();
-
-    void unpack_target_image();
-
-    void dump_and_clean();
-
-    void save_cfg_file();
+    void run();
 
-    void get_real_size();
+    void print_list(const openixcard::ImageList &list) const;
 };
 
 
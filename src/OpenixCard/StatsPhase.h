@@ -0,0 +1,46 @@
+/*
+ * StatsPhase.h
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXCARD_STATSPHASE_H
+#define OPENIXCARD_STATSPHASE_H
+
+#include <cstdint>
+
+extern "C" {
+#include "Stats.h"
+}
+
+// stats_begin() and stats_end() around a scope, also when it is left by an exception
+class StatsPhase {
+public:
+    explicit StatsPhase(const char *phase, uint64_t bytes = 0) : phase(phase), bytes(bytes) {
+        stats_begin();
+    }
+
+    ~StatsPhase() {
+        stats_end(phase, bytes);
+    }
+
+    StatsPhase(const StatsPhase &) = delete;
+
+    StatsPhase &operator=(const StatsPhase &) = delete;
+
+    // the bytes are often only known once the work is done
+    void set_bytes(uint64_t n) {
+        bytes = n;
+    }
+
+private:
+    const char *phase;
+    uint64_t bytes;
+};
+
+#endif //OPENIXCARD_STATSPHASE_H
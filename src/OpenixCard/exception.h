@@ -30,6 +30,31 @@ public:
     explicit file_size_error(const std::string &what) : std::runtime_error("Invalid file size: " + what + ".") {};
 };
 
+class not_block_device_error : public std::runtime_error {
+public:
+    explicit not_block_device_error(const std::string &what) : std::runtime_error("Target: " + what + " is not a block device.") {};
+};
+
+class manifest_mismatch_error : public std::runtime_error {
+public:
+    explicit manifest_mismatch_error(const std::string &what) : std::runtime_error("Unpacked items do not match manifest: " + what + ".") {};
+};
+
+class partition_table_error : public std::runtime_error {
+public:
+    explicit partition_table_error(const std::string &what) : std::runtime_error("Partition table error, bad format. " + what) {};
+};
+
+class generate_error : public std::runtime_error {
+public:
+    explicit generate_error(const std::string &what) : std::runtime_error("Generate image failed: " + what + ".") {};
+};
+
+class flash_error : public std::runtime_error {
+public:
+    explicit flash_error(const std::string &what) : std::runtime_error("Flashing failed on " + what + ".") {};
+};
+
 class no_file_provide_error : public std::runtime_error {
 public:
     no_file_provide_error() : std::runtime_error("No file Provide.") {};
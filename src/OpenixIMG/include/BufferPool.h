@@ -0,0 +1,45 @@
+/*
+ * BufferPool.h Shared buffers for the unpack and image generation paths
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXIMG_BUFFERPOOL_H
+#define OPENIXIMG_BUFFERPOOL_H
+
+#include <stddef.h>
+
+/* Every buffer is aligned for O_DIRECT and sized to a power of two */
+#define BUFFER_POOL_ALIGN           4096
+#define BUFFER_POOL_DEFAULT_BUDGET  (64 * 1024 * 1024)
+
+/*
+ * Limit the memory held by the pool, counting buffers in use and buffers
+ * kept for reuse. 0 restores the default budget.
+ */
+void buffer_pool_set_budget(size_t budget);
+
+size_t buffer_pool_budget(void);
+
+/*
+ * Get a buffer of up to *size bytes, rounded down to a power of two. No
+ * buffer is smaller than BUFFER_POOL_ALIGN or min_size, a *size below that
+ * gets one of that size. When the budget does not allow *size, a smaller
+ * one down to min_size is handed out instead. *size is updated to the usable size. Returns NULL when not
+ * even min_size fits; it never blocks. Callers that need several buffers
+ * should ask for their share of buffer_pool_budget() each.
+ */
+void *buffer_pool_get(size_t *size, size_t min_size);
+
+/* Return a buffer to the pool, NULL is ignored */
+void buffer_pool_put(void *buf);
+
+/* Free all buffers that are not in use */
+void buffer_pool_trim(void);
+
+#endif //OPENIXIMG_BUFFERPOOL_H
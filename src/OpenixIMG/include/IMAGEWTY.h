@@ -25,7 +25,7 @@ struct imagewty_header {
     uint32_t ram_base;
     uint32_t version;        /* format version (IMAGEWTY_VERSION) */
     uint32_t image_size;            /* total size of image file (rounded up to 256 bytes?) */
-    uint32_t image_header_size;     /* image header size (including padding) */
+    uint32_t image_size_hi;         /* high 32 bits of image_size (v3) */
     union {
         struct {
             uint32_t pid;            /* USB peripheral ID (from image.cfg) */
@@ -83,10 +83,11 @@ struct imagewty_file_header {
             uint32_t unknown_0;
             const char filename[IMAGEWTY_FHDR_FILENAME_LEN];
             uint32_t stored_length;
-            uint32_t pad1;
+            uint32_t stored_length_hi;      /* high 32 bits, images over 4 GiB */
             uint32_t original_length;
-            uint32_t pad2;
+            uint32_t original_length_hi;
             uint32_t offset;
+            uint32_t offset_hi;
         } v3;
     };
 };
@@ -0,0 +1,87 @@
+/*
+ * Logger.h One log for OpenixCard, OpenixIMG and genimage
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXIMG_LOGGER_H
+#define OPENIXIMG_LOGGER_H
+
+#include <stdarg.h>
+
+/* Not LOG_INFO and friends, <syslog.h> has those */
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_TRACE,
+};
+
+enum log_format {
+    LOG_FORMAT_TEXT,    /* "[source LEVEL] message", coloured on a terminal */
+    LOG_FORMAT_JSON,    /* one JSON object per line */
+};
+
+/*
+ * Messages are queued in a ring of this many lines of up to LOG_LINE_MAX
+ * bytes, a longer one is written right away by the thread logging it.
+ */
+#define LOG_RING_SLOTS      512
+#define LOG_LINE_MAX        512
+
+/* Drop messages above level, before they are even formatted. The default is info */
+void log_set_level(int level);
+
+int log_enabled(int level);
+
+void log_set_format(enum log_format format);
+
+typedef void (*log_handler)(int level, const char *source, const char *msg, void *arg);
+
+/*
+ * Hand the messages to handler instead of printing them to stdout, source
+ * is NULL for data. It runs on the writer thread once log_start() was
+ * called. NULL prints to stdout again.
+ */
+void log_set_handler(log_handler handler, void *arg);
+
+/* Print a message the way it is without a handler, for a handler that only wraps that */
+void log_print_default(int level, const char *source, const char *msg);
+
+/*
+ * Hand the messages to a writer thread from now on. A message then only
+ * costs formatting and a copy into the ring; the writer prints what piled
+ * up in one go and flushes once per batch. When the ring is full, debug
+ * and trace messages are dropped (and counted) rather than waiting for the
+ * terminal, the others wait. Until then, and in a forked child, messages
+ * are written by the caller.
+ */
+void log_start(void);
+
+/* Write what is queued and stop the writer, also done at exit */
+void log_stop(void);
+
+/* Wait until everything queued is written, before printing to stdout directly */
+void log_flush(void);
+
+/*
+ * Log a message of source ("OpenixIMG", ...). A NULL source is plain data
+ * like a partition table, printed without prefix. A trailing newline is
+ * not needed, one is dropped.
+ */
+void log_write(int level, const char *source, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+void log_vwrite(int level, const char *source, const char *fmt, va_list args);
+
+/* For genimage, which does not see this header: its 0 error .. 3 vdebug levels */
+int log_genimage_enabled(int level);
+
+void log_genimage(int level, const char *msg);
+
+#endif //OPENIXIMG_LOGGER_H
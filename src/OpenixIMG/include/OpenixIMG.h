@@ -32,8 +32,106 @@ void crypto_init(void);
 
 void *rc6_decrypt_inplace(void *p, size_t len, rc6_ctx_t *ctx);
 
+void *tf_decrypt_inplace(void *p, size_t len, tf_ctx_t *ctx);
+
 FILE *dir_fopen(const char *dir, const char *path, const char *mode, int is_absolute);
 
+/*
+ * Keep decrypted items in dir, keyed by the hash of their stored bytes and
+ * file header metadata. Later unpacks link unchanged items from there instead
+ * of decrypting and writing them again. NULL or "" disables the cache.
+ */
+void set_unpack_cache_dir(const char *dir);
+
+/*
+ * Hash every item while it is unpacked and write the digests to
+ * image.manifest next to image.cfg. If verify_manifest names a previous
+ * manifest, the items are compared against it and unpack_image() returns 7
+ * on any difference. A verify_manifest implies enable.
+ */
+void set_unpack_manifest(int enable, const char *verify_manifest);
+
+/*
+ * Some firmwares encrypt the content of the items that are not .fex files
+ * (tool binaries, scripts, ...) with Twofish instead of RC6. Enable this to
+ * unpack those; the .fex items stay RC6 either way.
+ */
+void set_unpack_twofish(int enable);
+
+/*
+ * Read only the image header and item table and check them against the
+ * file size: item bounds, overlaps and lengths. unpack_image() does the
+ * same before touching any item data. Returns 0 or the unpack_image()
+ * error code.
+ */
+int validate_image(const char *infn);
+
+/* One item of an image as returned by list_image() */
+struct image_entry {
+    char filename[IMAGEWTY_FHDR_FILENAME_LEN];
+    char maintype[IMAGEWTY_FHDR_MAINTYPE_LEN + 1];
+    char subtype[IMAGEWTY_FHDR_SUBTYPE_LEN + 1];
+    uint64_t offset;
+    uint64_t stored_length;
+    uint64_t original_length;
+    int encrypted;      /* stored encrypted */
+    int twofish;        /* with Twofish instead of RC6, see set_unpack_twofish() */
+};
+
+/*
+ * Read and validate only the image header and item table, like
+ * validate_image(), and return the items in *entries, to be released with
+ * free(). Nothing is printed unless the table is damaged. Returns 0 or the
+ * unpack_image() error code.
+ */
+int list_image(const char *infn, struct image_entry **entries, uint32_t *num_entries, uint32_t *header_version);
+
 int unpack_image(const char *infn, const char *outdn, int is_absolute);
 
+/*
+ * Header version (0x0100 or 0x0300) and encryption of the images
+ * pack_imagewty() and pack_imagewty_sources() write. The default is an
+ * encrypted v3 image, like the vendor tools write. v1 images can not be
+ * larger than 4 GiB. Returns -1 for an unknown version.
+ */
+int set_pack_format(uint32_t header_version, int encrypt);
+
+/* The image wide fields of the [IMAGE_CFG] section of image.cfg */
+struct imagewty_ids {
+    uint32_t version;
+    uint32_t pid;
+    uint32_t vid;
+    uint32_t hardware_id;
+    uint32_t firmware_id;
+};
+
+/*
+ * Build an IMAGEWTY image at outfn from the items listed in an image.cfg
+ * written by unpack_image(). Item paths are taken relative to the
+ * directory of the cfg. Returns 0, 2 if the cfg, an item or outfn can not
+ * be opened, 3 if the image is too large for a v1 header, 4 when out of
+ * memory, 5 if the cfg can not be parsed or 6 on I/O errors; outfn is
+ * removed on failure.
+ */
+int pack_imagewty(const char *cfgfn, const char *outfn);
+
+/* One item for pack_imagewty_sources() */
+struct pack_source {
+    const char *filename;
+    const char *maintype;
+    const char *subtype;
+    const void *data;   /* take length bytes from here ... */
+    int fd;             /* ... or from offset of fd */
+    uint64_t offset;
+    uint64_t length;
+    int trim;           /* leave out trailing zeros and do not read holes */
+};
+
+/*
+ * Like pack_imagewty(), but the items are streamed from the given sources,
+ * eg. partitions of a card image, without intermediate files.
+ */
+int pack_imagewty_sources(const struct pack_source *sources, size_t num_sources,
+                          const struct imagewty_ids *ids, const char *outfn);
+
 #endif //OPENIXIMG_OPENIXIMG_H
@@ -0,0 +1,57 @@
+/*
+ * Progress.h Live byte counters of a conversion
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXIMG_PROGRESS_H
+#define OPENIXIMG_PROGRESS_H
+
+#include <stdint.h>
+
+/*
+ * The stages are counted apart since they overlap: an unpack reads,
+ * decrypts and writes items at the same time, a pack reads, encrypts and
+ * writes the image.
+ */
+enum progress_stage {
+    PROGRESS_READ,
+    PROGRESS_DECRYPT,
+    PROGRESS_ENCRYPT,
+    PROGRESS_WRITE,
+    PROGRESS_INSERT,    /* genimage copying the partitions into the image */
+    PROGRESS_STAGES,
+};
+
+/* Clear all counters, done before every conversion step */
+void progress_reset(void);
+
+/*
+ * Add bytes to the expected total of a stage. A total that is only known
+ * bit by bit, like the partitions genimage inserts, grows as it goes.
+ */
+void progress_expect(enum progress_stage stage, uint64_t bytes);
+
+/*
+ * Count bytes as done. The counters are atomic and need no lock, so this
+ * is cheap enough for every chunk of the pipeline threads.
+ */
+void progress_add(enum progress_stage stage, uint64_t bytes);
+
+uint64_t progress_done(enum progress_stage stage);
+
+uint64_t progress_total(enum progress_stage stage);
+
+const char *progress_stage_name(enum progress_stage stage);
+
+/* For genimage, which does not see this header */
+void progress_insert_expect(uint64_t bytes);
+
+void progress_insert_add(uint64_t bytes);
+
+#endif //OPENIXIMG_PROGRESS_H
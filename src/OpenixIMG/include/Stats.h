@@ -0,0 +1,76 @@
+/*
+ * Stats.h Per phase timing and byte counts of a conversion
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef OPENIXIMG_STATS_H
+#define OPENIXIMG_STATS_H
+
+#include <stdint.h>
+
+/*
+ * The phases of a conversion: unpack with read, decrypt and item_write,
+ * pack with item_read, encrypt and image_write, fex_parse and cfg_gen of
+ * FEX2CFG, generate with image_setup and genimage:<handler> for every image,
+ * systemp for the commands genimage runs, insert_image and gpt_write.
+ */
+
+/* Phases nest at most this deep on one thread */
+#define STATS_MAX_DEPTH     16
+#define STATS_MAX_PHASES    64
+#define STATS_NAME_LEN      48
+
+/*
+ * Start collecting, which also clears what was collected before. Until then
+ * stats_begin() and stats_end() return right away.
+ */
+void stats_enable(int enable);
+
+int stats_enabled(void);
+
+/*
+ * Time the code between stats_begin() and the matching stats_end() on the
+ * same thread, wall clock and CPU time of that thread, and add it and bytes
+ * to the named phase. Pairs nest, the outer phase includes the inner ones.
+ * Phases of the pipeline threads overlap, so their times do not add up to
+ * the total.
+ */
+void stats_begin(void);
+
+void stats_end(const char *phase, uint64_t bytes);
+
+/* Like stats_end(), detail (the item, image or command) also names the trace span */
+void stats_end_detail(const char *phase, const char *detail, uint64_t bytes);
+
+/*
+ * Write the collected phases as JSON: for every phase the number of runs,
+ * wall and CPU time, bytes, MB/s and the peak RSS of the process when the
+ * phase last ended, plus the wall and CPU time since stats_enable() and the
+ * peak RSS of the whole process. Returns 0 or -1 if path can not be written.
+ */
+int stats_write_json(const char *path);
+
+/*
+ * Also record every stats_begin() / stats_end() pair as a span with its
+ * thread, for a timeline of the pipeline stages. Clears the spans recorded
+ * before.
+ */
+void stats_enable_trace(int enable);
+
+/* Name the calling thread in the trace, eg. "unpack reader" */
+void stats_thread_name(const char *name);
+
+/*
+ * Write the recorded spans as Chrome trace event JSON, to be loaded into
+ * chrome://tracing or ui.perfetto.dev. Returns 0 or -1 if path can not be
+ * written.
+ */
+int stats_write_trace(const char *path);
+
+#endif //OPENIXIMG_STATS_H
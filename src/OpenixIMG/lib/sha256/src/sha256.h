@@ -0,0 +1,37 @@
+/*
+ * sha256.h SHA-256 message digest (FIPS 180-4)
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN   32
+#define SHA256_HEX_LEN      (SHA256_DIGEST_LEN * 2 + 1)
+
+typedef struct sha256_ctx_st {
+    uint32_t state[8];
+    uint64_t length;        /* total message length in bytes */
+    uint8_t buf[64];        /* pending partial block */
+    size_t buf_len;
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_LEN]);
+
+/* Format a digest as a NUL terminated lower case hex string */
+void sha256_hex(const uint8_t digest[SHA256_DIGEST_LEN], char hex[SHA256_HEX_LEN]);
+
+#endif /* SHA256_H_ */
@@ -38,54 +38,36 @@ Mean:          378 cycles =    67.8 mbits/sec
 
 */
 
+#include <string.h>
+
 #include "std_defs.h"
 #include "twofish.h"
 
-#define Q_TABLES
-#define M_TABLE
-#define MK_TABLE
-#define ONE_STEP
-
 static char *alg_name[] = {"twofish", "twofish.c", "twofish"};
 
 char **cipher_name() {
     return alg_name;
 }
 
-u4byte k_len;
-u4byte l_key[40]
-#if 1
-        = {
-                0x4f1a3415, 0xbf541f51,
-                0x86fdce14, 0xe354f4a1,
-                0x616aadf9, 0xf310ee3f,
-                0xac74403f, 0xc562a030,
-                0xb76ff9f8, 0xe9b06896,
-                0x70c408a2, 0xfe3aedac,
-                0x5fa06e5e, 0x61fee97a,
-                0xa15cba01, 0x3583fafa,
-                0xcdb4985a, 0xe7172864,
-                0x7c003d57, 0xbf9f1b71,
-                0xcff1f4ab, 0xbdff4376,
-                0x57bc905d, 0xe3131a0e,
-                0x1007c7ea, 0x4d054e0e,
-                0x76baa279, 0x35aeb6c0,
-                0x398f5e03, 0x3a2c1d70,
-                0xd6dfbcf8, 0xcaf94cf4,
-                0xf67c3460, 0xc808ecd0,
-                0xd4360d82, 0x5168cf37,
-                0xf7a02dbf, 0xdf8968af,
-                0x27135ef4, 0x41234d48,
-        }
-#endif
-;
-u4byte s_key[4];
-
 /* finite field arithmetic for GF(2**8) with the modular    */
 /* polynomial x^8 + x^6 + x^5 + x^3 + 1 (0x169)             */
 
 #define G_M 0x0169
 
+/* The q permutations and the MDS multiplication do not depend on the key,  */
+/* so their tables are generated once and compiled in from twofish_tab.h.   */
+/* To regenerate it:                                                        */
+/*                                                                          */
+/*   cc -DTWOFISH_MAKE_TAB twofish.c -o mktab && ./mktab > twofish_tab.h    */
+
+#ifndef TWOFISH_MAKE_TAB
+
+#include "twofish_tab.h"
+
+#else
+
+#include <stdio.h>
+
 u1byte tab_5b[4] = {0, G_M >> 2, G_M >> 1, (G_M >> 1) ^ (G_M >> 2)};
 u1byte tab_ef[4] = {0, (G_M >> 1) ^ (G_M >> 2), G_M >> 1, G_M >> 2};
 
@@ -132,44 +114,29 @@ u1byte qp(const u4byte n, const u1byte x) {
     return (b4 << 4) | a4;
 };
 
-#ifdef  Q_TABLES
-
-u4byte qt_gen = 0;
 u1byte q_tab[2][256];
-
-#define q(n, x)  q_tab[n][x]
+u4byte m_tab[4][256];
 
 void gen_qtab(void) {
     u4byte i;
 
     for (i = 0; i < 256; ++i) {
-        q(0, i) = qp(0, (u1byte) i);
-        q(1, i) = qp(1, (u1byte) i);
+        q_tab[0][i] = qp(0, (u1byte) i);
+        q_tab[1][i] = qp(1, (u1byte) i);
     }
 };
 
-#else
-
-#define q(n,x)  qp(n, x)
-
-#endif
-
-#ifdef  M_TABLE
-
-u4byte mt_gen = 0;
-u4byte m_tab[4][256];
-
 void gen_mtab(void) {
     u4byte i, f01, f5b, fef;
 
     for (i = 0; i < 256; ++i) {
-        f01 = q(1, i);
+        f01 = q_tab[1][i];
         f5b = ffm_5b(f01);
         fef = ffm_ef(f01);
         m_tab[0][i] = f01 + (f5b << 8) + (fef << 16) + (fef << 24);
         m_tab[2][i] = f5b + (fef << 8) + (f01 << 16) + (fef << 24);
 
-        f01 = q(0, i);
+        f01 = q_tab[0][i];
         f5b = ffm_5b(f01);
         fef = ffm_ef(f01);
         m_tab[1][i] = fef + (fef << 8) + (f5b << 16) + (f01 << 24);
@@ -177,50 +144,13 @@ void gen_mtab(void) {
     }
 };
 
-#define mds(n, x)    m_tab[n][x]
-
-#else
-
-#define fm_00   ffm_01
-#define fm_10   ffm_5b
-#define fm_20   ffm_ef
-#define fm_30   ffm_ef
-#define q_0(x)  q(1,x)
-
-#define fm_01   ffm_ef
-#define fm_11   ffm_ef
-#define fm_21   ffm_5b
-#define fm_31   ffm_01
-#define q_1(x)  q(0,x)
-
-#define fm_02   ffm_5b
-#define fm_12   ffm_ef
-#define fm_22   ffm_01
-#define fm_32   ffm_ef
-#define q_2(x)  q(1,x)
-
-#define fm_03   ffm_5b
-#define fm_13   ffm_01
-#define fm_23   ffm_ef
-#define fm_33   ffm_5b
-#define q_3(x)  q(0,x)
-
-#define f_0(n,x)    ((u4byte)fm_0##n(x))
-#define f_1(n,x)    ((u4byte)fm_1##n(x) << 8)
-#define f_2(n,x)    ((u4byte)fm_2##n(x) << 16)
-#define f_3(n,x)    ((u4byte)fm_3##n(x) << 24)
-
-#define mds(n,x)    f_0(n,q_##n(x)) ^ f_1(n,q_##n(x)) ^ f_2(n,q_##n(x)) ^ f_3(n,q_##n(x))
-
 #endif
 
-u4byte h_fun(const u4byte x, const u4byte key[]) {
-    u4byte b0, b1, b2, b3;
+#define q(n, x)     q_tab[n][x]
+#define mds(n, x)   m_tab[n][x]
 
-#ifndef M_TABLE
-    u4byte  m5b_b0, m5b_b1, m5b_b2, m5b_b3;
-    u4byte  mef_b0, mef_b1, mef_b2, mef_b3;
-#endif
+static u4byte h_fun(const u4byte x, const u4byte key[], const u4byte k_len) {
+    u4byte b0, b1, b2, b3;
 
     b0 = byte(x, 0);
     b1 = byte(x, 1);
@@ -246,31 +176,10 @@ u4byte h_fun(const u4byte x, const u4byte key[]) {
             b2 = q(1, q(0, b2) ^ byte(key[1], 2)) ^ byte(key[0], 2);
             b3 = q(1, q(1, b3) ^ byte(key[1], 3)) ^ byte(key[0], 3);
     }
-#ifdef  M_TABLE
 
     return mds(0, b0) ^ mds(1, b1) ^ mds(2, b2) ^ mds(3, b3);
-
-#else
-
-    b0 = q(1, b0); b1 = q(0, b1); b2 = q(1, b2); b3 = q(0, b3);
-    m5b_b0 = ffm_5b(b0); m5b_b1 = ffm_5b(b1); m5b_b2 = ffm_5b(b2); m5b_b3 = ffm_5b(b3);
-    mef_b0 = ffm_ef(b0); mef_b1 = ffm_ef(b1); mef_b2 = ffm_ef(b2); mef_b3 = ffm_ef(b3);
-    b0 ^= mef_b1 ^ m5b_b2 ^ m5b_b3; b3 ^= m5b_b0 ^ mef_b1 ^ mef_b2;
-    b2 ^= mef_b0 ^ m5b_b1 ^ mef_b3; b1 ^= mef_b0 ^ mef_b2 ^ m5b_b3;
-
-    return b0 | (b3 << 8) | (b2 << 16) | (b1 << 24);
-
-#endif
 };
 
-#ifdef  MK_TABLE
-
-#ifdef  ONE_STEP
-u4byte mk_tab[4][256];
-#else
-u1byte  sb[4][256];
-#endif
-
 #define q20(x)  q(0,q(0,x) ^ byte(key[1],0)) ^ byte(key[0],0)
 #define q21(x)  q(0,q(1,x) ^ byte(key[1],1)) ^ byte(key[0],1)
 #define q22(x)  q(1,q(0,x) ^ byte(key[1],2)) ^ byte(key[0],2)
@@ -286,77 +195,48 @@ u1byte  sb[4][256];
 #define q42(x)  q(1,q(0,q(0, q(0, x) ^ byte(key[3],2)) ^ byte(key[2],2)) ^ byte(key[1],2)) ^ byte(key[0],2)
 #define q43(x)  q(1,q(1,q(0, q(1, x) ^ byte(key[3],3)) ^ byte(key[2],3)) ^ byte(key[1],3)) ^ byte(key[0],3)
 
-void
-gen_mk_tab(u4byte key[]) {
+/* the key dependent S-boxes with the MDS matrix folded in, one step per byte */
+
+static void gen_mk_tab(tf_ctx_t *ctx, const u4byte key[], const u4byte k_len) {
     u4byte i;
     u1byte by;
 
-
     switch (k_len) {
         case 2:
             for (i = 0; i < 256; ++i) {
                 by = (u1byte) i;
-#ifdef ONE_STEP
-                mk_tab[0][i] = mds(0, q20(by));
-                mk_tab[1][i] = mds(1, q21(by));
-                mk_tab[2][i] = mds(2, q22(by));
-                mk_tab[3][i] = mds(3, q23(by));
-#else
-                sb[0][i] = q20(by); sb[1][i] = q21(by);
-                sb[2][i] = q22(by); sb[3][i] = q23(by);
-#endif
+                ctx->mk_tab[0][i] = mds(0, q20(by));
+                ctx->mk_tab[1][i] = mds(1, q21(by));
+                ctx->mk_tab[2][i] = mds(2, q22(by));
+                ctx->mk_tab[3][i] = mds(3, q23(by));
             }
             break;
 
         case 3:
             for (i = 0; i < 256; ++i) {
                 by = (u1byte) i;
-#ifdef ONE_STEP
-                mk_tab[0][i] = mds(0, q30(by));
-                mk_tab[1][i] = mds(1, q31(by));
-                mk_tab[2][i] = mds(2, q32(by));
-                mk_tab[3][i] = mds(3, q33(by));
-#else
-                sb[0][i] = q30(by); sb[1][i] = q31(by);
-                sb[2][i] = q32(by); sb[3][i] = q33(by);
-#endif
+                ctx->mk_tab[0][i] = mds(0, q30(by));
+                ctx->mk_tab[1][i] = mds(1, q31(by));
+                ctx->mk_tab[2][i] = mds(2, q32(by));
+                ctx->mk_tab[3][i] = mds(3, q33(by));
             }
             break;
 
         case 4:
             for (i = 0; i < 256; ++i) {
                 by = (u1byte) i;
-#ifdef ONE_STEP
-                mk_tab[0][i] = mds(0, q40(by));
-                mk_tab[1][i] = mds(1, q41(by));
-                mk_tab[2][i] = mds(2, q42(by));
-                mk_tab[3][i] = mds(3, q43(by));
-#else
-                sb[0][i] = q40(by); sb[1][i] = q41(by);
-                sb[2][i] = q42(by); sb[3][i] = q43(by);
-#endif
+                ctx->mk_tab[0][i] = mds(0, q40(by));
+                ctx->mk_tab[1][i] = mds(1, q41(by));
+                ctx->mk_tab[2][i] = mds(2, q42(by));
+                ctx->mk_tab[3][i] = mds(3, q43(by));
             }
     }
 };
 
-#  ifdef ONE_STEP
-#    define g0_fun(x) ( mk_tab[0][byte(x,0)] ^ mk_tab[1][byte(x,1)] \
-                      ^ mk_tab[2][byte(x,2)] ^ mk_tab[3][byte(x,3)] )
-#    define g1_fun(x) ( mk_tab[0][byte(x,3)] ^ mk_tab[1][byte(x,0)] \
-                      ^ mk_tab[2][byte(x,1)] ^ mk_tab[3][byte(x,2)] )
-#  else
-#    define g0_fun(x) ( mds(0, sb[0][byte(x,0)]) ^ mds(1, sb[1][byte(x,1)]) \
-                      ^ mds(2, sb[2][byte(x,2)]) ^ mds(3, sb[3][byte(x,3)]) )
-#    define g1_fun(x) ( mds(0, sb[0][byte(x,3)]) ^ mds(1, sb[1][byte(x,0)]) \
-                      ^ mds(2, sb[2][byte(x,1)]) ^ mds(3, sb[3][byte(x,2)]) )
-#  endif
-
-#else
-
-#define g0_fun(x)   h_fun(x,s_key)
-#define g1_fun(x)   h_fun(rotl(x,8),s_key)
-
-#endif
+#define g0_fun(x) ( mk_tab[0][byte(x,0)] ^ mk_tab[1][byte(x,1)] \
+                  ^ mk_tab[2][byte(x,2)] ^ mk_tab[3][byte(x,3)] )
+#define g1_fun(x) ( mk_tab[0][byte(x,3)] ^ mk_tab[1][byte(x,0)] \
+                  ^ mk_tab[2][byte(x,1)] ^ mk_tab[3][byte(x,2)] )
 
 /* The (12,8) Reed Soloman code has the generator polynomial
 
@@ -408,50 +288,30 @@ u4byte mds_rem(u4byte p0, u4byte p1) {
 
 /* initialise the key schedule from the user supplied key   */
 
-u4byte *tf_init(const u4byte in_key[], const u4byte key_len) {
-    u4byte i, a, b;
-
-#ifdef Q_TABLES
-    if (!qt_gen) {
-        gen_qtab();
-        qt_gen = 1;
-    }
-#endif
-
-#ifdef M_TABLE
-    if (!mt_gen) {
-        gen_mtab();
-        mt_gen = 1;
-    }
-#endif
+void tf_set_key(const u4byte in_key[], const u4byte key_len, tf_ctx_t *ctx) {
+    u4byte i, a, b, k_len, me_key[4], mo_key[4], s_key[4];
 
     k_len = key_len / 64;   /* 2, 3 or 4 */
 
     for (i = 0; i < k_len; ++i) {
         a = in_key[i + i];
+        me_key[i] = a;
         b = in_key[i + i + 1];
+        mo_key[i] = b;
         s_key[k_len - i - 1] = mds_rem(a, b);
     }
-    //printf("s_key: %08x %08x %08x %08x\n", s_key[0], s_key[1], s_key[2], s_key[3]);
-
-#if 0
-    printf("l_key:\n");
-    for(i = 0; i < 40; i += 2)
-    {
-        a = 0x01010101 * i; b = a + 0x01010101;
-        a = h_fun(a, me_key);
-        b = rotl(h_fun(b, mo_key), 8);
-        l_key[i] = a + b;
-        l_key[i + 1] = rotl(a + 2 * b, 9);
-    printf("%08x %08x\n", l_key[i], l_key[i+1]);
-    }
-#endif
 
-#ifdef MK_TABLE
-    gen_mk_tab(s_key);
-#endif
+    for (i = 0; i < 40; i += 2) {
+        a = 0x01010101 * i;
+        b = a + 0x01010101;
+        a = h_fun(a, me_key, k_len);
+        b = h_fun(b, mo_key, k_len);
+        b = rotl(b, 8);
+        ctx->l_key[i] = a + b;
+        ctx->l_key[i + 1] = rotl(a + 2 * b, 9);
+    }
 
-    return l_key;
+    gen_mk_tab(ctx, s_key, k_len);
 };
 
 /* encrypt a block of text  */
@@ -464,7 +324,9 @@ u4byte *tf_init(const u4byte in_key[], const u4byte key_len) {
     blk[0] = rotr(blk[0] ^ (t0 + t1 + l_key[4 * (i) + 10]), 1);     \
     blk[1] = rotl(blk[1], 1) ^ (t0 + 2 * t1 + l_key[4 * (i) + 11])
 
-void tf_encrypt(const u4byte in_blk[4], u4byte out_blk[]) {
+static inline void encrypt_blk(const tf_ctx_t *ctx, const u4byte in_blk[4], u4byte out_blk[4]) {
+    const u4byte (*mk_tab)[256] = ctx->mk_tab;
+    const u4byte *l_key = ctx->l_key;
     u4byte t0, t1, blk[4];
 
     blk[0] = in_blk[0] ^ l_key[0];
@@ -497,7 +359,9 @@ void tf_encrypt(const u4byte in_blk[4], u4byte out_blk[]) {
         blk[0] = rotl(blk[0], 1) ^ (t0 + t1 + l_key[4 * (i) +  8]);     \
         blk[1] = rotr(blk[1] ^ (t0 + 2 * t1 + l_key[4 * (i) +  9]), 1)
 
-void tf_decrypt(const u4byte in_blk[4], u4byte out_blk[4]) {
+static inline void decrypt_blk(const tf_ctx_t *ctx, const u4byte in_blk[4], u4byte out_blk[4]) {
+    const u4byte (*mk_tab)[256] = ctx->mk_tab;
+    const u4byte *l_key = ctx->l_key;
     u4byte t0, t1, blk[4];
 
     blk[0] = in_blk[0] ^ l_key[4];
@@ -518,4 +382,91 @@ void tf_decrypt(const u4byte in_blk[4], u4byte out_blk[4]) {
     out_blk[1] = blk[3] ^ l_key[1];
     out_blk[2] = blk[0] ^ l_key[2];
     out_blk[3] = blk[1] ^ l_key[3];
-}
\ No newline at end of file
+}
+
+void tf_encrypt_ctx(const tf_ctx_t *ctx, const u4byte in_blk[4], u4byte out_blk[4]) {
+    encrypt_blk(ctx, in_blk, out_blk);
+}
+
+void tf_decrypt_ctx(const tf_ctx_t *ctx, const u4byte in_blk[4], u4byte out_blk[4]) {
+    decrypt_blk(ctx, in_blk, out_blk);
+}
+
+/* whole buffers, the block code is inlined so the tables stay in registers */
+
+void tf_encrypt_blocks(const tf_ctx_t *ctx, void *buf, size_t len) {
+    u1byte *p = buf;
+    u4byte blk[4];
+
+    for (; len >= 16; len -= 16, p += 16) {
+        memcpy(blk, p, 16);
+        encrypt_blk(ctx, blk, blk);
+        memcpy(p, blk, 16);
+    }
+}
+
+void tf_decrypt_blocks(const tf_ctx_t *ctx, void *buf, size_t len) {
+    u1byte *p = buf;
+    u4byte blk[4];
+
+    for (; len >= 16; len -= 16, p += 16) {
+        memcpy(blk, p, 16);
+        decrypt_blk(ctx, blk, blk);
+        memcpy(p, blk, 16);
+    }
+}
+
+/* the original single key interface */
+
+static tf_ctx_t tf_global;
+
+u4byte *tf_init(const u4byte in_key[], const u4byte key_len) {
+    tf_set_key(in_key, key_len, &tf_global);
+    return tf_global.l_key;
+};
+
+void tf_encrypt(const u4byte in_blk[4], u4byte out_blk[]) {
+    encrypt_blk(&tf_global, in_blk, out_blk);
+}
+
+void tf_decrypt(const u4byte in_blk[4], u4byte out_blk[4]) {
+    decrypt_blk(&tf_global, in_blk, out_blk);
+}
+
+#ifdef TWOFISH_MAKE_TAB
+
+static void print_tab(const char *decl, const u4byte *tab, int rows, int cols, int per_line, const char *fmt) {
+    int r, c;
+
+    printf("static const %s = {\n", decl);
+    for (r = 0; r < rows; r++) {
+        printf("        {");
+        for (c = 0; c < cols; c++) {
+            if (c % per_line == 0 && c != 0)
+                printf("\n         ");
+            printf(fmt, tab[r * cols + c]);
+            if (c != cols - 1)
+                printf(c % per_line == per_line - 1 ? "," : ", ");
+        }
+        printf(r != rows - 1 ? "},\n" : "}\n");
+    }
+    printf("};\n");
+}
+
+int main(void) {
+    u4byte q[2 * 256];
+    int i;
+
+    gen_qtab();
+    gen_mtab();
+    for (i = 0; i < 2 * 256; i++)
+        q[i] = q_tab[i / 256][i % 256];
+
+    printf("/* twofish_tab.h - generated by twofish.c with TWOFISH_MAKE_TAB, do not edit */\n\n");
+    print_tab("u1byte q_tab[2][256]", q, 2, 256, 16, "0x%02x");
+    printf("\n");
+    print_tab("u4byte m_tab[4][256]", &m_tab[0][0], 4, 256, 6, "0x%08x");
+    return 0;
+}
+
+#endif
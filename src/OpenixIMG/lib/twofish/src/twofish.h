@@ -1,8 +1,33 @@
 #ifndef TWOFISH_H
 #define TWOFISH_H
 
-typedef unsigned long u4byte; /* a 32 bit unsigned integer type   */
+#include <stddef.h>
+#include <stdint.h>
 
+typedef uint32_t u4byte; /* a 32 bit unsigned integer type   */
+
+/*
+ * Everything a key needs for encryption and decryption: the round keys and
+ * the key dependent S-boxes already combined with the MDS matrix. Set it up
+ * once per key with tf_set_key(), the block functions only read it.
+ */
+typedef struct tf_ctx_st {
+    u4byte l_key[40];
+    u4byte mk_tab[4][256];
+} tf_ctx_t;
+
+void tf_set_key(const u4byte in_key[], u4byte key_len, tf_ctx_t *ctx);
+
+void tf_encrypt_ctx(const tf_ctx_t *ctx, const u4byte in_blk[4], u4byte out_blk[4]);
+
+void tf_decrypt_ctx(const tf_ctx_t *ctx, const u4byte in_blk[4], u4byte out_blk[4]);
+
+/* En-/decrypt len / 16 blocks in place, buf needs no alignment */
+void tf_encrypt_blocks(const tf_ctx_t *ctx, void *buf, size_t len);
+
+void tf_decrypt_blocks(const tf_ctx_t *ctx, void *buf, size_t len);
+
+/* The original interface, working on a single global key */
 void tf_encrypt(const u4byte in_blk[4], u4byte out_blk[]);
 
 void tf_decrypt(const u4byte in_blk[4], u4byte out_blk[4]);
@@ -0,0 +1,169 @@
+/*
+ * BufferPool.c Shared buffers for the unpack and image generation paths
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "BufferPool.h"
+
+/*
+ * Buffers are kept on one list and reused by size class. The list stays
+ * short (a handful of pipeline buffers), so a linear search is fine.
+ */
+struct pool_buffer {
+    void *data;
+    size_t size;
+    int in_use;
+    struct pool_buffer *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_buffer *pool_buffers;
+static size_t pool_budget = BUFFER_POOL_DEFAULT_BUDGET;
+static size_t pool_allocated;
+
+/* The smallest size class holding size bytes */
+static size_t size_class(size_t size) {
+    size_t c = BUFFER_POOL_ALIGN;
+
+    while (c < size)
+        c <<= 1;
+    return c;
+}
+
+/* The largest size class up to size bytes, BUFFER_POOL_ALIGN for less than that */
+static size_t size_class_below(size_t size) {
+    size_t c = BUFFER_POOL_ALIGN;
+
+    while (c <= size / 2)
+        c <<= 1;
+    return c;
+}
+
+/* Free unused buffers until another need bytes fit into the budget */
+static int pool_make_room(size_t need) {
+    struct pool_buffer **p = &pool_buffers;
+
+    while (pool_allocated + need > pool_budget && *p != NULL) {
+        struct pool_buffer *b = *p;
+
+        if (b->in_use) {
+            p = &b->next;
+            continue;
+        }
+        *p = b->next;
+        pool_allocated -= b->size;
+        free(b->data);
+        free(b);
+    }
+    return pool_allocated + need <= pool_budget;
+}
+
+static struct pool_buffer *pool_find_free(size_t size) {
+    struct pool_buffer *b, *best = NULL;
+
+    for (b = pool_buffers; b != NULL; b = b->next) {
+        if (b->in_use || b->size < size)
+            continue;
+        if (best == NULL || b->size < best->size)
+            best = b;
+    }
+    return best;
+}
+
+void buffer_pool_set_budget(size_t budget) {
+    pthread_mutex_lock(&pool_lock);
+    pool_budget = budget ? budget : BUFFER_POOL_DEFAULT_BUDGET;
+    pool_make_room(0);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+size_t buffer_pool_budget(void) {
+    size_t budget;
+
+    pthread_mutex_lock(&pool_lock);
+    budget = pool_budget;
+    pthread_mutex_unlock(&pool_lock);
+    return budget;
+}
+
+void *buffer_pool_get(size_t *size, size_t min_size) {
+    size_t want = size_class_below(*size), min = size_class(min_size), c;
+    struct pool_buffer *b = NULL;
+
+    if (want < min)
+        want = min;
+
+    pthread_mutex_lock(&pool_lock);
+    for (c = want; c >= min; c >>= 1) {
+        b = pool_find_free(c);
+        if (b != NULL)
+            break;
+        if (!pool_make_room(c))
+            continue;
+        b = calloc(1, sizeof(*b));
+        if (b == NULL)
+            break;
+        if (posix_memalign(&b->data, BUFFER_POOL_ALIGN, c) != 0) {
+            free(b);
+            b = NULL;
+            break;
+        }
+        b->size = c;
+        b->next = pool_buffers;
+        pool_buffers = b;
+        pool_allocated += c;
+        break;
+    }
+    if (b != NULL) {
+        b->in_use = 1;
+        *size = c;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return b != NULL ? b->data : NULL;
+}
+
+void buffer_pool_put(void *buf) {
+    struct pool_buffer *b;
+
+    if (buf == NULL)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    for (b = pool_buffers; b != NULL; b = b->next) {
+        if (b->data == buf) {
+            b->in_use = 0;
+            break;
+        }
+    }
+    /* the budget may have been lowered while the buffer was in use */
+    pool_make_room(0);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void buffer_pool_trim(void) {
+    struct pool_buffer **p = &pool_buffers;
+
+    pthread_mutex_lock(&pool_lock);
+    while (*p != NULL) {
+        struct pool_buffer *b = *p;
+
+        if (b->in_use) {
+            p = &b->next;
+            continue;
+        }
+        *p = b->next;
+        pool_allocated -= b->size;
+        free(b->data);
+        free(b);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
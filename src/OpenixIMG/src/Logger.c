@@ -0,0 +1,335 @@
+/*
+ * Logger.c One log for OpenixCard, OpenixIMG and genimage
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Logger.h"
+
+struct log_line {
+    int level;
+    char source[16];    /* empty for data */
+    double time;
+    char msg[LOG_LINE_MAX];
+};
+
+static const char *log_names[] = {"ERROR", "WARNING", "INFO", "DEBUG", "TRACE"};
+static const char *log_json_names[] = {"error", "warning", "info", "debug", "trace"};
+static const char *log_colors[] = {"\033[31m", "\033[33m", "\033[36m", "\033[37m", "\033[37m"};
+#define LOG_COLOR_DATA  "\033[32m"
+#define LOG_COLOR_RESET "\033[0m"
+
+/* genimage's 0 error, 1 info, 2 debug and 3 vdebug */
+static const int log_genimage_levels[] = {LOG_LEVEL_ERROR, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG, LOG_LEVEL_TRACE};
+
+static int log_max_level = LOG_LEVEL_INFO;
+static enum log_format log_out_format = LOG_FORMAT_TEXT;
+static int log_color = -1;
+static log_handler log_out_handler;
+static void *log_out_arg;
+
+/*
+ * Callers add lines at head, the writer prints from tail and only then
+ * moves tail on, so tail == head means everything is out. One condition
+ * serves both sides, it is always broadcast.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static struct log_line log_ring[LOG_RING_SLOTS];
+static uint64_t log_head, log_tail;
+static unsigned long log_dropped;
+static int log_async, log_stopping;
+static pthread_t log_thread;
+
+static int level_index(int level) {
+    if (level < LOG_LEVEL_ERROR)
+        return LOG_LEVEL_ERROR;
+    return level > LOG_LEVEL_TRACE ? LOG_LEVEL_TRACE : level;
+}
+
+static void json_string(FILE *fp, const char *str) {
+    const unsigned char *p;
+
+    fputc('"', fp);
+    for (p = (const unsigned char *) str; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(fp, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(fp, "\\u%04x", *p);
+        else
+            fputc(*p, fp);
+    }
+    fputc('"', fp);
+}
+
+static void log_print_stdout(int level, const char *source, double time, const char *msg) {
+    int i = level_index(level);
+
+    if (log_out_format == LOG_FORMAT_JSON) {
+        fprintf(stdout, "{\"time\": %.3f, \"level\": \"%s\"", time, log_json_names[i]);
+        if (source != NULL) {
+            fprintf(stdout, ", \"source\": ");
+            json_string(stdout, source);
+        }
+        fprintf(stdout, ", \"msg\": ");
+        json_string(stdout, msg);
+        fprintf(stdout, "}\n");
+        return;
+    }
+
+    if (log_color < 0)
+        log_color = isatty(STDOUT_FILENO);
+    if (source == NULL)
+        fprintf(stdout, "%s%s%s\n", log_color ? LOG_COLOR_DATA : "", msg,
+                log_color ? LOG_COLOR_RESET : "");
+    else
+        fprintf(stdout, "%s[%s %s] %s%s\n", log_color ? log_colors[i] : "", source, log_names[i],
+                msg, log_color ? LOG_COLOR_RESET : "");
+}
+
+/* msg is line->msg, or the whole of a line too long for it */
+static void log_print(const struct log_line *line, const char *msg) {
+    const char *source = line->source[0] ? line->source : NULL;
+
+    if (log_out_handler != NULL) {
+        log_out_handler(line->level, source, msg, log_out_arg);
+        return;
+    }
+    log_print_stdout(line->level, source, line->time, msg);
+}
+
+static double log_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void *log_writer(void *arg) {
+    unsigned long dropped;
+    uint64_t head, i;
+    (void) arg;
+
+    pthread_mutex_lock(&log_lock);
+    for (;;) {
+        while (log_tail == log_head && !log_dropped && !log_stopping)
+            pthread_cond_wait(&log_cond, &log_lock);
+        if (log_tail == log_head && !log_dropped)
+            break;
+        head = log_head;
+        dropped = log_dropped;
+        log_dropped = 0;
+        pthread_mutex_unlock(&log_lock);
+
+        /* the lines up to head are not touched by the callers until tail moves */
+        for (i = log_tail; i < head; i++)
+            log_print(&log_ring[i % LOG_RING_SLOTS], log_ring[i % LOG_RING_SLOTS].msg);
+        if (dropped) {
+            struct log_line line = {.level = LOG_LEVEL_WARNING, .source = "Log", .time = log_now()};
+
+            snprintf(line.msg, sizeof(line.msg), "%lu messages dropped, the output could not keep up", dropped);
+            log_print(&line, line.msg);
+        }
+        fflush(stdout);
+
+        pthread_mutex_lock(&log_lock);
+        log_tail = head;
+        pthread_cond_broadcast(&log_cond);
+    }
+    /* whoever comes after this writes by itself */
+    log_async = 0;
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+/* A child writes by itself, what the parent queued before has to come first */
+static void log_atfork_prepare(void) {
+    log_flush();
+}
+
+/* Only the forking thread lives on in the child, there is no writer to wait for */
+static void log_atfork_child(void) {
+    pthread_mutex_init(&log_lock, NULL);
+    pthread_cond_init(&log_cond, NULL);
+    log_async = 0;
+    log_stopping = 0;
+    log_head = log_tail = 0;
+}
+
+void log_set_level(int level) {
+    log_max_level = level;
+}
+
+int log_enabled(int level) {
+    return level <= log_max_level;
+}
+
+void log_set_format(enum log_format format) {
+    log_out_format = format;
+}
+
+void log_set_handler(log_handler handler, void *arg) {
+    log_flush();
+    pthread_mutex_lock(&log_lock);
+    log_out_handler = handler;
+    log_out_arg = arg;
+    pthread_mutex_unlock(&log_lock);
+}
+
+void log_print_default(int level, const char *source, const char *msg) {
+    log_print_stdout(level, source, log_now(), msg);
+}
+
+void log_start(void) {
+    static int registered;
+
+    pthread_mutex_lock(&log_lock);
+    if (log_async) {
+        pthread_mutex_unlock(&log_lock);
+        return;
+    }
+    log_async = 1;
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0)
+        log_async = 0;
+    pthread_mutex_unlock(&log_lock);
+
+    if (!registered) {
+        registered = 1;
+        pthread_atfork(log_atfork_prepare, NULL, log_atfork_child);
+        atexit(log_stop);
+    }
+}
+
+void log_stop(void) {
+    pthread_mutex_lock(&log_lock);
+    if (!log_async || log_stopping) {
+        pthread_mutex_unlock(&log_lock);
+        return;
+    }
+    log_stopping = 1;
+    pthread_cond_broadcast(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+
+    pthread_join(log_thread, NULL);
+    pthread_mutex_lock(&log_lock);
+    log_stopping = 0;
+    pthread_mutex_unlock(&log_lock);
+    fflush(stdout);
+}
+
+void log_flush(void) {
+    pthread_mutex_lock(&log_lock);
+    while (log_async && (log_tail != log_head || log_dropped))
+        pthread_cond_wait(&log_cond, &log_lock);
+    pthread_mutex_unlock(&log_lock);
+    fflush(stdout);
+}
+
+static void log_put(const struct log_line *line) {
+    pthread_mutex_lock(&log_lock);
+    if (!log_async) {
+        /* under the lock, so lines of several threads do not mix */
+        log_print(line, line->msg);
+        if (line->level <= LOG_LEVEL_WARNING)
+            fflush(stdout);
+        pthread_mutex_unlock(&log_lock);
+        return;
+    }
+    while (log_head - log_tail == LOG_RING_SLOTS) {
+        if (line->level > LOG_LEVEL_INFO) {
+            log_dropped++;
+            pthread_mutex_unlock(&log_lock);
+            return;
+        }
+        pthread_cond_wait(&log_cond, &log_lock);
+        if (!log_async) {
+            log_print(line, line->msg);
+            pthread_mutex_unlock(&log_lock);
+            return;
+        }
+    }
+    log_ring[log_head++ % LOG_RING_SLOTS] = *line;
+    pthread_cond_broadcast(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * A line too long for the ring is printed by the caller, once the queued
+ * lines are out. It holds the lock meanwhile, so the writer and the other
+ * callers wait for it.
+ */
+static void log_put_long(const struct log_line *line, const char *msg) {
+    pthread_mutex_lock(&log_lock);
+    while (log_async && (log_tail != log_head || log_dropped))
+        pthread_cond_wait(&log_cond, &log_lock);
+    log_print(line, msg);
+    fflush(stdout);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void strip_newline(char *msg) {
+    size_t len = strlen(msg);
+
+    if (len && msg[len - 1] == '\n')
+        msg[len - 1] = '\0';
+}
+
+void log_vwrite(int level, const char *source, const char *fmt, va_list args) {
+    struct log_line line;
+    va_list again;
+    char *msg;
+    int len;
+
+    if (!log_enabled(level))
+        return;
+
+    line.level = level;
+    snprintf(line.source, sizeof(line.source), "%s", source ? source : "");
+    line.time = log_now();
+    va_copy(again, args);
+    len = vsnprintf(line.msg, sizeof(line.msg), fmt, args);
+    if (len >= (int) sizeof(line.msg)) {
+        msg = malloc((size_t) len + 1);
+        if (msg != NULL) {
+            vsnprintf(msg, (size_t) len + 1, fmt, again);
+            va_end(again);
+            strip_newline(msg);
+            log_put_long(&line, msg);
+            free(msg);
+            return;
+        }
+        /* out of memory, at least show that something is missing */
+        strcpy(line.msg + sizeof(line.msg) - 4, "...");
+    }
+    va_end(again);
+    strip_newline(line.msg);
+    log_put(&line);
+}
+
+void log_write(int level, const char *source, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    log_vwrite(level, source, fmt, args);
+    va_end(args);
+}
+
+int log_genimage_enabled(int level) {
+    return log_enabled(log_genimage_levels[level < 0 ? 0 : level > 3 ? 3 : level]);
+}
+
+void log_genimage(int level, const char *msg) {
+    log_write(log_genimage_levels[level < 0 ? 0 : level > 3 ? 3 : level], "GenIMG", "%s", msg);
+}
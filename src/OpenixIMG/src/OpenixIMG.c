@@ -14,25 +14,52 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
 #include "OpenixIMG.h"
 #include "IMAGEWTY.h"
+#include "BufferPool.h"
+#include "Stats.h"
+#include "Progress.h"
+#include "Logger.h"
+#include "sha256.h"
 
 int flag_encryption_enabled;
 
-#define OpenixIMG_LOG(fmt, arg...) \
-    do {                           \
-        printf(fmt, ##arg);        \
-    } while (0)
+/* Unpack cache, see set_unpack_cache_dir() */
+static const char *unpack_cache_dir;
+
+/* Item manifest, see set_unpack_manifest() */
+static int unpack_manifest;
+static const char *unpack_verify_manifest;
+
+/* Twofish for non-fex items, see set_unpack_twofish() */
+static int unpack_twofish;
 
-#define O_LOG(fmt, arg...) OpenixIMG_LOG("[OpenixIMG INFO] " fmt, ##arg)
+/* Layout of written images, see set_pack_format() */
+static uint32_t pack_header_version = 0x0300;
+static int pack_encrypt = 1;
+
+#define UNPACK_MANIFEST_NAME    "image.manifest"
+#define UNPACK_MANIFEST_MAGIC   "# OpenixIMG manifest 1"
+
+#define O_LOG(fmt, arg...) log_write(LOG_LEVEL_INFO, "OpenixIMG", fmt, ##arg)
+#define O_ERR(fmt, arg...) log_write(LOG_LEVEL_ERROR, "OpenixIMG", fmt, ##arg)
 
 /* Crypto */
 rc6_ctx_t header_ctx;
 rc6_ctx_t fileheaders_ctx;
 rc6_ctx_t filecontent_ctx;
 u4byte tf_key[32];
+tf_ctx_t filecontent_tf_ctx;
 
 const char *progname;
 
@@ -82,6 +109,7 @@ void crypto_init(void) {
     tf_key[1] = 4;
     for (i = 2; i < 32; i++)
         tf_key[i] = tf_key[i - 2] + tf_key[i - 1];
+    tf_set_key(tf_key, 256, &filecontent_tf_ctx);
 }
 
 void *rc6_decrypt_inplace(void *p, size_t len, rc6_ctx_t *ctx) {
@@ -99,8 +127,14 @@ void *rc6_decrypt_inplace(void *p, size_t len, rc6_ctx_t *ctx) {
     return p;
 }
 
-FILE *dir_fopen(const char *dir, const char *path, const char *mode, int is_absolute) {
-    char outfn[512];
+void *tf_decrypt_inplace(void *p, size_t len, tf_ctx_t *ctx) {
+    if (flag_encryption_enabled)
+        tf_decrypt_blocks(ctx, p, len);
+
+    return p + len;
+}
+
+static void dir_path(char *outfn, const char *dir, const char *path, int is_absolute) {
     char *p;
     int len;
 
@@ -122,88 +156,922 @@ FILE *dir_fopen(const char *dir, const char *path, const char *mode, int is_abso
         recursive_mkdir(outfn);
         *p = '/';
     }
+}
+
+FILE *dir_fopen(const char *dir, const char *path, const char *mode, int is_absolute) {
+    char outfn[512];
+
+    dir_path(outfn, dir, path, is_absolute);
 
     return fopen(outfn, mode);
 }
 
-int unpack_image(const char *infn, const char *outdn, int is_absolute) {
-    uint32_t pid, vid, hardware_id, firmware_id;
-    FILE *ifp, *ofp, *cfp;
+void set_unpack_cache_dir(const char *dir) {
+    unpack_cache_dir = (dir != NULL && dir[0] != '\0') ? dir : NULL;
+}
+
+void set_unpack_manifest(int enable, const char *verify_manifest) {
+    unpack_verify_manifest = (verify_manifest != NULL && verify_manifest[0] != '\0') ? verify_manifest : NULL;
+    unpack_manifest = enable || unpack_verify_manifest != NULL;
+}
+
+void set_unpack_twofish(int enable) {
+    unpack_twofish = enable;
+}
+
+int set_pack_format(uint32_t header_version, int encrypt) {
+    if (header_version != 0x0100 && header_version != 0x0300)
+        return -1;
+    pack_header_version = header_version;
+    pack_encrypt = encrypt;
+    return 0;
+}
+
+/* Firmwares that use Twofish keep RC6 for the .fex partition items */
+static int item_uses_twofish(const char *filename) {
+    size_t len = strlen(filename);
+
+    return unpack_twofish && !(len >= 4 && strcmp(filename + len - 4, ".fex") == 0);
+}
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t offset) {
+    while (len) {
+        ssize_t r = pread(fd, buf, len, (off_t) offset);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        buf = (uint8_t *) buf + r;
+        len -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t offset) {
+    while (len) {
+        ssize_t w = pwrite(fd, buf, len, (off_t) offset);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        buf = (const uint8_t *) buf + w;
+        len -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    while (len) {
+        ssize_t w = write(fd, buf, len);
+
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        buf = (const uint8_t *) buf + w;
+        len -= w;
+    }
+    return 0;
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    int i;
+
+    for (i = 0; i < 8; i++)
+        p[i] = (uint8_t) (v >> (i * 8));
+}
+
+/*
+ * The cache key covers the item bytes exactly as stored in the image plus
+ * every header field that changes what ends up on disk. The offset and the
+ * filename are deliberately left out: an item that only moved because an
+ * earlier item grew is still the same plaintext.
+ */
+static int cache_key(const struct imagewty_file_header *filehdr, uint32_t header_version, int twofish,
+                     int fd, uint64_t offset, uint64_t stored_length, uint64_t original_length,
+                     void *buf, size_t buf_size, char hex[SHA256_HEX_LEN]) {
+    static const char tag[] = "OpenixIMG cache v1";
+    uint8_t meta[24], digest[SHA256_DIGEST_LEN];
+    sha256_ctx_t ctx;
+    uint64_t pos;
+
+    put_le64(meta, stored_length);
+    put_le64(meta + 8, original_length);
+    put_le64(meta + 16, ((uint64_t) header_version << 8) | (flag_encryption_enabled ? 1 : 0) | (twofish ? 2 : 0));
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, tag, sizeof(tag));
+    sha256_update(&ctx, filehdr->maintype, IMAGEWTY_FHDR_MAINTYPE_LEN);
+    sha256_update(&ctx, filehdr->subtype, IMAGEWTY_FHDR_SUBTYPE_LEN);
+    sha256_update(&ctx, meta, sizeof(meta));
+    for (pos = 0; pos < stored_length;) {
+        size_t len = stored_length - pos > buf_size ? buf_size : (size_t) (stored_length - pos);
+
+        if (pread_full(fd, buf, len, offset + pos) != 0)
+            return -1;
+        sha256_update(&ctx, buf, len);
+        pos += len;
+    }
+    sha256_final(&ctx, digest);
+    sha256_hex(digest, hex);
+    return 0;
+}
+
+static int clone_file(const char *src, const char *dst) {
+#ifdef FICLONE
+    int ifd, ofd, ret;
+
+    ifd = open(src, O_RDONLY);
+    if (ifd < 0)
+        return -1;
+    ofd = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (ofd < 0) {
+        O_ERR("Unable to create %s: %s\n", dst, strerror(errno));
+        close(ifd);
+        return -1;
+    }
+    ret = ioctl(ofd, FICLONE, ifd);
+    close(ifd);
+    close(ofd);
+    if (ret < 0)
+        unlink(dst);
+    return ret < 0 ? -1 : 0;
+#else
+    (void) src;
+    (void) dst;
+    return -1;
+#endif
+}
+
+static int copy_file(const char *src, const char *dst) {
+    char buf[65536];
+    FILE *ifp, *ofp;
+    size_t n;
+    int ret = 0;
+
+    ifp = fopen(src, "rb");
+    if (ifp == NULL)
+        return -1;
+    ofp = fopen(dst, "wb");
+    if (ofp == NULL) {
+        fclose(ifp);
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), ifp)) > 0) {
+        if (fwrite(buf, 1, n, ofp) != n) {
+            ret = -1;
+            break;
+        }
+    }
+    fclose(ifp);
+    if (fclose(ofp) != 0)
+        ret = -1;
+    if (ret)
+        unlink(dst);
+    return ret;
+}
+
+/*
+ * Place a cached plaintext at outfn: a reflink where the filesystem supports
+ * it, a plain copy otherwise. Never a hardlink, an output edited in place
+ * would change the cache entry behind its key.
+ */
+static int cache_restore(const char *cachefn, const char *outfn, uint64_t original_length) {
+    struct stat st;
+
+    if (stat(cachefn, &st) != 0 || (uint64_t) st.st_size != original_length)
+        return -1;
+
+    unlink(outfn);
+    if (clone_file(cachefn, outfn) == 0)
+        return 0;
+    return copy_file(cachefn, outfn);
+}
+
+static void cache_store(const char *outfn, const char *cachefn) {
+    char tmpfn[640];
+
+    snprintf(tmpfn, sizeof(tmpfn), "%s.%ld.tmp", cachefn, (long) getpid());
+    unlink(tmpfn);
+    if (clone_file(outfn, tmpfn) != 0 && copy_file(outfn, tmpfn) != 0)
+        return;
+    /* rename() keeps concurrent runs sharing one cache from seeing partial entries */
+    if (rename(tmpfn, cachefn) != 0)
+        unlink(tmpfn);
+}
+
+static int hash_file(const char *fn, void *buf, size_t buf_size, char hex[SHA256_HEX_LEN]) {
+    uint8_t digest[SHA256_DIGEST_LEN];
+    sha256_ctx_t ctx;
+    ssize_t r;
+    int fd;
+
+    fd = open(fn, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    sha256_init(&ctx);
+    while ((r = read(fd, buf, buf_size)) > 0)
+        sha256_update(&ctx, buf, r);
+    close(fd);
+    if (r < 0)
+        return -1;
+    sha256_final(&ctx, digest);
+    sha256_hex(digest, hex);
+    return 0;
+}
+
+/*
+ * The image header and the file header table, decrypted. Everything else
+ * is read from fd as needed.
+ */
+struct image_table {
+    int fd;
+    uint64_t size;
+    uint8_t *headers;
     struct imagewty_header *header;
-    void *image, *curr;
-    long imagesize;
     uint32_t num_files;
-    size_t i;
+};
 
-    ifp = fopen(infn, "rb");
-    if (ifp == NULL) {
-        return 2;
-    }
+struct image_item {
+    const char *filename;
+    uint64_t offset;
+    uint64_t stored_length;
+    uint64_t original_length;
+};
 
-    fseek(ifp, 0, SEEK_END);
-    imagesize = ftell(ifp);
-    fseek(ifp, 0, SEEK_SET);
+static const struct imagewty_file_header *image_file_header(const struct image_table *t, uint32_t i) {
+    return (const struct imagewty_file_header *) (t->headers + 1024 + (size_t) i * 1024);
+}
+
+static void image_item(const struct image_table *t, uint32_t i, struct image_item *item) {
+    const struct imagewty_file_header *filehdr = image_file_header(t, i);
 
-    if (imagesize <= 0) {
-        return 3;
+    if (t->header->header_version == 0x0300) {
+        item->filename = filehdr->v3.filename;
+        item->offset = (uint64_t) filehdr->v3.offset_hi << 32 | filehdr->v3.offset;
+        item->stored_length = (uint64_t) filehdr->v3.stored_length_hi << 32 | filehdr->v3.stored_length;
+        item->original_length = (uint64_t) filehdr->v3.original_length_hi << 32 | filehdr->v3.original_length;
+    } else {
+        item->filename = filehdr->v1.filename;
+        item->offset = filehdr->v1.offset;
+        item->stored_length = filehdr->v1.stored_length;
+        item->original_length = filehdr->v1.original_length;
     }
+}
+
+struct item_extent {
+    uint64_t start, end;
+    uint32_t index;
+};
+
+static int item_extent_cmp(const void *a, const void *b) {
+    const struct item_extent *x = a, *y = b;
+
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Check the item table against the real file size before any bulk I/O.
+ * Every problem is reported. Returns 3 if items reach past the end of the
+ * file, 5 if the table is inconsistent in any other way, 0 otherwise.
+ */
+static int image_validate(const struct image_table *t) {
+    uint64_t table_end = 1024 + (uint64_t) t->num_files * 1024;
+    struct item_extent *extents;
+    size_t count = 0;
+    int truncated = 0, corrupt = 0;
+    uint32_t i;
 
-    image = malloc(imagesize);
-    if (!image) {
+    extents = calloc(t->num_files ? t->num_files : 1, sizeof(*extents));
+    if (extents == NULL)
         return 4;
+
+    for (i = 0; i < t->num_files; i++) {
+        struct image_item item;
+
+        image_item(t, i, &item);
+        if (memchr(item.filename, '\0', IMAGEWTY_FHDR_FILENAME_LEN) == NULL || item.filename[0] == '\0') {
+            O_ERR("Item %u has no valid filename\n", i);
+            corrupt = 1;
+            continue;
+        }
+        if (strncmp(item.filename, "../", 3) == 0 || strstr(item.filename, "/../") != NULL) {
+            O_ERR("Item %u: %s points outside the output directory\n", i, item.filename);
+            corrupt = 1;
+        }
+        if (item.original_length > item.stored_length) {
+            O_ERR("Item %u: %s is larger (%llu) than its stored data (%llu)\n", i, item.filename,
+                  (unsigned long long) item.original_length, (unsigned long long) item.stored_length);
+            corrupt = 1;
+        }
+        if (item.stored_length == 0)
+            continue;
+        if (item.offset < table_end) {
+            O_ERR("Item %u: %s overlaps the header table\n", i, item.filename);
+            corrupt = 1;
+        }
+        if (item.offset > t->size || item.stored_length > t->size - item.offset) {
+            O_ERR("Item %u: %s ends at %llu, past the end of the image (%llu)\n", i, item.filename,
+                  (unsigned long long) (item.offset + item.stored_length), (unsigned long long) t->size);
+            truncated = 1;
+        }
+        extents[count].start = item.offset;
+        extents[count].end = item.offset + item.stored_length;
+        extents[count].index = i;
+        count++;
     }
 
-    fread(image, imagesize, 1, ifp);
-    fclose(ifp);
+    qsort(extents, count, sizeof(*extents), item_extent_cmp);
+    for (i = 1; i < count; i++) {
+        if (extents[i].start < extents[i - 1].end) {
+            O_ERR("Items %u and %u overlap\n", extents[i - 1].index, extents[i].index);
+            corrupt = 1;
+        }
+    }
+    free(extents);
+
+    return truncated ? 3 : corrupt ? 5 : 0;
+}
+
+static void image_close(struct image_table *t) {
+    free(t->headers);
+    t->headers = NULL;
+    if (t->fd >= 0)
+        close(t->fd);
+    t->fd = -1;
+}
+
+/*
+ * Read and decrypt only the image header and the file header table, then
+ * validate them. Returns 0 or one of the unpack_image() error codes.
+ */
+static int image_open(const char *infn, struct image_table *t) {
+    struct stat st;
+    uint8_t *p;
+    int ret;
+
+    memset(t, 0, sizeof(*t));
+    t->fd = open(infn, O_RDONLY);
+    if (t->fd < 0)
+        return 2;
+
+    if (fstat(t->fd, &st) != 0 || st.st_size < 1024) {
+        ret = 3;
+        goto err;
+    }
+    t->size = (uint64_t) st.st_size;
+
+    t->headers = malloc(1024);
+    if (t->headers == NULL) {
+        ret = 4;
+        goto err;
+    }
+    if (pread_full(t->fd, t->headers, 1024, 0) != 0) {
+        ret = 6;
+        goto err;
+    }
 
     /* Check for encryption; see bug #2 (A31 unencrypted images) */
-    header = (struct imagewty_header *) image;
-    if (memcmp(header->magic, IMAGEWTY_MAGIC, IMAGEWTY_MAGIC_LEN) == 0)
+    t->header = (struct imagewty_header *) t->headers;
+    flag_encryption_enabled = 1;
+    if (memcmp(t->header->magic, IMAGEWTY_MAGIC, IMAGEWTY_MAGIC_LEN) == 0)
         flag_encryption_enabled = 0;
 
     /* Decrypt header (padded to 1024 bytes) */
+    rc6_decrypt_inplace(t->headers, 1024, &header_ctx);
+
+    if (t->header->header_version == 0x0300) {
+        t->num_files = t->header->v3.num_files;
+    } else if (t->header->header_version == 0x0100) {
+        t->num_files = t->header->v1.num_files;
+    } else {
+        O_ERR("Unknown IMG version 0x%0x\n", t->header->header_version);
+        ret = 5;
+        goto err;
+    }
+
+    if (1024 + (uint64_t) t->num_files * 1024 > t->size) {
+        O_ERR("Image claims %u items, more than fit in %llu bytes\n", t->num_files,
+              (unsigned long long) t->size);
+        ret = 3;
+        goto err;
+    }
+
+    /* Decrypt file headers */
+    p = realloc(t->headers, 1024 + (size_t) t->num_files * 1024);
+    if (p == NULL) {
+        ret = 4;
+        goto err;
+    }
+    t->headers = p;
+    t->header = (struct imagewty_header *) p;
+    if (pread_full(t->fd, t->headers + 1024, (size_t) t->num_files * 1024, 1024) != 0) {
+        ret = 6;
+        goto err;
+    }
+    rc6_decrypt_inplace(t->headers + 1024, (size_t) t->num_files * 1024, &fileheaders_ctx);
+
+    ret = image_validate(t);
+    if (ret != 0)
+        goto err;
+    return 0;
+
+err:
+    image_close(t);
+    return ret;
+}
+
+int validate_image(const char *infn) {
+    struct image_table t;
+    int ret;
+
+    ret = image_open(infn, &t);
+    if (ret == 0) {
+        O_LOG("IMG version 0x%0x with %u items looks valid\n", t.header->header_version, t.num_files);
+        image_close(&t);
+    }
+    return ret;
+}
+
+int list_image(const char *infn, struct image_entry **entries, uint32_t *num_entries, uint32_t *header_version) {
+    struct image_table t;
+    struct image_entry *e;
+    uint32_t i;
+    int ret;
+
+    ret = image_open(infn, &t);
+    if (ret != 0)
+        return ret;
+
+    e = calloc(t.num_files ? t.num_files : 1, sizeof(*e));
+    if (e == NULL) {
+        image_close(&t);
+        return 4;
+    }
+    for (i = 0; i < t.num_files; i++) {
+        const struct imagewty_file_header *filehdr = image_file_header(&t, i);
+        struct image_item item;
+
+        image_item(&t, i, &item);
+        /* image_validate() made sure the filename is terminated */
+        strcpy(e[i].filename, item.filename);
+        memcpy(e[i].maintype, filehdr->maintype, IMAGEWTY_FHDR_MAINTYPE_LEN);
+        memcpy(e[i].subtype, filehdr->subtype, IMAGEWTY_FHDR_SUBTYPE_LEN);
+        e[i].offset = item.offset;
+        e[i].stored_length = item.stored_length;
+        e[i].original_length = item.original_length;
+        e[i].encrypted = flag_encryption_enabled;
+        e[i].twofish = flag_encryption_enabled && item_uses_twofish(item.filename);
+    }
+
+    *entries = e;
+    *num_entries = t.num_files;
+    *header_version = t.header->header_version;
+    image_close(&t);
+    return 0;
+}
+
+/*
+ * Unpacking is a three stage pipeline over a small ring of chunk buffers: a
+ * reader thread fills chunks from the image, the calling thread decrypts
+ * them and a writer thread writes them to their item's file. While one chunk
+ * is decrypted the next one is read and the previous one written, so the
+ * disks and the CPU work at the same time.
+ */
+#define UNPACK_CHUNK_SIZE       (4 * 1024 * 1024)
+#define UNPACK_CHUNK_MIN_SIZE   (64 * 1024)
+#define UNPACK_RING_SIZE        4
+
+struct unpack_item {
+    const struct imagewty_file_header *filehdr;
+    const char *filename;
+    char outfn[512];
+    char cachefn[512];
+    uint64_t offset;
+    uint64_t stored_length;
+    uint64_t original_length;
+    int cached;         /* restored from the unpack cache, not decrypted */
+    int twofish;        /* content is Twofish, not RC6 encrypted */
+    sha256_ctx_t hash;
+    char hex[SHA256_HEX_LEN];
+};
+
+enum unpack_chunk_state {
+    UNPACK_CHUNK_FREE,
+    UNPACK_CHUNK_READ,
+    UNPACK_CHUNK_DECRYPTED,
+};
+
+struct unpack_chunk {
+    enum unpack_chunk_state state;
+    uint64_t seq;
+    struct unpack_item *item;
+    uint64_t pos;       /* position of this chunk inside its item */
+    size_t len;
+    int last;           /* last chunk of its item */
+    int end;            /* nothing follows, the pipeline shuts down */
+    uint8_t *buf;
+    size_t buf_size;
+};
+
+struct unpack_pipeline {
+    int fd;
+    struct unpack_item *items;
+    size_t num_items;
+    struct unpack_chunk ring[UNPACK_RING_SIZE];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int error;
+};
+
+/* Wait until chunk seq is in the given state */
+static struct unpack_chunk *unpack_get(struct unpack_pipeline *pl, uint64_t seq,
+                                       enum unpack_chunk_state state) {
+    struct unpack_chunk *c = &pl->ring[seq % UNPACK_RING_SIZE];
+
+    pthread_mutex_lock(&pl->lock);
+    if (state == UNPACK_CHUNK_FREE) {
+        while (c->state != UNPACK_CHUNK_FREE)
+            pthread_cond_wait(&pl->cond, &pl->lock);
+    } else {
+        /* seq is only stable once the slot left the FREE state */
+        while (c->state != state || c->seq != seq)
+            pthread_cond_wait(&pl->cond, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return c;
+}
+
+static void unpack_put(struct unpack_pipeline *pl, struct unpack_chunk *c,
+                       enum unpack_chunk_state state) {
+    pthread_mutex_lock(&pl->lock);
+    c->state = state;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void *unpack_reader(void *arg) {
+    struct unpack_pipeline *pl = arg;
+    struct unpack_chunk *c;
+    uint64_t seq = 0, pos;
+    size_t i;
+    int err;
+
+    stats_thread_name("unpack reader");
+    for (i = 0; i < pl->num_items; i++) {
+        struct unpack_item *item = &pl->items[i];
+
+        if (item->cached)
+            continue;
+
+        /* an empty item still gets one chunk so its file is created */
+        pos = 0;
+        do {
+            c = unpack_get(pl, seq, UNPACK_CHUNK_FREE);
+            c->seq = seq++;
+            c->item = item;
+            c->pos = pos;
+            c->len = item->stored_length - pos > c->buf_size ?
+                     c->buf_size : (size_t) (item->stored_length - pos);
+            c->last = pos + c->len == item->stored_length;
+            c->end = 0;
+            stats_begin();
+            err = pread_full(pl->fd, c->buf, c->len, item->offset + pos);
+            stats_end_detail("read", item->filename, c->len);
+            progress_add(PROGRESS_READ, c->len);
+            if (err != 0) {
+                pthread_mutex_lock(&pl->lock);
+                pl->error = 1;
+                pthread_mutex_unlock(&pl->lock);
+                c->end = 1;
+                unpack_put(pl, c, UNPACK_CHUNK_READ);
+                return NULL;
+            }
+            pos += c->len;
+            unpack_put(pl, c, UNPACK_CHUNK_READ);
+        } while (pos < item->stored_length);
+    }
+
+    c = unpack_get(pl, seq, UNPACK_CHUNK_FREE);
+    c->seq = seq;
+    c->end = 1;
+    unpack_put(pl, c, UNPACK_CHUNK_READ);
+    return NULL;
+}
+
+static void *unpack_writer(void *arg) {
+    struct unpack_pipeline *pl = arg;
+    struct unpack_chunk *c;
+    uint64_t seq;
+    size_t written;
+    int ofd = -1, item_error = 0;
+
+    stats_thread_name("unpack writer");
+    for (seq = 0;; seq++) {
+        c = unpack_get(pl, seq, UNPACK_CHUNK_DECRYPTED);
+        if (c->end) {
+            unpack_put(pl, c, UNPACK_CHUNK_FREE);
+            break;
+        }
+
+        stats_begin();
+        written = 0;
+        if (c->pos == 0) {
+            /* Never write through a hardlink an older version put into the cache */
+            unlink(c->item->outfn);
+            item_error = 0;
+            ofd = open(c->item->outfn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (ofd < 0) {
+                O_ERR("Unable to create %s: %s\n", c->item->outfn, strerror(errno));
+                pthread_mutex_lock(&pl->lock);
+                pl->error = 1;
+                pthread_mutex_unlock(&pl->lock);
+            }
+            if (unpack_manifest)
+                sha256_init(&c->item->hash);
+        }
+        if (c->pos < c->item->original_length) {
+            uint64_t left = c->item->original_length - c->pos;
+            size_t len = left < c->len ? (size_t) left : c->len;
+
+            written = len;
+            /* hash the plaintext while it is still in cache */
+            if (unpack_manifest)
+                sha256_update(&c->item->hash, c->buf, len);
+            if (ofd >= 0 && write_full(ofd, c->buf, len) != 0) {
+                item_error = 1;
+                pthread_mutex_lock(&pl->lock);
+                pl->error = 1;
+                pthread_mutex_unlock(&pl->lock);
+            }
+        }
+        if (c->last) {
+            if (unpack_manifest) {
+                uint8_t digest[SHA256_DIGEST_LEN];
+
+                sha256_final(&c->item->hash, digest);
+                sha256_hex(digest, c->item->hex);
+            }
+            if (ofd >= 0) {
+                if (close(ofd) != 0) {
+                    O_ERR("Unable to write %s: %s\n", c->item->outfn, strerror(errno));
+                    item_error = 1;
+                    pthread_mutex_lock(&pl->lock);
+                    pl->error = 1;
+                    pthread_mutex_unlock(&pl->lock);
+                }
+                ofd = -1;
+                /* a short file must not be handed out from the cache again */
+                if (unpack_cache_dir != NULL && !item_error)
+                    cache_store(c->item->outfn, c->item->cachefn);
+            }
+        }
+        stats_end_detail("item_write", c->item->filename, written);
+        progress_add(PROGRESS_WRITE, written);
+        unpack_put(pl, c, UNPACK_CHUNK_FREE);
+    }
+
+    if (ofd >= 0)
+        close(ofd);
+    return NULL;
+}
+
+static int unpack_items(struct unpack_pipeline *pl) {
+    pthread_t reader, writer;
+    struct unpack_chunk *c;
+    uint64_t seq;
+    size_t i;
+    int end, ret = 0;
+
+    for (i = 0; i < pl->num_items; i++) {
+        if (pl->items[i].cached)
+            continue;
+        progress_expect(PROGRESS_READ, pl->items[i].stored_length);
+        progress_expect(PROGRESS_DECRYPT, pl->items[i].stored_length);
+        progress_expect(PROGRESS_WRITE, pl->items[i].original_length);
+    }
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+    if (pthread_create(&reader, NULL, unpack_reader, pl) != 0) {
+        ret = -1;
+        goto out;
+    }
+    if (pthread_create(&writer, NULL, unpack_writer, pl) != 0) {
+        /* let the reader run dry, it stops on the end marker */
+        for (seq = 0, end = 0; !end; seq++) {
+            c = unpack_get(pl, seq, UNPACK_CHUNK_READ);
+            end = c->end;
+            unpack_put(pl, c, UNPACK_CHUNK_FREE);
+        }
+        pthread_join(reader, NULL);
+        ret = -1;
+        goto out;
+    }
+
+    /* the slot may be reused as soon as it is handed on, so read end first */
+    for (seq = 0, end = 0; !end; seq++) {
+        c = unpack_get(pl, seq, UNPACK_CHUNK_READ);
+        end = c->end;
+        if (!end) {
+            stats_begin();
+            if (c->item->twofish)
+                tf_decrypt_inplace(c->buf, c->len, &filecontent_tf_ctx);
+            else
+                rc6_decrypt_inplace(c->buf, c->len, &filecontent_ctx);
+            stats_end_detail("decrypt", c->item->filename, c->len);
+            progress_add(PROGRESS_DECRYPT, c->len);
+        }
+        unpack_put(pl, c, UNPACK_CHUNK_DECRYPTED);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    if (pl->error)
+        ret = -1;
+out:
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->lock);
+    return ret;
+}
+
+/*
+ * The manifest lists one item per line, tab separated: sha256 of the
+ * plaintext, original length, maintype, subtype and filename.
+ */
+static int manifest_write(const struct unpack_pipeline *pl, const char *outdn, int is_absolute) {
+    FILE *mfp;
+    size_t i;
+
+    mfp = dir_fopen(outdn, UNPACK_MANIFEST_NAME, "wb", is_absolute);
+    if (mfp == NULL)
+        return -1;
+    fprintf(mfp, "%s\n", UNPACK_MANIFEST_MAGIC);
+    for (i = 0; i < pl->num_items; i++) {
+        const struct unpack_item *item = &pl->items[i];
+
+        fprintf(mfp, "%s\t%llu\t%.8s\t%.16s\t%s\n", item->hex,
+                (unsigned long long) item->original_length,
+                item->filehdr->maintype, item->filehdr->subtype, item->filename);
+    }
+    return fclose(mfp) != 0 ? -1 : 0;
+}
+
+struct manifest_entry {
+    char hex[SHA256_HEX_LEN];
+    unsigned long long length;
+    char maintype[IMAGEWTY_FHDR_MAINTYPE_LEN + 1];
+    char subtype[IMAGEWTY_FHDR_SUBTYPE_LEN + 1];
+    char filename[IMAGEWTY_FHDR_FILENAME_LEN + 1];
+    int seen;
+};
+
+/* Compare the unpacked items with a previous manifest, returns the number of differences */
+static int manifest_verify(const struct unpack_pipeline *pl, const char *path) {
+    struct manifest_entry *entries = NULL;
+    size_t count = 0, i, j;
+    char line[1024];
+    int bad = 0;
+    FILE *mfp;
+
+    mfp = fopen(path, "rb");
+    if (mfp == NULL) {
+        O_ERR("Cannot open manifest %s\n", path);
+        return 1;
+    }
+    if (fgets(line, sizeof(line), mfp) == NULL ||
+        strncmp(line, UNPACK_MANIFEST_MAGIC, strlen(UNPACK_MANIFEST_MAGIC)) != 0) {
+        O_ERR("%s is not a manifest\n", path);
+        fclose(mfp);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), mfp) != NULL) {
+        struct manifest_entry *e, *tmp;
+        char *field[5], *p = line;
+        int n;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        for (n = 0; n < 5 && p != NULL; n++) {
+            field[n] = p;
+            p = n < 4 ? strchr(p, '\t') : NULL;
+            if (p != NULL)
+                *p++ = '\0';
+        }
+        if (n < 5 || strlen(field[0]) != SHA256_HEX_LEN - 1)
+            continue;
+        tmp = realloc(entries, (count + 1) * sizeof(*entries));
+        if (tmp == NULL)
+            break;
+        entries = tmp;
+        e = &entries[count++];
+        memcpy(e->hex, field[0], SHA256_HEX_LEN);
+        e->length = strtoull(field[1], NULL, 10);
+        snprintf(e->maintype, sizeof(e->maintype), "%s", field[2]);
+        snprintf(e->subtype, sizeof(e->subtype), "%s", field[3]);
+        snprintf(e->filename, sizeof(e->filename), "%s", field[4]);
+        e->seen = 0;
+    }
+    fclose(mfp);
+
+    for (i = 0; i < pl->num_items; i++) {
+        const struct unpack_item *item = &pl->items[i];
+        char maintype[IMAGEWTY_FHDR_MAINTYPE_LEN + 1], subtype[IMAGEWTY_FHDR_SUBTYPE_LEN + 1];
+
+        /* the header fields are not NUL terminated when full */
+        snprintf(maintype, sizeof(maintype), "%.8s", item->filehdr->maintype);
+        snprintf(subtype, sizeof(subtype), "%.16s", item->filehdr->subtype);
+        for (j = 0; j < count; j++)
+            if (!entries[j].seen && strcmp(entries[j].filename, item->filename) == 0)
+                break;
+        if (j == count) {
+            O_ERR("%s is not in the manifest\n", item->filename);
+            bad++;
+            continue;
+        }
+        entries[j].seen = 1;
+        if (entries[j].length != item->original_length || strcmp(entries[j].hex, item->hex) != 0 ||
+            strcmp(entries[j].maintype, maintype) != 0 || strcmp(entries[j].subtype, subtype) != 0) {
+            O_ERR("%s does not match the manifest: %s %s %llu %s, expected %s %s %llu %s\n", item->filename,
+                  maintype, subtype, (unsigned long long) item->original_length, item->hex,
+                  entries[j].maintype, entries[j].subtype, entries[j].length, entries[j].hex);
+            bad++;
+        }
+    }
+    for (j = 0; j < count; j++) {
+        if (!entries[j].seen) {
+            O_ERR("%s is missing from the image\n", entries[j].filename);
+            bad++;
+        }
+    }
+    free(entries);
+
+    if (bad == 0)
+        O_LOG("All %zu items match the manifest\n", pl->num_items);
+    return bad;
+}
+
+int unpack_image(const char *infn, const char *outdn, int is_absolute) {
+    uint32_t pid, vid, hardware_id, firmware_id;
+    struct unpack_pipeline pl;
+    struct imagewty_header *header;
+    struct image_table t;
+    FILE *cfp;
+    uint32_t num_files;
+    uint32_t cache_hits = 0, cache_misses = 0;
+    size_t i;
+    int ret = 0;
+
+    memset(&pl, 0, sizeof(pl));
     O_LOG("Decrypting IMG header...\n");
-    curr = rc6_decrypt_inplace(image, 1024, &header_ctx);
+    ret = image_open(infn, &t);
+    if (ret != 0)
+        return ret;
+    pl.fd = t.fd;
+    header = t.header;
+    num_files = t.num_files;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(pl.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
     /* Check version of header and setup our local state */
     O_LOG("IMG version is: 0x%0x\n", header->header_version);
     if (header->header_version == 0x0300) {
-        num_files = header->v3.num_files;
         hardware_id = header->v3.hardware_id;
         firmware_id = header->v3.firmware_id;
         pid = header->v3.pid;
         vid = header->v3.vid;
-    } else if (header->header_version == 0x0100) {
-        num_files = header->v1.num_files;
+    } else {
         hardware_id = header->v1.hardware_id;
         firmware_id = header->v1.firmware_id;
         pid = header->v1.pid;
         vid = header->v1.vid;
-    } else {
-        return 5;
     }
 
-    /* Decrypt file headers */
-    curr = rc6_decrypt_inplace(curr, num_files * 1024, &fileheaders_ctx);
-
-    /* Decrypt file contents */
-    O_LOG("Decrypting IMG file contents...\n");
-    for (i = 0; i < num_files; i++) {
-        struct imagewty_file_header *filehdr;
-        uint64_t stored_length;
-        void *next;
-
-        filehdr = (struct imagewty_file_header *) (image + 1024 + (i * 1024));
-        if (header->header_version == 0x0300) {
-            stored_length = filehdr->v3.stored_length;
-        } else {
-            stored_length = filehdr->v1.stored_length;
+    pl.items = calloc(num_files ? num_files : 1, sizeof(*pl.items));
+    if (!pl.items) {
+        ret = 4;
+        goto out;
+    }
+    for (i = 0; i < UNPACK_RING_SIZE; i++) {
+        pl.ring[i].buf_size = buffer_pool_budget() / UNPACK_RING_SIZE;
+        if (pl.ring[i].buf_size > UNPACK_CHUNK_SIZE)
+            pl.ring[i].buf_size = UNPACK_CHUNK_SIZE;
+        pl.ring[i].buf = buffer_pool_get(&pl.ring[i].buf_size, UNPACK_CHUNK_MIN_SIZE);
+        if (!pl.ring[i].buf) {
+            ret = 4;
+            goto out;
         }
-
-        next = rc6_decrypt_inplace(curr, stored_length, &filecontent_ctx);
-        curr = next;
     }
 
+    if (unpack_cache_dir != NULL)
+        recursive_mkdir(unpack_cache_dir);
+
     O_LOG("Writing the IMG config data...\n");
     cfp = dir_fopen(outdn, "image.cfg", "wb", is_absolute);
     if (cfp != NULL) {
@@ -230,33 +1098,72 @@ int unpack_image(const char *infn, const char *outdn, int is_absolute) {
         fputs("[FILELIST]\r\n", cfp);
     }
 
+    /*
+     * Items are RC6 (or Twofish) encrypted block by block, so each one can
+     * be decrypted on its own right before it is written. That is what lets
+     * the unpack cache skip the decryption of items that did not change.
+     */
+    O_LOG("Decrypting IMG file contents...\n");
     for (i = 0; i < num_files; i++) {
-        uint32_t original_length;
-        struct imagewty_file_header *filehdr;
+        struct unpack_item *item = &pl.items[i];
+        const struct imagewty_file_header *filehdr;
+        struct image_item info;
         const char *filename;
-        uint32_t offset;
+        char key[SHA256_HEX_LEN];
 
-        filehdr = (struct imagewty_file_header *) (image + 1024 + (i * 1024));
-        if (header->header_version == 0x0300) {
-            original_length = filehdr->v3.original_length;
-            filename = filehdr->v3.filename;
-            offset = filehdr->v3.offset;
-        } else {
-            original_length = filehdr->v1.original_length;
-            filename = filehdr->v1.filename;
-            offset = filehdr->v1.offset;
-        }
-        ofp = dir_fopen(outdn, filename, "wb", is_absolute);
-        if (ofp) {
-            fwrite(image + offset, original_length, 1, ofp);
-            fclose(ofp);
+        filehdr = image_file_header(&t, i);
+        image_item(&t, i, &info);
+        filename = info.filename;
+        item->stored_length = info.stored_length;
+        item->original_length = info.original_length;
+        item->offset = info.offset;
+        item->filehdr = filehdr;
+        item->filename = filename;
+        item->twofish = item_uses_twofish(filename);
+        dir_path(item->outfn, outdn, filename, is_absolute);
+        pl.num_items++;
+
+        if (unpack_cache_dir != NULL) {
+            /* hashing reads the item once more, the page cache usually has it */
+            if (cache_key(filehdr, header->header_version, item->twofish, pl.fd, item->offset, item->stored_length,
+                          item->original_length, pl.ring[0].buf, pl.ring[0].buf_size, key) != 0) {
+                ret = 6;
+                break;
+            }
+            snprintf(item->cachefn, sizeof(item->cachefn), "%s/%s", unpack_cache_dir, key);
+            if (cache_restore(item->cachefn, item->outfn, item->original_length) == 0) {
+                /* not decrypted, so the manifest digest comes from the restored file */
+                if (unpack_manifest &&
+                    hash_file(item->outfn, pl.ring[0].buf, pl.ring[0].buf_size, item->hex) != 0) {
+                    ret = 6;
+                    break;
+                }
+                item->cached = 1;
+                cache_hits++;
+            } else {
+                cache_misses++;
+            }
         }
 
-        fprintf(cfp, "\t{filename = INPUT_DIR .. \"%s\", maintype = \"%.8s\", subtype = \"%.16s\",},\r\n",
-                filename[0] == '/' ? filename + 1 : filename,
-                filehdr->maintype, filehdr->subtype);
+        if (cfp != NULL)
+            fprintf(cfp, "\t{filename = INPUT_DIR .. \"%s\", maintype = \"%.8s\", subtype = \"%.16s\",},\r\n",
+                    filename[0] == '/' ? filename + 1 : filename,
+                    filehdr->maintype, filehdr->subtype);
+    }
+
+    if (ret == 0 && unpack_items(&pl) != 0)
+        ret = 6;
+
+    if (ret == 0 && unpack_manifest) {
+        if (manifest_write(&pl, outdn, is_absolute) != 0)
+            ret = 6;
+        else if (unpack_verify_manifest != NULL && manifest_verify(&pl, unpack_verify_manifest) != 0)
+            ret = 7;
     }
 
+    if (unpack_cache_dir != NULL)
+        O_LOG("Unpack cache: %u unchanged, %u decrypted\n", cache_hits, cache_misses);
+
     if (cfp != NULL) {
         /* Now print the relevant stuff for the image.cfg */
         fputs("\r\n[IMAGE_CFG]\r\n", cfp);
@@ -275,5 +1182,702 @@ int unpack_image(const char *infn, const char *outdn, int is_absolute) {
         fputs("filelist = FILELIST\r\n", cfp);
         fclose(cfp);
     }
+
+out:
+    for (i = 0; i < UNPACK_RING_SIZE; i++)
+        buffer_pool_put(pl.ring[i].buf);
+    free(pl.items);
+    image_close(&t);
+    return ret;
+}
+
+/*
+ * Packing runs the unpack pipeline the other way around: a reader thread
+ * fills chunks from the item sources, a pool of worker threads encrypts
+ * them and a writer thread writes them to the image in order. RC6 works on
+ * independent 16 byte blocks, so chunks can be encrypted in any order and
+ * the workers keep every core busy. The item table is only written once
+ * every item has been placed.
+ */
+#define PACK_ALIGN          1024
+#define PACK_MAX_WORKERS    16
+
+#define PACK_ALIGN_UP(x)    (((x) + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1))
+
+struct pack_item {
+    char path[512];     /* opened by the reader when there is no fd or data */
+    char filename[IMAGEWTY_FHDR_FILENAME_LEN];
+    char maintype[IMAGEWTY_FHDR_MAINTYPE_LEN + 1];
+    char subtype[IMAGEWTY_FHDR_SUBTYPE_LEN + 1];
+    int fd;
+    const uint8_t *data;
+    uint64_t src_offset;
+    uint64_t length;    /* bytes to take from the source */
+    int trim;
+    /* filled in by the reader */
+    uint64_t offset;
+    uint64_t stored_length;
+    uint64_t original_length;
+};
+
+enum pack_chunk_state {
+    PACK_CHUNK_FREE,
+    PACK_CHUNK_READ,
+    PACK_CHUNK_ENCRYPTED,
+};
+
+struct pack_chunk {
+    enum pack_chunk_state state;
+    uint64_t seq;
+    uint64_t offset;    /* position of this chunk inside the image */
+    uint64_t zeros;     /* zero bytes in front of the data, see pack_write_zeros() */
+    size_t len;
+    int end;            /* nothing follows, the worker that sees it stops */
+    uint8_t *buf;
+    size_t buf_size;
+};
+
+struct pack_pipeline {
+    int fd;
+    struct pack_item *items;
+    size_t num_items;
+    uint64_t size;      /* end of the data written so far */
+    struct pack_chunk *ring;
+    size_t ring_size;
+    unsigned workers;
+    uint64_t next_seq;  /* next chunk a worker picks up */
+    uint8_t *zero_buf;  /* encrypted zeros */
+    size_t zero_size;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int error;
+    int too_large;      /* the data went past what a v1 image can address */
+};
+
+static struct pack_chunk *pack_get(struct pack_pipeline *pl, uint64_t seq, enum pack_chunk_state state) {
+    struct pack_chunk *c = &pl->ring[seq % pl->ring_size];
+
+    pthread_mutex_lock(&pl->lock);
+    if (state == PACK_CHUNK_FREE) {
+        while (c->state != PACK_CHUNK_FREE)
+            pthread_cond_wait(&pl->cond, &pl->lock);
+    } else {
+        while (c->state != state || c->seq != seq)
+            pthread_cond_wait(&pl->cond, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return c;
+}
+
+static void pack_put(struct pack_pipeline *pl, struct pack_chunk *c, enum pack_chunk_state state) {
+    pthread_mutex_lock(&pl->lock);
+    c->state = state;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static void pack_fail(struct pack_pipeline *pl) {
+    pthread_mutex_lock(&pl->lock);
+    pl->error = 1;
+    pthread_mutex_unlock(&pl->lock);
+}
+
+static int pack_failed(struct pack_pipeline *pl) {
+    int error;
+
+    pthread_mutex_lock(&pl->lock);
+    error = pl->error;
+    pthread_mutex_unlock(&pl->lock);
+    return error;
+}
+
+static void rc6_encrypt_inplace(void *p, size_t len, rc6_ctx_t *ctx) {
+    size_t i;
+
+    if (!pack_encrypt)
+        return;
+    for (i = 0; i + 16 <= len; i += 16)
+        rc6_enc((uint8_t *) p + i, ctx);
+}
+
+static int is_zero(const uint8_t *buf, size_t len) {
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+/* Queue one end marker per worker from seq on, each worker stops at the first it sees */
+static void pack_end(struct pack_pipeline *pl, uint64_t seq) {
+    struct pack_chunk *c;
+    unsigned w;
+
+    for (w = 0; w < pl->workers; w++) {
+        c = pack_get(pl, seq, PACK_CHUNK_FREE);
+        c->seq = seq++;
+        c->len = 0;
+        c->zeros = 0;
+        c->end = 1;
+        pack_put(pl, c, PACK_CHUNK_READ);
+    }
+}
+
+/* Bytes of a hole in the source at pos, PACK_ALIGN aligned, 0 if there is data or no hole support */
+static uint64_t pack_hole(const struct pack_item *item, int fd, uint64_t pos) {
+#ifdef SEEK_DATA
+    off_t data = lseek(fd, (off_t) (item->src_offset + pos), SEEK_DATA);
+    uint64_t hole;
+
+    if (data < 0)
+        return errno == ENXIO ? item->length - pos : 0;
+    hole = (uint64_t) data - (item->src_offset + pos);
+    if (hole > item->length - pos)
+        hole = item->length - pos;
+    return hole & ~(uint64_t) (PACK_ALIGN - 1);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Items marked trim are partitions read from a card: chunks of zeros are
+ * not queued but counted, and only written (as encrypted zeros) once data
+ * follows them. Zeros at the end of an item are left out of the image.
+ */
+static void *pack_reader(void *arg) {
+    struct pack_pipeline *pl = arg;
+    struct pack_chunk *c = NULL;
+    uint64_t seq = 0, pos, zeros, hole;
+    size_t i, len, padded;
+    int fd, err;
+
+    stats_thread_name("pack reader");
+    for (i = 0; i < pl->num_items; i++) {
+        struct pack_item *item = &pl->items[i];
+
+        item->offset = pl->size;
+        fd = item->fd;
+        if (item->data == NULL && fd < 0 && item->length) {
+            fd = open(item->path, O_RDONLY);
+            if (fd < 0) {
+                O_ERR("Unable to open %s\n", item->path);
+                pack_fail(pl);
+                goto end;
+            }
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        }
+
+        for (pos = 0, zeros = 0; pos < item->length; pos += len) {
+            if (item->trim && fd >= 0 && (hole = pack_hole(item, fd, pos)) != 0) {
+                zeros += hole;
+                len = hole;
+                progress_add(PROGRESS_READ, hole);
+                continue;
+            }
+            /* a slot that only held zeros is still ours, reuse it */
+            if (c == NULL)
+                c = pack_get(pl, seq, PACK_CHUNK_FREE);
+            len = item->length - pos > c->buf_size ? c->buf_size : (size_t) (item->length - pos);
+            err = 0;
+            stats_begin();
+            if (item->data != NULL)
+                memcpy(c->buf, item->data + pos, len);
+            else
+                err = pread_full(fd, c->buf, len, item->src_offset + pos);
+            stats_end_detail("item_read", item->filename, len);
+            progress_add(PROGRESS_READ, len);
+            if (err != 0) {
+                O_ERR("Unable to read %s\n", item->path[0] ? item->path : item->filename);
+                pack_fail(pl);
+                if (fd != item->fd)
+                    close(fd);
+                goto end;
+            }
+            if (item->trim && is_zero(c->buf, len)) {
+                zeros += len;
+                continue;
+            }
+
+            /* the tail up to the next PACK_ALIGN boundary is zero padding */
+            padded = (size_t) PACK_ALIGN_UP(len);
+            if (pack_header_version == 0x0100 && pl->size + zeros + padded > UINT32_MAX) {
+                pl->too_large = 1;
+                pack_fail(pl);
+                if (fd != item->fd)
+                    close(fd);
+                goto end;
+            }
+            memset(c->buf + len, 0, padded - len);
+            c->seq = seq++;
+            c->offset = pl->size;
+            c->zeros = zeros;
+            c->len = padded;
+            c->end = 0;
+            pl->size += zeros + padded;
+            item->original_length = pos + len;
+            item->stored_length = pl->size - item->offset;
+            zeros = 0;
+            pack_put(pl, c, PACK_CHUNK_READ);
+            c = NULL;
+        }
+        /* trailing zeros are left out, count them as done so the stages reach their totals */
+        if (zeros) {
+            progress_add(PROGRESS_ENCRYPT, zeros);
+            progress_add(PROGRESS_WRITE, zeros);
+        }
+        if (fd >= 0 && fd != item->fd)
+            close(fd);
+    }
+
+end:
+    pack_end(pl, seq);
+    return NULL;
+}
+
+static void *pack_worker(void *arg) {
+    struct pack_pipeline *pl = arg;
+    struct pack_chunk *c;
+    uint64_t seq;
+    int end;
+
+    stats_thread_name("pack worker");
+    do {
+        pthread_mutex_lock(&pl->lock);
+        seq = pl->next_seq++;
+        pthread_mutex_unlock(&pl->lock);
+
+        c = pack_get(pl, seq, PACK_CHUNK_READ);
+        end = c->end;
+        stats_begin();
+        rc6_encrypt_inplace(c->buf, c->len, &filecontent_ctx);
+        stats_end("encrypt", c->len);
+        /* the zeros in front come encrypted from zero_buf */
+        if (!end)
+            progress_add(PROGRESS_ENCRYPT, c->zeros + c->len);
+        pack_put(pl, c, PACK_CHUNK_ENCRYPTED);
+    } while (!end);
+    return NULL;
+}
+
+/* RC6 turns every zero block into the same 16 bytes, so zero runs need no worker */
+static int pack_write_zeros(struct pack_pipeline *pl, uint64_t offset, uint64_t len) {
+    while (len) {
+        size_t n = len > pl->zero_size ? pl->zero_size : (size_t) len;
+
+        if (pwrite_full(pl->fd, pl->zero_buf, n, offset) != 0)
+            return -1;
+        offset += n;
+        len -= n;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+static void *pack_writer(void *arg) {
+    struct pack_pipeline *pl = arg;
+    struct pack_chunk *c;
+    uint64_t seq;
+    int end;
+
+    stats_thread_name("pack writer");
+    for (seq = 0;; seq++) {
+        c = pack_get(pl, seq, PACK_CHUNK_ENCRYPTED);
+        end = c->end;
+        stats_begin();
+        if (!end && !pack_failed(pl) &&
+            ((c->zeros && pack_write_zeros(pl, c->offset, c->zeros) != 0) ||
+             pwrite_full(pl->fd, c->buf, c->len, c->offset + c->zeros) != 0))
+            pack_fail(pl);
+        stats_end("image_write", c->zeros + c->len);
+        if (!end)
+            progress_add(PROGRESS_WRITE, c->zeros + c->len);
+        pack_put(pl, c, PACK_CHUNK_FREE);
+        if (end)
+            break;
+    }
+    return NULL;
+}
+
+static int pack_items(struct pack_pipeline *pl) {
+    pthread_t reader, writer, workers[PACK_MAX_WORKERS];
+    unsigned started, w;
+    size_t i;
+    int ret = 0;
+
+    /* encrypt and write also count the padding, so they may end a bit above */
+    for (i = 0; i < pl->num_items; i++) {
+        progress_expect(PROGRESS_READ, pl->items[i].length);
+        progress_expect(PROGRESS_ENCRYPT, pl->items[i].length);
+        progress_expect(PROGRESS_WRITE, pl->items[i].length);
+    }
+
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->cond, NULL);
+    for (started = 0; started < pl->workers; started++) {
+        if (pthread_create(&workers[started], NULL, pack_worker, pl) != 0)
+            break;
+    }
+    /* fewer workers just means fewer end markers */
+    pl->workers = started;
+    if (started == 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (pthread_create(&writer, NULL, pack_writer, pl) != 0) {
+        /* stop the workers, nothing consumes what they encrypt */
+        pack_end(pl, 0);
+        ret = -1;
+    } else {
+        if (pthread_create(&reader, NULL, pack_reader, pl) != 0) {
+            pack_fail(pl);
+            pack_end(pl, 0);
+        } else {
+            pthread_join(reader, NULL);
+        }
+        pthread_join(writer, NULL);
+    }
+    for (w = 0; w < started; w++)
+        pthread_join(workers[w], NULL);
+    if (pl->error)
+        ret = -1;
+out:
+    pthread_cond_destroy(&pl->cond);
+    pthread_mutex_destroy(&pl->lock);
+    return ret;
+}
+
+/* Encrypt and write the image header and file header table for the placed items */
+static int pack_write_headers(const struct pack_pipeline *pl, const struct imagewty_ids *ids) {
+    struct imagewty_header *header;
+    uint8_t *headers;
+    size_t i;
+    int ret = 0;
+
+    headers = calloc(pl->num_items + 1, 1024);
+    if (headers == NULL)
+        return 4;
+    header = (struct imagewty_header *) headers;
+    memcpy(header->magic, IMAGEWTY_MAGIC, IMAGEWTY_MAGIC_LEN);
+    header->header_version = pack_header_version;
+    header->ram_base = 0x04D00000;
+    header->version = ids->version;
+    header->image_size = (uint32_t) pl->size;
+    if (pack_header_version == 0x0300) {
+        header->header_size = 0x60;
+        header->image_size_hi = (uint32_t) (pl->size >> 32);
+        header->v3.unknown = 1024;
+        header->v3.pid = ids->pid;
+        header->v3.vid = ids->vid;
+        header->v3.hardware_id = ids->hardware_id;
+        header->v3.firmware_id = ids->firmware_id;
+        header->v3.val1 = 1;
+        header->v3.val1024 = 1024;
+        header->v3.num_files = (uint32_t) pl->num_items;
+        header->v3.val1024_2 = 1024;
+    } else {
+        header->header_size = 0x50;
+        header->v1.pid = ids->pid;
+        header->v1.vid = ids->vid;
+        header->v1.hardware_id = ids->hardware_id;
+        header->v1.firmware_id = ids->firmware_id;
+        header->v1.val1 = 1;
+        header->v1.val1024 = 1024;
+        header->v1.num_files = (uint32_t) pl->num_items;
+        header->v1.val1024_2 = 1024;
+    }
+    for (i = 0; i < pl->num_items; i++) {
+        struct imagewty_file_header *filehdr = (struct imagewty_file_header *) (headers + 1024 + i * 1024);
+        const struct pack_item *item = &pl->items[i];
+
+        filehdr->filename_len = IMAGEWTY_FHDR_FILENAME_LEN;
+        filehdr->total_header_size = 1024;
+        memcpy((char *) filehdr->maintype, item->maintype, strlen(item->maintype));
+        memcpy((char *) filehdr->subtype, item->subtype, strlen(item->subtype));
+        if (pack_header_version == 0x0300) {
+            strcpy((char *) filehdr->v3.filename, item->filename);
+            filehdr->v3.stored_length = (uint32_t) item->stored_length;
+            filehdr->v3.stored_length_hi = (uint32_t) (item->stored_length >> 32);
+            filehdr->v3.original_length = (uint32_t) item->original_length;
+            filehdr->v3.original_length_hi = (uint32_t) (item->original_length >> 32);
+            filehdr->v3.offset = (uint32_t) item->offset;
+            filehdr->v3.offset_hi = (uint32_t) (item->offset >> 32);
+        } else {
+            strcpy((char *) filehdr->v1.filename, item->filename);
+            filehdr->v1.stored_length = (uint32_t) item->stored_length;
+            filehdr->v1.original_length = (uint32_t) item->original_length;
+            filehdr->v1.offset = (uint32_t) item->offset;
+        }
+    }
+    rc6_encrypt_inplace(headers, 1024, &header_ctx);
+    rc6_encrypt_inplace(headers + 1024, pl->num_items * 1024, &fileheaders_ctx);
+
+    if (pwrite_full(pl->fd, headers, (pl->num_items + 1) * 1024, 0) != 0)
+        ret = 6;
+    free(headers);
+    return ret;
+}
+
+static int pack_run(struct pack_pipeline *pl, const struct imagewty_ids *ids, const char *outfn) {
+    uint64_t max_slots;
+    size_t i;
+    long cpus;
+    int ret = 0;
+
+    pl->size = 1024 + (uint64_t) pl->num_items * 1024;
+    /*
+     * v1 has no high words for sizes and offsets, refuse before writing
+     * anything. Trimmed items may end up smaller, the reader stops at the
+     * limit for those.
+     */
+    if (pack_header_version == 0x0100) {
+        uint64_t total = pl->size;
+
+        for (i = 0; i < pl->num_items; i++)
+            if (!pl->items[i].trim)
+                total += PACK_ALIGN_UP(pl->items[i].length);
+        if (total > UINT32_MAX) {
+            O_ERR("%s would be %llu bytes, too large for a v1 image\n", outfn, (unsigned long long) total);
+            return 3;
+        }
+    }
+    pl->fd = open(outfn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pl->fd < 0) {
+        O_ERR("Unable to create %s\n", outfn);
+        return 2;
+    }
+
+    /* two chunks per worker keep them busy while the reader and writer catch up */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pl->workers = cpus < 1 ? 1 : cpus > PACK_MAX_WORKERS ? PACK_MAX_WORKERS : (unsigned) cpus;
+    max_slots = buffer_pool_budget() / UNPACK_CHUNK_MIN_SIZE;
+    if (max_slots < 2 * pl->workers + 2)
+        pl->workers = max_slots > 4 ? (unsigned) (max_slots - 2) / 2 : 1;
+    pl->ring_size = 2 * pl->workers + 2;
+    pl->ring = calloc(pl->ring_size, sizeof(*pl->ring));
+    pl->zero_size = UNPACK_CHUNK_MIN_SIZE;
+    pl->zero_buf = calloc(1, pl->zero_size);
+    if (pl->ring == NULL || pl->zero_buf == NULL) {
+        ret = 4;
+        goto out;
+    }
+    rc6_encrypt_inplace(pl->zero_buf, pl->zero_size, &filecontent_ctx);
+    for (i = 0; i < pl->ring_size; i++) {
+        pl->ring[i].buf_size = buffer_pool_budget() / pl->ring_size;
+        if (pl->ring[i].buf_size > UNPACK_CHUNK_SIZE)
+            pl->ring[i].buf_size = UNPACK_CHUNK_SIZE;
+        pl->ring[i].buf = buffer_pool_get(&pl->ring[i].buf_size, UNPACK_CHUNK_MIN_SIZE);
+        if (pl->ring[i].buf == NULL) {
+            ret = 4;
+            goto out;
+        }
+    }
+
+    O_LOG("%s %zu items with %u threads...\n", pack_encrypt ? "Encrypting" : "Writing", pl->num_items, pl->workers);
+    if (pack_items(pl) != 0) {
+        if (pl->too_large)
+            O_ERR("%s would be more than %llu bytes, too large for a v1 image\n", outfn,
+                  (unsigned long long) UINT32_MAX);
+        ret = pl->too_large ? 3 : 6;
+    } else {
+        ret = pack_write_headers(pl, ids);
+    }
+
+out:
+    if (pl->ring != NULL) {
+        for (i = 0; i < pl->ring_size; i++)
+            buffer_pool_put(pl->ring[i].buf);
+        free(pl->ring);
+    }
+    free(pl->zero_buf);
+    close(pl->fd);
+    /* do not leave a half written image behind */
+    if (ret != 0)
+        unlink(outfn);
+    return ret;
+}
+
+/* Copy the quoted value of key = "..." or key = INPUT_DIR .. "..." into out, 0 on success */
+static int cfg_string(const char *line, const char *key, char *out, size_t size) {
+    const char *p = strstr(line, key), *q;
+
+    if (p == NULL)
+        return -1;
+    p += strlen(key);
+    p += strspn(p, " \t");
+    if (*p++ != '=')
+        return -1;
+    p += strspn(p, " \t");
+    if (strncmp(p, "INPUT_DIR", 9) == 0) {
+        p += 9;
+        p += strspn(p, " \t");
+        if (strncmp(p, "..", 2) != 0)
+            return -1;
+        p += 2;
+        p += strspn(p, " \t");
+    }
+    if (*p != '"' || (q = strchr(p + 1, '"')) == NULL || (size_t) (q - p - 1) >= size)
+        return -1;
+    memcpy(out, p + 1, q - p - 1);
+    out[q - p - 1] = '\0';
+    return 0;
+}
+
+/* Make room for one more item, NULL when out of memory */
+static struct pack_item *pack_add_item(struct pack_pipeline *pl, size_t *capacity) {
+    struct pack_item *item;
+
+    if (pl->num_items == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 32;
+        item = realloc(pl->items, *capacity * sizeof(*item));
+        if (item == NULL)
+            return NULL;
+        pl->items = item;
+    }
+    item = &pl->items[pl->num_items];
+    memset(item, 0, sizeof(*item));
+    item->fd = -1;
+    return item;
+}
+
+/*
+ * Read the [FILELIST] and [IMAGE_CFG] sections of an image.cfg as written
+ * by unpack_image(). Item paths are relative to the directory of the cfg.
+ */
+static int pack_read_cfg(const char *cfgfn, struct pack_pipeline *pl, struct imagewty_ids *ids) {
+    char line[1024], dir[512], *p;
+    const char *section = "";
+    size_t capacity = 0;
+    FILE *cfp;
+    int ret = 0;
+
+    cfp = fopen(cfgfn, "r");
+    if (cfp == NULL) {
+        O_ERR("Unable to open %s\n", cfgfn);
+        return 2;
+    }
+    snprintf(dir, sizeof(dir), "%s", cfgfn);
+    p = strrchr(dir, '/');
+    if (p != NULL)
+        p[1] = '\0';
+    else
+        strcpy(dir, "./");
+
+    while (ret == 0 && fgets(line, sizeof(line), cfp) != NULL) {
+        if (line[0] == ';')
+            continue;
+        if (line[0] == '[') {
+            section = strncmp(line, "[FILELIST]", 10) == 0 ? "FILELIST" :
+                      strncmp(line, "[IMAGE_CFG]", 11) == 0 ? "IMAGE_CFG" : "";
+            continue;
+        }
+
+        if (strcmp(section, "FILELIST") == 0 && strstr(line, "filename") != NULL) {
+            struct pack_item *item = pack_add_item(pl, &capacity);
+
+            if (item == NULL) {
+                ret = 4;
+                break;
+            }
+            if (cfg_string(line, "filename", item->filename, sizeof(item->filename)) != 0 ||
+                cfg_string(line, "maintype", item->maintype, sizeof(item->maintype)) != 0 ||
+                cfg_string(line, "subtype", item->subtype, sizeof(item->subtype)) != 0) {
+                O_ERR("Unsupported item in %s: %s", cfgfn, line);
+                ret = 5;
+                break;
+            }
+            snprintf(item->path, sizeof(item->path), "%s%s", dir, item->filename);
+            pl->num_items++;
+        } else if (strcmp(section, "IMAGE_CFG") == 0) {
+            char key[32];
+            long long value;
+
+            if (sscanf(line, " %31[a-z] = %lli", key, &value) != 2)
+                continue;
+            if (strcmp(key, "version") == 0)
+                ids->version = (uint32_t) value;
+            else if (strcmp(key, "pid") == 0)
+                ids->pid = (uint32_t) value;
+            else if (strcmp(key, "vid") == 0)
+                ids->vid = (uint32_t) value;
+            else if (strcmp(key, "hardwareid") == 0)
+                ids->hardware_id = (uint32_t) value;
+            else if (strcmp(key, "firmwareid") == 0)
+                ids->firmware_id = (uint32_t) value;
+        }
+    }
+    fclose(cfp);
+
+    if (ret == 0 && pl->num_items == 0) {
+        O_ERR("No items listed in %s\n", cfgfn);
+        ret = 5;
+    }
+    return ret;
+}
+
+int pack_imagewty(const char *cfgfn, const char *outfn) {
+    struct pack_pipeline pl;
+    struct imagewty_ids ids;
+    struct stat st;
+    size_t i;
+    int ret;
+
+    memset(&pl, 0, sizeof(pl));
+    memset(&ids, 0, sizeof(ids));
+    O_LOG("Reading %s...\n", cfgfn);
+    ret = pack_read_cfg(cfgfn, &pl, &ids);
+    if (ret != 0)
+        goto out;
+
+    for (i = 0; i < pl.num_items; i++) {
+        struct pack_item *item = &pl.items[i];
+
+        if (stat(item->path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            O_ERR("Unable to open %s\n", item->path);
+            ret = 2;
+            goto out;
+        }
+        item->length = (uint64_t) st.st_size;
+    }
+    ret = pack_run(&pl, &ids, outfn);
+
+out:
+    free(pl.items);
+    return ret;
+}
+
+int pack_imagewty_sources(const struct pack_source *sources, size_t num_sources,
+                          const struct imagewty_ids *ids, const char *outfn) {
+    struct pack_pipeline pl;
+    size_t i, capacity = 0;
+    int ret;
+
+    memset(&pl, 0, sizeof(pl));
+    for (i = 0; i < num_sources; i++) {
+        const struct pack_source *src = &sources[i];
+        struct pack_item *item = pack_add_item(&pl, &capacity);
+
+        if (item == NULL) {
+            ret = 4;
+            goto out;
+        }
+        if (strlen(src->filename) >= sizeof(item->filename) || strlen(src->maintype) >= sizeof(item->maintype) ||
+            strlen(src->subtype) >= sizeof(item->subtype)) {
+            O_ERR("Item name too long: %s\n", src->filename);
+            ret = 5;
+            goto out;
+        }
+        strcpy(item->filename, src->filename);
+        strcpy(item->maintype, src->maintype);
+        strcpy(item->subtype, src->subtype);
+        item->fd = src->data != NULL ? -1 : src->fd;
+        item->data = src->data;
+        item->src_offset = src->offset;
+        item->length = src->length;
+        item->trim = src->trim;
+        pl.num_items++;
+    }
+    ret = pack_run(&pl, ids, outfn);
+
+out:
+    free(pl.items);
+    return ret;
+}
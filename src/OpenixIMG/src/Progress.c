@@ -0,0 +1,62 @@
+/*
+ * Progress.c Live byte counters of a conversion
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+#include <stdatomic.h>
+
+#include "Progress.h"
+
+/* Only the totals matter to the reader, relaxed ordering is enough */
+static _Atomic uint64_t progress_done_bytes[PROGRESS_STAGES];
+static _Atomic uint64_t progress_total_bytes[PROGRESS_STAGES];
+
+static const char *progress_names[PROGRESS_STAGES] = {
+        "read",
+        "decrypt",
+        "encrypt",
+        "write",
+        "insert",
+};
+
+void progress_reset(void) {
+    int i;
+
+    for (i = 0; i < PROGRESS_STAGES; i++) {
+        atomic_store_explicit(&progress_done_bytes[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&progress_total_bytes[i], 0, memory_order_relaxed);
+    }
+}
+
+void progress_expect(enum progress_stage stage, uint64_t bytes) {
+    atomic_fetch_add_explicit(&progress_total_bytes[stage], bytes, memory_order_relaxed);
+}
+
+void progress_add(enum progress_stage stage, uint64_t bytes) {
+    atomic_fetch_add_explicit(&progress_done_bytes[stage], bytes, memory_order_relaxed);
+}
+
+uint64_t progress_done(enum progress_stage stage) {
+    return atomic_load_explicit(&progress_done_bytes[stage], memory_order_relaxed);
+}
+
+uint64_t progress_total(enum progress_stage stage) {
+    return atomic_load_explicit(&progress_total_bytes[stage], memory_order_relaxed);
+}
+
+const char *progress_stage_name(enum progress_stage stage) {
+    return progress_names[stage];
+}
+
+void progress_insert_expect(uint64_t bytes) {
+    progress_expect(PROGRESS_INSERT, bytes);
+}
+
+void progress_insert_add(uint64_t bytes) {
+    progress_add(PROGRESS_INSERT, bytes);
+}
@@ -0,0 +1,338 @@
+/*
+ * Stats.c Per phase timing and byte counts of a conversion
+ * Copyright (c) 2022, YuzukiTsuru <GloomyGhost@GloomyGhost.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * See README and LICENSE for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "Stats.h"
+
+struct stats_phase {
+    char name[STATS_NAME_LEN];
+    uint64_t count;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t bytes;
+    long peak_rss_kb;
+};
+
+/* One stats_begin() / stats_end() pair for the trace */
+struct stats_span {
+    char name[STATS_NAME_LEN + 96];
+    char phase[STATS_NAME_LEN];
+    uint64_t start_ns;  /* since stats_enable_trace() */
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t bytes;
+    long tid;
+};
+
+struct stats_thread {
+    long tid;
+    char name[STATS_NAME_LEN];
+};
+
+#define STATS_MAX_THREADS   64
+
+/* Start times of the open phases of this thread */
+struct stats_frame {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static int stats_on;        /* collecting or tracing */
+static int stats_collect;
+static uint64_t stats_start_ns;
+static uint64_t stats_start_cpu_ns;
+static struct stats_phase stats_phases[STATS_MAX_PHASES];
+static size_t stats_num_phases;
+
+static int stats_tracing;
+static uint64_t trace_start_ns;
+static struct stats_span *trace_spans;
+static size_t trace_num_spans, trace_capacity;
+static struct stats_thread trace_threads[STATS_MAX_THREADS];
+static size_t trace_num_threads;
+
+static __thread struct stats_frame stats_stack[STATS_MAX_DEPTH];
+static __thread int stats_depth;
+static __thread long stats_tid;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/* ru_maxrss is in KiB on Linux */
+static long peak_rss_kb(void) {
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return ru.ru_maxrss;
+}
+
+static uint64_t process_cpu_ns(void) {
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return ((uint64_t) ru.ru_utime.tv_sec + (uint64_t) ru.ru_stime.tv_sec) * 1000000000ULL +
+           ((uint64_t) ru.ru_utime.tv_usec + (uint64_t) ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static long thread_id(void) {
+    if (stats_tid == 0)
+        stats_tid = (long) syscall(SYS_gettid);
+    return stats_tid;
+}
+
+void stats_enable(int enable) {
+    pthread_mutex_lock(&stats_lock);
+    stats_collect = enable;
+    stats_on = stats_collect || stats_tracing;
+    stats_num_phases = 0;
+    stats_start_ns = clock_ns(CLOCK_MONOTONIC);
+    stats_start_cpu_ns = process_cpu_ns();
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_enable_trace(int enable) {
+    pthread_mutex_lock(&stats_lock);
+    stats_tracing = enable;
+    stats_on = stats_collect || stats_tracing;
+    free(trace_spans);
+    trace_spans = NULL;
+    trace_num_spans = 0;
+    trace_capacity = 0;
+    trace_num_threads = 0;
+    trace_start_ns = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+int stats_enabled(void) {
+    return stats_on;
+}
+
+void stats_begin(void) {
+    struct stats_frame *f;
+
+    if (!stats_on)
+        return;
+    /* too deep nesting is counted but not timed */
+    if (stats_depth++ >= STATS_MAX_DEPTH)
+        return;
+    f = &stats_stack[stats_depth - 1];
+    f->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    f->wall_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+/* Called with stats_lock held, a span that does not fit is dropped */
+static void trace_add(const char *phase, const char *detail, const struct stats_frame *f,
+                      uint64_t wall, uint64_t cpu, uint64_t bytes) {
+    struct stats_span *span;
+
+    if (trace_num_spans == trace_capacity) {
+        size_t capacity = trace_capacity ? trace_capacity * 2 : 4096;
+
+        span = realloc(trace_spans, capacity * sizeof(*span));
+        if (span == NULL)
+            return;
+        trace_spans = span;
+        trace_capacity = capacity;
+    }
+    span = &trace_spans[trace_num_spans++];
+    if (detail != NULL && detail[0] != '\0')
+        snprintf(span->name, sizeof(span->name), "%s %s", phase, detail);
+    else
+        snprintf(span->name, sizeof(span->name), "%s", phase);
+    snprintf(span->phase, sizeof(span->phase), "%s", phase);
+    span->start_ns = f->wall_ns > trace_start_ns ? f->wall_ns - trace_start_ns : 0;
+    span->wall_ns = wall;
+    span->cpu_ns = cpu;
+    span->bytes = bytes;
+    span->tid = thread_id();
+}
+
+void stats_end(const char *phase, uint64_t bytes) {
+    stats_end_detail(phase, NULL, bytes);
+}
+
+void stats_end_detail(const char *phase, const char *detail, uint64_t bytes) {
+    struct stats_phase *p = NULL;
+    const struct stats_frame *f;
+    uint64_t wall, cpu;
+    long rss;
+    size_t i;
+
+    if (!stats_on || stats_depth == 0)
+        return;
+    if (stats_depth-- > STATS_MAX_DEPTH)
+        return;
+    f = &stats_stack[stats_depth];
+    wall = clock_ns(CLOCK_MONOTONIC) - f->wall_ns;
+    cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - f->cpu_ns;
+    rss = peak_rss_kb();
+
+    pthread_mutex_lock(&stats_lock);
+    if (stats_tracing)
+        trace_add(phase, detail, f, wall, cpu, bytes);
+    if (!stats_collect) {
+        pthread_mutex_unlock(&stats_lock);
+        return;
+    }
+    for (i = 0; i < stats_num_phases; i++) {
+        if (strncmp(stats_phases[i].name, phase, STATS_NAME_LEN - 1) == 0) {
+            p = &stats_phases[i];
+            break;
+        }
+    }
+    if (p == NULL && stats_num_phases < STATS_MAX_PHASES) {
+        p = &stats_phases[stats_num_phases++];
+        memset(p, 0, sizeof(*p));
+        snprintf(p->name, sizeof(p->name), "%s", phase);
+    }
+    if (p != NULL) {
+        p->count++;
+        p->wall_ns += wall;
+        p->cpu_ns += cpu;
+        p->bytes += bytes;
+        p->peak_rss_kb = rss;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_thread_name(const char *name) {
+    long tid;
+    size_t i;
+
+    if (!stats_tracing)
+        return;
+    tid = thread_id();
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < trace_num_threads && trace_threads[i].tid != tid; i++);
+    if (i < STATS_MAX_THREADS) {
+        trace_threads[i].tid = tid;
+        snprintf(trace_threads[i].name, sizeof(trace_threads[i].name), "%s", name);
+        if (i == trace_num_threads)
+            trace_num_threads++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* Item names and genimage commands may hold anything */
+static void json_string(FILE *fp, const char *str) {
+    const unsigned char *p;
+
+    fputc('"', fp);
+    for (p = (const unsigned char *) str; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            fprintf(fp, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(fp, "\\u%04x", *p);
+        else
+            fputc(*p, fp);
+    }
+    fputc('"', fp);
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t ns) {
+    return ns ? (double) bytes * 1e3 / (double) ns : 0;
+}
+
+int stats_write_json(const char *path) {
+    FILE *fp;
+    size_t i;
+    int ret;
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+
+    pthread_mutex_lock(&stats_lock);
+    fprintf(fp, "{\n"
+                "  \"version\": 1,\n"
+                "  \"wall_ns\": %llu,\n"
+                "  \"cpu_ns\": %llu,\n"
+                "  \"peak_rss_kb\": %ld,\n"
+                "  \"phases\": [\n",
+            (unsigned long long) (clock_ns(CLOCK_MONOTONIC) - stats_start_ns),
+            (unsigned long long) (process_cpu_ns() - stats_start_cpu_ns), peak_rss_kb());
+    for (i = 0; i < stats_num_phases; i++) {
+        const struct stats_phase *p = &stats_phases[i];
+
+        /* names are ours or genimage handler types, nothing to escape */
+        fprintf(fp, "    {\"name\": \"%s\", \"count\": %llu, \"wall_ns\": %llu, \"cpu_ns\": %llu, "
+                    "\"bytes\": %llu, \"mb_per_s\": %.1f, \"peak_rss_kb\": %ld}%s\n",
+                p->name, (unsigned long long) p->count, (unsigned long long) p->wall_ns,
+                (unsigned long long) p->cpu_ns, (unsigned long long) p->bytes, mb_per_s(p->bytes, p->wall_ns),
+                p->peak_rss_kb, i + 1 < stats_num_phases ? "," : "");
+    }
+    fprintf(fp, "  ]\n"
+                "}\n");
+    pthread_mutex_unlock(&stats_lock);
+
+    ret = ferror(fp) ? -1 : 0;
+    if (fclose(fp) != 0)
+        ret = -1;
+    return ret;
+}
+
+int stats_write_trace(const char *path) {
+    const char *sep = "";
+    FILE *fp;
+    long pid;
+    size_t i;
+    int ret;
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+
+    pid = (long) getpid();
+    pthread_mutex_lock(&stats_lock);
+    fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (i = 0; i < trace_num_threads; i++) {
+        fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %ld, \"tid\": %ld, \"args\": {\"name\": ",
+                sep, pid, trace_threads[i].tid);
+        json_string(fp, trace_threads[i].name);
+        fprintf(fp, "}}");
+        sep = ",\n";
+    }
+    /* complete events, timestamps and durations in microseconds */
+    for (i = 0; i < trace_num_spans; i++) {
+        const struct stats_span *span = &trace_spans[i];
+
+        fprintf(fp, "%s{\"name\": ", sep);
+        json_string(fp, span->name);
+        fprintf(fp, ", \"cat\": ");
+        json_string(fp, span->phase);
+        fprintf(fp, ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %ld, \"tid\": %ld, "
+                    "\"args\": {\"bytes\": %llu, \"cpu_us\": %.3f}}",
+                (double) span->start_ns / 1e3, (double) span->wall_ns / 1e3, pid, span->tid,
+                (unsigned long long) span->bytes, (double) span->cpu_ns / 1e3);
+        sep = ",\n";
+    }
+    fprintf(fp, "\n]}\n");
+    pthread_mutex_unlock(&stats_lock);
+
+    ret = ferror(fp) ? -1 : 0;
+    if (fclose(fp) != 0)
+        ret = -1;
+    return ret;
+}